@@ -72,6 +72,17 @@
     #include <initializer_list>
 #endif
 
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    #include <tuple>                        // for forward_as_tuple
+#endif
+
+#ifdef SPP_PARALLEL_RESIZE
+    #include <thread>                       // for set_resize_threads(), needs C++11
+    #include <vector>
+    #include <exception>
+    #include <atomic>
+#endif
+
 #if (SPP_GROUP_SIZE == 32)
     #define SPP_SHIFT_ 5
     #define SPP_MASK_  0x1F
@@ -131,6 +142,24 @@ struct cvt<const std::pair<const K, V> >
     #define MK_MOVE_IT(p) std::make_move_iterator(p)
 #endif
 
+//  ----------------------------------------------------------------------
+//              M E M O R Y    B U D G E T
+//  ----------------------------------------------------------------------
+// What a memory budget hook tells the table to do when an insert, or the
+// resize it triggers, would take it over its budget (see
+// sparse_hashtable::set_memory_budget())
+// ----------------------------------------------------------------------
+enum memory_budget_action
+{
+    budget_refuse,      // throw std::length_error, nothing is inserted
+    budget_evicted,     // the hook erased some items, check again
+    budget_allow        // go over the budget this time
+};
+
+// hook(ctx, used, needed): the table uses used bytes (see set_memory_budget()),
+// and the insert needs up to needed more
+typedef memory_budget_action (*memory_budget_hook)(void *ctx, size_t used, size_t needed);
+
 
 //  ----------------------------------------------------------------------
 //             I N T E R N A L    S T U F F
@@ -388,7 +417,8 @@ namespace sparsehash_internal
             set_shrink_factor(ht_empty_flt);
         }
 
-        size_t hash(const key_type& v) const
+        template <class K>
+        size_t hash(const K& v) const
         {
             size_t h = hasher::operator()(v);
             Mixer<size_t, sizeof(size_t)> mixer;
@@ -788,7 +818,8 @@ public:
     typedef T*             pointer;
     typedef T&             reference;
 
-    explicit Two_d_iterator(row_it curr) : row_current(curr), col_current(0)
+    explicit Two_d_iterator(row_it curr, row_it next = 0) :
+        row_current(curr), col_current(0), row_next(next)
     {
         if (row_current && !row_current->is_marked())
         {
@@ -797,13 +828,13 @@ public:
         }
     }
 
-    explicit Two_d_iterator(row_it curr, col_it col) : row_current(curr), col_current(col)
+    explicit Two_d_iterator(row_it curr, col_it col) : row_current(curr), col_current(col), row_next(0)
     {
         assert(col);
     }
 
     // The default constructor
-    Two_d_iterator() :  row_current(0), col_current(0) { }
+    Two_d_iterator() :  row_current(0), col_current(0), row_next(0) { }
 
     // Need this explicitly so we can convert normal iterators <=> const iterators
     // not explicit on purpose
@@ -811,7 +842,8 @@ public:
     template <class T2, class row_it2, class col_it2, class iter_type2>
     Two_d_iterator(const Two_d_iterator<T2, row_it2, col_it2, iter_type2>& it) :
         row_current (*(row_it *)&it.row_current),
-        col_current (*(col_it *)&it.col_current)
+        col_current (*(col_it *)&it.col_current),
+        row_next    (*(row_it *)&it.row_next)
     { }
 
     // The default destructor is fine; we don't define one
@@ -832,6 +864,11 @@ public:
             // end of current row
             // ------------------
             ++row_current;                                // go to beginning of next
+            if (row_current->is_marked() && row_next)
+            {
+                row_current = row_next;                   // go on with the next rows
+                row_next = 0;
+            }
             if (!row_current->is_marked())                // col is irrelevant at end
                 col_current = row_current->ne_begin();
             else
@@ -887,9 +924,12 @@ public:
 
     // Here's the info we actually need to be an iterator
     // These need to be public so we convert from iterator to const_iterator
+    // row_next, when set, is where the rows go on after row_end (the rows
+    // of the new table of an incremental resize, see sparse_hashtable).
     // ---------------------------------------------------------------------
     row_it row_current;
     col_it col_current;
+    row_it row_next;
 };
 
 
@@ -1031,8 +1071,214 @@ static inline uint32_t spp_popcount(uint64_t i)
 // called its "offset."
 // ---------------------------------------------------------------------------
 
-template <class T, class Alloc>
-class sparsegroup
+// The memory used by a table, as returned by memory_usage().  It does
+// not include the allocator's own overhead (see allocator_footprint()).
+// item_bytes counts the whole item arrays of the groups, slack_bytes the
+// part of them which is allocated ahead of inserts (see the growth
+// policies below), and given back by shrink_to_fit().  The erased
+// buckets do not hold any memory: the item is destroyed and its room in
+// the group released on erase, only a bit remembers the bucket for the
+// probe sequences.  There are num_erased of them, until purge_deleted().
+// ---------------------------------------------------------------------------
+struct memory_usage_info
+{
+    memory_usage_info() : group_bytes(0), item_bytes(0), slack_bytes(0), num_erased(0) {}
+
+    size_t total() const { return group_bytes + item_bytes; }
+
+    size_t group_bytes;      // the group array, one sparsegroup per SPP_GROUP_SIZE buckets
+    size_t item_bytes;       // the item arrays of the groups, slack included
+    size_t slack_bytes;      // room for items not inserted yet
+    size_t num_erased;       // erased buckets
+};
+
+// Growth policies for the item arrays of the groups: sizing(n) returns
+// how many items to allocate room for, when a group holds n items.  A
+// larger array means fewer reallocations on insert, but more memory.
+// The allocator of a table selects the policy with a growth_policy member
+// type (see spp::growth_allocator), otherwise it is default_growth, set by
+// SPP_ALLOC_SZ for all the tables.
+// ---------------------------------------------------------------------------
+
+// aggressive allocation first, then decreasing as sparsegroups fill up
+// (SPP_ALLOC_SZ == 0, the default)
+// --------------------------------------------------------------------
+struct aggressive_growth
+{
+    static uint32_t sizing(uint32_t n)
+    {
+        struct alloc_batch_size
+        {
+            // 32 bit bitmap
+            // ........ .... .... .. .. .. .. .  .  .  .  .  .  .  .
+            //     8     12   16  18 20 22 24 25 26   ...          32
+            // ------------------------------------------------------
+            SPP_CXX14_CONSTEXPR alloc_batch_size()
+                : data()
+            {
+                uint8_t group_sz          = SPP_GROUP_SIZE / 4;
+                uint8_t group_start_alloc = SPP_GROUP_SIZE / 8; //4;
+                uint8_t alloc_sz          = group_start_alloc;
+                for (int i=0; i<4; ++i)
+                {
+                    for (int j=0; j<group_sz; ++j)
+                    {
+                        if (j && j % group_start_alloc == 0)
+                            alloc_sz += group_start_alloc;
+                        data[i * group_sz + j] = alloc_sz;
+                    }
+                    if (group_start_alloc > 2)
+                        group_start_alloc /= 2;
+                    alloc_sz += group_start_alloc;
+                }
+            }
+            uint8_t data[SPP_GROUP_SIZE];
+        };
+
+        static alloc_batch_size s_alloc_batch_sz;
+        return n ? static_cast<uint32_t>(s_alloc_batch_sz.data[n-1]) : 0; // more aggressive alloc at the beginning
+    }
+};
+
+// use as little memory as possible - slowest insert/delete in table
+// (SPP_ALLOC_SZ == 1)
+// -----------------------------------------------------------------
+struct tight_growth
+{
+    static uint32_t sizing(uint32_t n) { return n; }
+};
+
+// rounds up to a multiple of N, which must be a power of two - a decent
+// compromise with N == 2 (SPP_ALLOC_SZ == N)
+// ---------------------------------------------------------------------
+template <uint32_t N>
+struct rounded_growth
+{
+    static uint32_t sizing(uint32_t n) { return (n + N - 1) & ~(N - 1); }
+};
+
+#if !defined(SPP_ALLOC_SZ) || (SPP_ALLOC_SZ == 0)
+    typedef aggressive_growth      default_growth;
+#elif (SPP_ALLOC_SZ == 1)
+    typedef tight_growth           default_growth;
+#else
+    typedef rounded_growth<SPP_ALLOC_SZ> default_growth;
+#endif
+
+// Optional per-bucket hash fingerprints, kept in the group next to the
+// bitmaps when the hasher asks for them (see spp_::use_fingerprints).  A
+// probe checks the fingerprint first, and only compares the keys when it
+// matches.  The default version is empty and costs nothing.
+// ---------------------------------------------------------------------------
+template <bool FP>
+class group_fingerprints
+{
+public:
+    void set_fingerprint(uint8_t , size_t )             {}
+    bool match_fingerprint(uint8_t , size_t ) const     { return true; }
+    void swap_fingerprints(group_fingerprints &)        {}
+    void copy_fingerprint(uint8_t , const group_fingerprints &, uint8_t ) {}
+};
+
+template <>
+class group_fingerprints<true>
+{
+public:
+    group_fingerprints()                                { memset(_fp, 0, sizeof(_fp)); }
+
+    void set_fingerprint(uint8_t i, size_t hashval)     { _fp[i] = _fingerprint(hashval); }
+    bool match_fingerprint(uint8_t i, size_t hashval) const { return _fp[i] == _fingerprint(hashval); }
+    void swap_fingerprints(group_fingerprints &o)       { std::swap_ranges(_fp, _fp + SPP_GROUP_SIZE, o._fp); }
+    void copy_fingerprint(uint8_t i, const group_fingerprints &o, uint8_t j) { _fp[i] = o._fp[j]; }
+
+private:
+    // the low bits of the hash select the bucket, and the high ones may be
+    // all zero with a weak hasher: fold the hash to 32 bits, and multiply
+    // by an odd constant, which carries every bit into the top byte
+    static uint8_t _fingerprint(size_t hashval)
+    {
+        const uint32_t h = static_cast<uint32_t>(hashval ^ (hashval >> (sizeof(size_t) * 4)));
+        return static_cast<uint8_t>((h * static_cast<uint32_t>(0x9E3779B1UL)) >> 24);
+    }
+
+    uint8_t _fp[SPP_GROUP_SIZE];
+};
+
+// Optional per-bucket distances from the item to its home bucket, kept in
+// the group next to the bitmaps with robin_hood_probing, so that probing
+// doesn't hash the keys it passes.  A distance which doesn't fit in a
+// byte is stored as far_distance, and the key is hashed to find it.  The
+// default version is empty and costs nothing.
+// ---------------------------------------------------------------------------
+template <bool RH>
+class group_distances
+{
+public:
+    enum { far_distance = 255 };
+
+    void   set_distance(uint8_t , size_t )              {}
+    size_t distance(uint8_t ) const                     { return far_distance; }
+    void   swap_distances(group_distances &)            {}
+    void   copy_distance(uint8_t , const group_distances &, uint8_t ) {}
+};
+
+template <>
+class group_distances<true>
+{
+public:
+    enum { far_distance = 255 };
+
+    group_distances()                                   { memset(_dist, 0, sizeof(_dist)); }
+
+    void   set_distance(uint8_t i, size_t d)            { _dist[i] = d < far_distance ? (uint8_t)d : (uint8_t)far_distance; }
+    size_t distance(uint8_t i) const                    { return _dist[i]; }
+    void   swap_distances(group_distances &o)           { std::swap_ranges(_dist, _dist + SPP_GROUP_SIZE, o._dist); }
+    void   copy_distance(uint8_t i, const group_distances &o, uint8_t j) { _dist[i] = o._dist[j]; }
+
+private:
+    uint8_t _dist[SPP_GROUP_SIZE];
+};
+
+// Optional version counter, in each group and in the hashtable, for the
+// lookups which run while a writer changes the table (see
+// spp_optimistic.h).  The writer makes it odd while it changes the group,
+// or the table layout, and readers read again when it moved.  The default
+// version is empty and costs nothing.
+// ---------------------------------------------------------------------------
+template <bool V>
+class version_counter
+{
+public:
+    bool     begin_write()                 { return false; }
+    void     end_write()                   {}
+    uint32_t read_begin() const            { return 0; }
+    bool     read_validate(uint32_t) const { return true; }
+};
+
+template <>
+class version_counter<true>;    // defined in spp_optimistic.h
+
+// Makes a version counter odd for its lifetime, unless it already is (the
+// changes of a group may be nested, the outer one counts)
+template <class C>
+class version_guard
+{
+public:
+    explicit version_guard(C &c) : _c(c), _own(c.begin_write()) {}
+    ~version_guard() { if (_own) _c.end_write(); }
+
+private:
+    version_guard(const version_guard &);
+    version_guard &operator=(const version_guard &);
+
+    C    &_c;
+    bool  _own;
+};
+
+template <class T, class Alloc, bool FP = false, bool RH = false>
+class sparsegroup : public group_fingerprints<FP>,
+                    public group_distances<RH>,
+                    public version_counter<spp_::use_versions<Alloc>::value>
 {
 public:
     // Basic types
@@ -1045,6 +1291,12 @@ public:
 
     typedef uint8_t                                        size_type;        // max # of buckets
 
+    typedef typename spp_::growth_policy<allocator_type, default_growth>::type growth_type;
+
+    // see version_counter, each change of the group is done with a write_guard
+    typedef version_counter<spp_::use_versions<allocator_type>::value> version_type;
+    typedef version_guard<version_type>                    write_guard;
+
     // These are our special iterators, that go over non-empty buckets in a
     // group.  These aren't const-only because you can change non-empty bcks.
     // ---------------------------------------------------------------------
@@ -1088,52 +1340,10 @@ private:
     { return !!((_bitmap | _bm_erased) & (static_cast<group_bm_type>(1) << i)); }
 
 
+    // how many items to allocate room for, to hold n items
     static uint32_t _sizing(uint32_t n)
     {
-#if !defined(SPP_ALLOC_SZ) || (SPP_ALLOC_SZ == 0)
-        // aggressive allocation first, then decreasing as sparsegroups fill up
-        // --------------------------------------------------------------------
-        struct alloc_batch_size
-        {
-            // 32 bit bitmap
-            // ........ .... .... .. .. .. .. .  .  .  .  .  .  .  .
-            //     8     12   16  18 20 22 24 25 26   ...          32
-            // ------------------------------------------------------
-            SPP_CXX14_CONSTEXPR alloc_batch_size()
-                : data()
-            {
-                uint8_t group_sz          = SPP_GROUP_SIZE / 4;
-                uint8_t group_start_alloc = SPP_GROUP_SIZE / 8; //4;
-                uint8_t alloc_sz          = group_start_alloc;
-                for (int i=0; i<4; ++i)
-                {
-                    for (int j=0; j<group_sz; ++j)
-                    {
-                        if (j && j % group_start_alloc == 0)
-                            alloc_sz += group_start_alloc;
-                        data[i * group_sz + j] = alloc_sz;
-                    }
-                    if (group_start_alloc > 2)
-                        group_start_alloc /= 2;
-                    alloc_sz += group_start_alloc;
-                }
-            }
-            uint8_t data[SPP_GROUP_SIZE];
-        };
-
-        static alloc_batch_size s_alloc_batch_sz;
-        return n ? static_cast<uint32_t>(s_alloc_batch_sz.data[n-1]) : 0; // more aggressive alloc at the beginning
-
-#elif (SPP_ALLOC_SZ == 1)
-        // use as little memory as possible - slowest insert/delete in table
-        // -----------------------------------------------------------------
-        return n;
-#else
-        // decent compromise when SPP_ALLOC_SZ == 2
-        // ----------------------------------------
-        static size_type sz_minus_1 = SPP_ALLOC_SZ - 1;
-        return (n + sz_minus_1) & ~sz_minus_1;
-#endif
+        return growth_type::sizing(n);
     }
 
     pointer _allocate_group(allocator_type &alloc, uint32_t n /* , bool tight = false */)
@@ -1229,6 +1439,7 @@ public:
     }
 
     sparsegroup(const sparsegroup& x) :
+        group_fingerprints<FP>(x), group_distances<RH>(x), version_type(),
         _group(0), _bitmap(x._bitmap), _bm_erased(x._bm_erased)
     {
         _set_num_items(0);
@@ -1237,6 +1448,7 @@ public:
     }
 
     sparsegroup(const sparsegroup& x, allocator_type& a) :
+        group_fingerprints<FP>(x), group_distances<RH>(x), version_type(),
         _group(0), _bitmap(x._bitmap), _bm_erased(x._bm_erased)
     {
         _set_num_items(0);
@@ -1253,12 +1465,18 @@ public:
 
     ~sparsegroup() { assert(_group == 0); }
 
-    void destruct(allocator_type& a) { _free_group(a, _num_alloc()); }
+    void destruct(allocator_type& a)
+    {
+        write_guard w(*this);
+        _free_group(a, _num_alloc());
+        _bitmap = 0;           // for optimistic readers still in the group array
+    }
 
     // Many STL algorithms use swap instead of copy constructors
     void swap(sparsegroup& x)
     {
         using std::swap;
+        write_guard w(*this), wx(x);
 
         swap(_group, x._group);
         swap(_bitmap, x._bitmap);
@@ -1267,11 +1485,14 @@ public:
         swap(_num_buckets,   x._num_buckets);
         swap(_num_allocated, x._num_allocated);
 #endif
+        this->swap_fingerprints(x);
+        this->swap_distances(x);
     }
 
     // It's always nice to be able to clear a table without deallocating it
     void clear(allocator_type &alloc, bool erased)
     {
+        write_guard w(*this);
         _free_group(alloc, _num_alloc());
         _bitmap = 0;
         if (erased)
@@ -1290,6 +1511,9 @@ public:
     // We also may want to know how many *used* buckets there are
     size_type num_nonempty() const   { return (size_type)_num_items(); }
 
+    // and how many items we have room for
+    size_type num_allocated() const  { return (size_type)_num_alloc(); }
+
     // TODO(csilvers): make protected + friend
     // This is used by sparse_hashtable to get an element from the table
     // when we know it exists.
@@ -1299,6 +1523,39 @@ public:
         return (reference)_group[pos_to_offset(i)];
     }
 
+    // Prefetches the slot where the item at position i is (or would be)
+    // stored.  Reads the bitmap, so the group itself should already be
+    // in cache, or at least on its way.
+    void prefetch(size_type i) const
+    {
+        if (_group)
+            SPP_PREFETCH(_group + pos_to_offset(i));
+    }
+
+    // Reads bucket i while a writer may be changing the group (see
+    // version_counter), copying the item there, if any, to out (raw storage
+    // for a value_type).  Returns read_retry if the group changed meanwhile.
+    // The item arrays the writer replaces must stay readable until then
+    // (see spp::epoch_allocator).
+    // ----------------------------------------------------------------------
+    enum read_result { read_empty, read_erased, read_full, read_retry };
+
+    read_result read_optimistic(size_type i, void *out) const
+    {
+        const uint32_t v = this->read_begin();
+        const group_bm_type bm  = *static_cast<const volatile group_bm_type *>(&_bitmap);
+        const group_bm_type bme = *static_cast<const volatile group_bm_type *>(&_bm_erased);
+        const value_type   *grp = *static_cast<value_type * const volatile *>(&_group);
+        if (!this->read_validate(v))
+            return read_retry;
+
+        const group_bm_type bit = static_cast<group_bm_type>(1) << i;
+        if (!(bm & bit))
+            return (bme & bit) ? read_erased : read_empty;
+        memcpy(out, static_cast<const void *>(grp + _pos_to_offset(bm, i)), sizeof(value_type));
+        return this->read_validate(v) ? read_full : read_retry;
+    }
+
     typedef std::pair<pointer, bool> SetResult;
 
 private:
@@ -1312,8 +1569,11 @@ private:
     //typedef spp_::three_type generic_alloc_type;
 
 #if 1
-    typedef typename if_<((spp_::is_same<allocator_type, libc_allocator<value_type> >::value ||
-                           spp_::is_same<allocator_type,  spp_allocator<value_type> >::value) &&
+    typedef typename spp_::base_allocator<allocator_type>::type base_allocator_type;
+
+    typedef typename if_<((spp_::is_same<base_allocator_type, libc_allocator<value_type> >::value ||
+                           spp_::is_same<base_allocator_type,  spp_allocator<value_type> >::value ||
+                           spp_::is_same<base_allocator_type,  spp_slab_allocator<value_type> >::value) &&
                           spp_::is_relocatable<value_type>::value), realloc_ok_type, realloc_not_ok_type>::type
              check_alloc_type;
 #else
@@ -1337,7 +1597,7 @@ private:
     //        realloc_and_memmove_ok;
 
     // ------------------------- memory at *p is uninitialized => need to construct
-    void _init_val(mutable_value_type *p, reference val)
+    static void _init_val(mutable_value_type *p, reference val)
     {
 #if !defined(SPP_NO_CXX11_RVALUE_REFERENCES)
         ::new (p) value_type(std::move((mutable_reference)val));
@@ -1347,11 +1607,26 @@ private:
     }
 
     // ------------------------- memory at *p is uninitialized => need to construct
-    void _init_val(mutable_value_type *p, const_reference val)
+    static void _init_val(mutable_value_type *p, const_reference val)
     {
         ::new (p) value_type(val);
     }
 
+    // Initializer passed to _set_aux() when inserting an existing value (which
+    // can be reference or const_reference)
+    // ------------------------------------------------------------------------
+    template <class Val>
+    class _value_init
+    {
+    public:
+        explicit _value_init(Val &val) : _val(val) {}
+        void operator()(void *p) const { _init_val(static_cast<mutable_pointer>(p), _val); }
+
+    private:
+        _value_init &operator=(const _value_init &);
+        Val &_val;
+    };
+
     // ------------------------------------------------ memory at *p is initialized
     void _set_val(value_type *p, reference val)
     {
@@ -1370,45 +1645,69 @@ private:
     }
 
     // Create space at _group[offset], assuming value_type is relocatable, and the 
-    // allocator_type is the spp allocator.
-    // return true if the slot was constructed (i.e. contains a valid value_type
+    // allocator_type is the spp allocator, then construct the new value there
+    // by calling init(p).
     // ---------------------------------------------------------------------------------
-    template <class Val>
-    void _set_aux(allocator_type &alloc, size_type offset, Val &val, realloc_ok_type)
+    template <class Init>
+    void _set_aux(allocator_type &alloc, size_type offset, Init &init, realloc_ok_type)
     {
         //static int x=0;  if (++x < 10) printf("x\n"); // check we are getting here
 
         uint32_t  num_items = _num_items();
-        uint32_t  num_alloc = _sizing(num_items);
+        uint32_t  num_alloc = _num_alloc();
 
         if (num_items == num_alloc)
         {
             num_alloc = _sizing(num_items + 1);
-            _group = alloc.reallocate(_group, num_alloc);
+            _group = alloc.reallocate(_group, num_items, num_alloc);
             _set_num_alloc(num_alloc);
         }
 
-        for (uint32_t i = num_items; i > offset; --i)
-            memcpy(static_cast<void *>(_group + i), _group + i-1, sizeof(*_group));
+        // construct the new item in the free slot after the last one, and
+        // only then move it to its position, so that if init throws the
+        // items are left as they were.
+        mutable_pointer last = (mutable_pointer)(_group + num_items);
+        try
+        {
+            init(last);
+        }
+        catch (...)
+        {
+            if (!num_items)
+            {
+                alloc.deallocate(_group, num_alloc);
+                _group = NULL;
+                _set_num_alloc(0);
+            }
+            else if (_num_alloc() != num_alloc) // not stored, follows the item count
+                _group = alloc.reallocate(_group, num_alloc, _num_alloc());
+            throw;
+        }
 
-        _init_val((mutable_pointer)(_group + offset), val);
+        if (offset < num_items)
+        {
+            unsigned char tmp[sizeof(value_type)];
+            memcpy(tmp, static_cast<void *>(last), sizeof(tmp));
+            memmove(static_cast<void *>(_group + offset + 1), _group + offset,
+                    (num_items - offset) * sizeof(*_group));
+            memcpy(static_cast<void *>(_group + offset), tmp, sizeof(tmp));
+        }
     }
 
     // Create space at _group[offset], assuming value_type is *not* relocatable, and the 
-    // allocator_type is the spp allocator.
-    // return true if the slot was constructed (i.e. contains a valid value_type
+    // allocator_type is the spp allocator, then construct the new value there
+    // by calling init(p).
     // ---------------------------------------------------------------------------------
-    template <class Val>
-    void _set_aux(allocator_type &alloc, size_type offset, Val &val, realloc_not_ok_type)
+    template <class Init>
+    void _set_aux(allocator_type &alloc, size_type offset, Init &init, realloc_not_ok_type)
     {
         uint32_t  num_items = _num_items();
-        uint32_t  num_alloc = _sizing(num_items);
+        uint32_t  num_alloc = _num_alloc();
 
-        //assert(num_alloc == (uint32_t)_num_allocated);
         if (num_items < num_alloc)
         {
             // create new object at end and rotate it to position
-            _init_val((mutable_pointer)&_group[num_items], val);
+            init((mutable_pointer)&_group[num_items]);
             std::rotate((mutable_pointer)(_group + offset),
                         (mutable_pointer)(_group + num_items),
                         (mutable_pointer)(_group + num_items + 1));
@@ -1416,7 +1715,22 @@ private:
         }
 
         // This is valid because 0 <= offset <= num_items
-        pointer p = _allocate_group(alloc, _sizing(num_items + 1));
+        const uint32_t new_alloc = _sizing(num_items + 1);
+        pointer p = _allocate_group(alloc, num_items + 1);
+
+        // construct the new item first, so that if init throws the items
+        // have not been moved yet.
+        try
+        {
+            init((mutable_pointer)(p + offset));
+        }
+        catch (...)
+        {
+            alloc.deallocate(p, new_alloc);
+            _set_num_alloc(num_alloc);
+            throw;
+        }
+
         if (offset)
             std::uninitialized_copy(MK_MOVE_IT((mutable_pointer)_group),
                                     MK_MOVE_IT((mutable_pointer)(_group + offset)),
@@ -1425,7 +1739,6 @@ private:
             std::uninitialized_copy(MK_MOVE_IT((mutable_pointer)(_group + offset)),
                                     MK_MOVE_IT((mutable_pointer)(_group + num_items)),
                                     (mutable_pointer)(p + offset + 1));
-        _init_val((mutable_pointer)(p + offset), val);
         _free_group(alloc, num_alloc);
         _group = p;
     }
@@ -1436,7 +1749,8 @@ private:
     {
         if (!_bmtest(i))
         {
-            _set_aux(alloc, offset, val, check_alloc_type());
+            _value_init<Val> init(val);
+            _set_aux(alloc, offset, init, check_alloc_type());
             _incr_num_items();
             _bmset(i);
         }
@@ -1451,6 +1765,7 @@ public:
     template <class Val>
     pointer set(allocator_type &alloc, size_type i, Val &val)
     {
+        write_guard w(*this);
         _bme_clear(i); // in case this was an "erased" location
 
         size_type offset = pos_to_offset(i);
@@ -1458,6 +1773,64 @@ public:
         return (pointer)(_group + offset);
     }
 
+    // Constructs a new item in bucket i, which must not be occupied, by
+    // calling init(p) where p points to the uninitialized slot.  This lets
+    // the caller build the value in place, and only once it knows the
+    // insertion will happen.  Returns the pointer to the inserted item.
+    // ---------------------------------------------------------------------
+    template <class Init>
+    pointer emplace(allocator_type &alloc, size_type i, Init &init)
+    {
+        assert(!_bmtest(i));
+        write_guard w(*this);
+        _bme_clear(i); // in case this was an "erased" location
+
+        size_type offset = pos_to_offset(i);
+        _set_aux(alloc, offset, init, check_alloc_type()); // may change _group pointer
+        _incr_num_items();
+        _bmset(i);
+        return (pointer)(_group + offset);
+    }
+
+    // Fills this empty group at once, allocating its item array a single
+    // time: bm has the positions to fill, and init(p, i) constructs the item
+    // of position i at p, in increasing order of i.  If init throws, the
+    // group is left empty.  Used by sparse_hashtable::parallel_build().
+    // ------------------------------------------------------------------------
+    template <class Init>
+    void fill(allocator_type &alloc, group_bm_type bm, Init &init)
+    {
+        assert(!_group && !_bitmap);
+        if (!bm)
+            return;
+        write_guard w(*this);
+        const uint32_t num_items = spp_popcount(bm);
+        const uint32_t num_alloc = _sizing(num_items);
+        _group = _allocate_group(alloc, num_items);
+
+        try
+        {
+            for (size_type i = 0; bm; ++i, bm >>= 1)
+            {
+                if (bm & 1)
+                {
+                    init((mutable_pointer)(_group + _num_items()), i);
+                    _incr_num_items();
+                    _bmset(i);
+                    _bme_clear(i);
+                }
+            }
+        }
+        catch (...)
+        {
+            _free_group(alloc, num_alloc);
+            _bitmap = 0;
+            _set_num_items(0);
+            _set_num_alloc(0);
+            throw;
+        }
+    }
+
     // We let you see if a bucket is non-empty without retrieving it
     // -------------------------------------------------------------
     bool test(size_type i) const
@@ -1480,7 +1853,7 @@ private:
     {
         // static int x=0;  if (++x < 10) printf("Y\n"); // check we are getting here
         uint32_t  num_items = _num_items();
-        uint32_t  num_alloc = _sizing(num_items);
+        uint32_t  num_alloc = _num_alloc();
 
         if (num_items == 1)
         {
@@ -1495,12 +1868,12 @@ private:
         for (size_type i = offset; i < num_items - 1; ++i)
             memcpy(static_cast<void *>(_group + i), _group + i + 1, sizeof(*_group));
 
-        if (_sizing(num_items - 1) != num_alloc)
+        if (_sizing(num_items - 1) < num_alloc)  // not after shrink_to_fit()
         {
-            num_alloc = _sizing(num_items - 1);
-            assert(num_alloc);            // because we have at least 1 item left
-            _set_num_alloc(num_alloc);
-            _group = alloc.reallocate(_group, num_alloc);
+            uint32_t new_alloc = _sizing(num_items - 1);
+            assert(new_alloc);            // because we have at least 1 item left
+            _set_num_alloc(new_alloc);
+            _group = alloc.reallocate(_group, num_alloc, new_alloc);
         }
     }
 
@@ -1510,9 +1883,9 @@ private:
     void _group_erase_aux(allocator_type &alloc, size_type offset, realloc_not_ok_type)
     {
         uint32_t  num_items = _num_items();
-        uint32_t  num_alloc   = _sizing(num_items);
+        uint32_t  num_alloc   = _num_alloc();
 
-        if (_sizing(num_items - 1) != num_alloc)
+        if (_sizing(num_items - 1) < num_alloc)  // not after shrink_to_fit()
         {
             pointer p = 0;
             if (num_items > 1)
@@ -1549,11 +1922,31 @@ private:
         _group_erase_aux(alloc, offset, check_alloc_type());
     }
 
+    // Reallocate the array to exactly num_items items.
+    // ------------------------------------------------
+    void _shrink_to_fit_aux(allocator_type &alloc, uint32_t num_items, realloc_ok_type)
+    {
+        _group = alloc.reallocate(_group, _num_alloc(), num_items);
+    }
+
+    void _shrink_to_fit_aux(allocator_type &alloc, uint32_t num_items, realloc_not_ok_type)
+    {
+        pointer p = alloc.allocate(static_cast<size_type>(num_items));
+        if (p == NULL)
+            throw_exception(std::bad_alloc());
+        std::uninitialized_copy(MK_MOVE_IT((mutable_pointer)_group),
+                                MK_MOVE_IT((mutable_pointer)(_group + num_items)),
+                                (mutable_pointer)p);
+        _free_group(alloc, _num_alloc());
+        _group = p;
+    }
+
 public:
     template <class twod_iter>
     bool erase_ne(allocator_type &alloc, twod_iter &it)
     {
         assert(_group && it.col_current != ne_end());
+        write_guard w(*this);
         size_type offset = (size_type)(it.col_current - ne_begin());
         size_type pos    = offset_to_pos(offset);
 
@@ -1586,6 +1979,7 @@ public:
     {
         if (_bmtest(i))
         {
+            write_guard w(*this);
             // trivial to erase empty bucket
             if (_num_items() == 1)
                 clear(alloc, false);
@@ -1599,6 +1993,75 @@ public:
         }
     }
 
+    // Same as erase(), but without remembering that i has been erased.  Used
+    // when the hashtable moves items around instead (robin hood hashing).
+    // ----------------------------------------------------------------------
+    void remove(allocator_type &alloc, size_type i)
+    {
+        write_guard w(*this);
+        erase(alloc, i);
+        _bme_clear(i);
+    }
+
+    // Gives the memory allocated for more items than the group holds back
+    // to the allocator.  As the size of the array is stored (see
+    // _num_alloc()), the next insert grows it again as usual.  Does
+    // nothing when it is not stored (SPP_STORE_NUM_ITEMS == 0), as it is
+    // then assumed to be _sizing(_num_items()).
+    // -------------------------------------------------------------------
+    void shrink_to_fit(allocator_type &alloc)
+    {
+#ifdef SPP_STORE_NUM_ITEMS
+        uint32_t num_items = _num_items();
+        if (num_items && num_items < _num_alloc())
+        {
+            write_guard w(*this);
+            _shrink_to_fit_aux(alloc, num_items, check_alloc_type());
+            _set_num_alloc(num_items);
+        }
+#else
+        (void)alloc;
+#endif
+    }
+
+    // Erases all the items, remembering the positions they were at as
+    // erased, so that probing goes past them as if they were still there.
+    // Used by incremental resizing, once the items have been moved out.
+    // --------------------------------------------------------------------
+    void erase_all(allocator_type &alloc)
+    {
+        write_guard w(*this);
+        _bm_erased |= _bitmap;
+        clear(alloc, false);
+    }
+
+    // Moves the item at position i to the empty position j.  The items of
+    // the group are stored in position order, so when no other item lies
+    // between i and j only the bitmap changes, otherwise the items in
+    // between are rotated.
+    // ---------------------------------------------------------------------
+    void relocate(size_type i, size_type j)
+    {
+        assert(_bmtest(i) && !_bmtest(j));
+        write_guard w(*this);
+        size_type from = pos_to_offset(i);
+        _bmclear(i);
+        size_type to = pos_to_offset(j);
+        _bme_clear(j);
+        _bmset(j);
+
+        if (from < to)
+            std::rotate((mutable_pointer)(_group + from),
+                        (mutable_pointer)(_group + from + 1),
+                        (mutable_pointer)(_group + to + 1));
+        else if (to < from)
+            std::rotate((mutable_pointer)(_group + to),
+                        (mutable_pointer)(_group + from),
+                        (mutable_pointer)(_group + from + 1));
+        this->copy_fingerprint(j, *this, i);
+        this->copy_distance(j, *this, i);
+    }
+
     // I/O
     // We support reading and writing groups to disk.  We don't store
     // the actual array contents (which we don't know how to store),
@@ -1618,6 +2081,7 @@ public:
     // Reading destroys the old group contents!  Returns true if all was ok.
     template <typename INPUT> bool read_metadata(allocator_type &alloc, INPUT *fp)
     {
+        write_guard w(*this);
         clear(alloc, true);
 
         if (!sparsehash_internal::read_data(fp, &_bitmap, sizeof(_bitmap)))
@@ -1634,6 +2098,7 @@ public:
     // Again, only meaningful if value_type is a POD.
     template <typename INPUT> bool read_nopointer_data(INPUT *fp)
     {
+        write_guard w(*this);
         for (ne_iterator it = ne_begin(); it != ne_end(); ++it)
             if (!sparsehash_internal::read_data(fp, &(*it), sizeof(*it)))
                 return false;
@@ -1785,13 +2250,13 @@ private:
 
 // ---------------------------------------------------------------------------
 // ---------------------------------------------------------------------------
-template <class T, class Alloc>
+template <class T, class Alloc, bool FP = false, bool RH = false>
 class sparsetable
 {
 public:
     typedef T                                             value_type;
     typedef Alloc                                         allocator_type;
-    typedef sparsegroup<value_type, allocator_type>       group_type;
+    typedef sparsegroup<value_type, allocator_type, FP, RH> group_type;
 
 private:
     typedef typename Alloc::template rebind<group_type>::other group_alloc_type;
@@ -1813,8 +2278,8 @@ public:
     typedef typename group_type::ne_iterator              ColIterator;
     typedef typename group_type::const_ne_iterator        ColConstIterator;
 
-    typedef table_iterator<sparsetable<T, allocator_type> >        iterator;       // defined with index
-    typedef const_table_iterator<sparsetable<T, allocator_type> >  const_iterator; // defined with index
+    typedef table_iterator<sparsetable<T, allocator_type, FP, RH> >        iterator;       // defined with index
+    typedef const_table_iterator<sparsetable<T, allocator_type, FP, RH> >  const_iterator; // defined with index
     typedef std::reverse_iterator<const_iterator>         const_reverse_iterator;
     typedef std::reverse_iterator<iterator>               reverse_iterator;
 
@@ -1868,6 +2333,24 @@ public:
     const_ne_iterator ne_end() const       { return const_ne_iterator(_last_group); }
     const_ne_iterator ne_cend() const      { return const_ne_iterator(_last_group); }
 
+    // Iterators over our items which go on with the items of next, for the
+    // old table of an incremental resize (see sparse_hashtable::begin())
+    ne_iterator       ne_begin(sparsetable &next)
+    {
+        return ne_iterator(_first_group, next._first_group);
+    }
+
+    const_ne_iterator ne_cbegin(const sparsetable &next) const
+    {
+        return const_ne_iterator(_first_group, next._first_group);
+    }
+
+    // Whether it points to one of our items
+    bool owns(const const_ne_iterator &it) const
+    {
+        return it.row_current >= _first_group && it.row_current < _last_group;
+    }
+
     reverse_ne_iterator       ne_rbegin()        { return reverse_ne_iterator(ne_end()); }
     const_reverse_ne_iterator ne_rbegin() const  { return const_reverse_ne_iterator(ne_end());  }
     const_reverse_ne_iterator ne_crbegin() const { return const_reverse_ne_iterator(ne_end());  }
@@ -1968,14 +2451,19 @@ public:
 
     void _copy(const sparsetable &o)
     {
-        _table_size = o._table_size;
-        _num_buckets = o._num_buckets;
         _alloc = o._alloc;                // todo - copy or move allocator according to...
         _group_alloc = o._group_alloc;    // http://en.cppreference.com/w/cpp/container/unordered_map/unordered_map
+        _copy_groups(o);
+    }
 
-        group_size_type sz = (group_size_type)(o._last_group - o._first_group);
-        if (sz)
-        {
+    void _copy_groups(const sparsetable &o)
+    {
+        _table_size = o._table_size;
+        _num_buckets = o._num_buckets;
+
+        group_size_type sz = (group_size_type)(o._last_group - o._first_group);
+        if (sz)
+        {
             _alloc_group_array(sz, _first_group, _last_group);
             for (group_size_type i=0; i<sz; ++i)
                 new (_first_group + i) group_type(o._first_group[i], _alloc);
@@ -2061,6 +2549,44 @@ public:
         _table_size = 0;
     }
 
+    // Tightens the item arrays of all the groups, see sparsegroup::shrink_to_fit()
+    void shrink_to_fit()
+    {
+        for (group_type *g = _first_group; g != _last_group; ++g)
+            g->shrink_to_fit(_alloc);
+    }
+
+    // The bytes of the group array and of the items, without the slack of
+    // the item arrays, in O(1)
+    size_t memory_bytes() const
+    {
+        size_t res = (size_t)_num_buckets * sizeof(value_type);
+        if (_first_group)
+            res += (size_t)(_last_group - _first_group + 1) * sizeof(group_type); // + end marker
+        return res;
+    }
+
+    // Adds the memory of the group array and of the item arrays to mu,
+    // without looking at the items
+    void add_memory_usage(memory_usage_info &mu) const
+    {
+        if (!_first_group)
+            return;
+        mu.group_bytes += (size_t)(_last_group - _first_group + 1) * sizeof(group_type); // + end marker
+        for (const group_type *g = _first_group; g != _last_group; ++g)
+        {
+            mu.item_bytes  += (size_t)g->num_allocated() * sizeof(value_type);
+            mu.slack_bytes += (size_t)(g->num_allocated() - g->num_nonempty()) * sizeof(value_type);
+        }
+    }
+
+    // Makes us a copy of o, group for group, but keeps our allocator
+    void clone(const sparsetable &o)
+    {
+        _cleanup();
+        _copy_groups(o);
+    }
+
     inline allocator_type get_allocator() const
     {
         return _alloc;
@@ -2077,6 +2603,14 @@ public:
     bool empty() const               { return _table_size == 0; }
     size_type num_nonempty() const   { return _num_buckets; }
 
+    // The group array and the number of buckets, for the readers racing
+    // with a writer, who check the hashtable version before using them
+    void read_layout(const group_type *&groups, size_type &num_buckets) const
+    {
+        groups      = *static_cast<group_type * const volatile *>(&_first_group);
+        num_buckets = *static_cast<const volatile size_type *>(&_table_size);
+    }
+
     // OK, we'll let you resize one of these puppies
     void resize(size_type new_size)
     {
@@ -2151,6 +2685,7 @@ public:
 
         bool test_strict() const { return grp.test_strict(pos); }
         bool test() const        { return grp.test(pos); }
+        bool match_fingerprint(size_t hashval) const { return grp.match_fingerprint(pos, hashval); }
         typename sparsetable::reference unsafe_get() const { return  grp.unsafe_get(pos); }
         ne_iter get_iter(typename sparsetable::reference ref)
         {
@@ -2192,6 +2727,42 @@ public:
         return which_group(i).unsafe_get(pos_in_group(i));
     }
 
+    // Used by the hashtable to hide memory latency when looking up several
+    // buckets: first prefetch the groups, and then the slots in them.
+    // ---------------------------------------------------------------------
+    void prefetch_group(size_type i) const
+    {
+        assert(i < _table_size);
+        SPP_PREFETCH(&which_group(i));
+    }
+
+    void prefetch_slot(size_type i) const
+    {
+        assert(i < _table_size);
+        which_group(i).prefetch(pos_in_group(i));
+    }
+
+    // Records the hash of the value just stored in bucket i, when
+    // fingerprints are enabled, and its distance to its home bucket with
+    // robin hood probing (no-ops otherwise)
+    // ------------------------------------------------------------------
+    static const bool has_fingerprints = FP;
+    static const bool has_distances    = RH;
+
+    void set_hash(size_type i, size_t hashval)
+    {
+        group_type &grp(which_group(i));
+        grp.set_fingerprint(pos_in_group(i), hashval);
+        grp.set_distance(pos_in_group(i), (i - hashval) & (_table_size - 1));
+    }
+
+    // The distance of the item in bucket i to its home bucket, or
+    // group_type::far_distance if it must be computed from the hash
+    size_type distance(size_type i) const
+    {
+        return (size_type)which_group(i).distance(pos_in_group(i));
+    }
+
     // Needed for hashtables, gets as a ne_iterator.  Crashes for empty bcks
     const_ne_iterator get_iter(size_type i) const
     {
@@ -2204,6 +2775,14 @@ public:
                                   _first_group[grp_idx].pos_to_offset(pos_in_group(i))));
     }
 
+    // Same as get_iter(i), going on with the items of next, see ne_cbegin()
+    const_ne_iterator get_iter(size_type i, const sparsetable &next) const
+    {
+        const_ne_iterator it(get_iter(i));
+        it.row_next = next._first_group;
+        return it;
+    }
+
     const_ne_iterator get_iter(size_type i, ColIterator col_it) const
     {
         return const_ne_iterator(_first_group + group_num(i), col_it);
@@ -2226,6 +2805,18 @@ public:
         return ne_iterator(_first_group + group_num(i), col_it);
     }
 
+    // Returns an iterator to the first non-empty bucket at or after i
+    ne_iterator get_iter_from(size_type i)
+    {
+        group_type *grp = _first_group + group_num(i);
+        if (!grp->num_nonempty())
+            return ne_iterator(grp + 1);   // skips empty groups
+
+        ne_iterator it(grp, grp->ne_begin() + grp->pos_to_offset(pos_in_group(i)));
+        it.advance_past_end();
+        return it;
+    }
+
     // And the reverse transformation.
     size_type get_pos(const const_ne_iterator& it) const
     {
@@ -2248,6 +2839,18 @@ public:
         return *p;
     }
 
+    // Constructs a new value in the empty bucket i with init(p), see
+    // sparsegroup::emplace()
+    // ----------------------------------------------------------------
+    template <class Init>
+    reference emplace(size_type i, Init &init)
+    {
+        assert(i < _table_size);
+        pointer p(which_group(i).emplace(_alloc, pos_in_group(i), init));
+        ++_num_buckets;
+        return *p;
+    }
+
     // used in _move_from (where we can move the old value instead of copying it
     void move(size_type i, reference val)
     {
@@ -2273,6 +2876,74 @@ public:
         erase(pos.pos);
     }
 
+    // Used when rehashing with several threads, each one working on its
+    // own groups: same as move() and clear() on a single group, but they
+    // leave the count of items to the caller, see set_num_nonempty().
+    // --------------------------------------------------------------------
+    void move_uncounted(size_type i, reference val)
+    {
+        assert(i < _table_size);
+        which_group(i).set(_alloc, pos_in_group(i), val);
+    }
+
+    void clear_group_uncounted(size_type grp)
+    {
+        _first_group[grp].clear(_alloc, true);
+    }
+
+    // Same as sparsegroup::fill() on group grp, for parallel_build()
+    template <class Init>
+    void fill_group_uncounted(size_type grp, group_bm_type bm, Init &init)
+    {
+        _first_group[grp].fill(_alloc, bm, init);
+    }
+
+    void set_num_nonempty(size_type n) { _num_buckets = n; }
+
+    // Erases all the elements of group number grp, see sparsegroup::erase_all()
+    // -------------------------------------------------------------------------
+    void erase_group(size_type grp)
+    {
+        group_type &g = _first_group[grp];
+        _num_buckets -= g.num_nonempty();
+        g.erase_all(_alloc);
+    }
+
+    // Takes the element out of bucket i without leaving an erased marker
+    // ------------------------------------------------------------------
+    void remove(size_type i)
+    {
+        assert(i < _table_size);
+
+        GroupsReference grp(which_group(i));
+        typename group_type::size_type old_numbuckets = grp.num_nonempty();
+        grp.remove(_alloc, pos_in_group(i));
+        _num_buckets += grp.num_nonempty() - old_numbuckets;
+    }
+
+    // Moves the element in bucket i to the empty bucket j, without leaving
+    // an erased marker (used by robin hood hashing)
+    // --------------------------------------------------------------------
+    void relocate(size_type i, size_type j)
+    {
+        assert(i < _table_size && j < _table_size);
+
+        group_type &from(which_group(i));
+        group_type &to(which_group(j));
+        typename group_type::size_type pi = pos_in_group(i), pj = pos_in_group(j);
+        const size_t dist = from.distance(pi);
+
+        if (&from == &to)
+            from.relocate(pi, pj);
+        else
+        {
+            to.set(_alloc, pj, from.unsafe_get(pi));    // moves the value
+            to.copy_fingerprint(pj, from, pi);
+            from.remove(_alloc, pi);
+        }
+        to.set_distance(pj, dist == group_type::far_distance ? dist : (dist + j - i) & (_table_size - 1));
+    }
+
     void erase(iterator start_it, iterator end_it)
     {
         // This could be more efficient, but then we'd need to figure
@@ -2492,22 +3163,93 @@ private:
 // EqualKey: Given two Keys, says whether they are the same (that is,
 //           if they are both associated with the same Value).
 // Alloc: STL allocator to use to allocate memory.
+// Probing: how the buckets are probed on collisions (see below).
 //
 //  ----------------------------------------------------------------------
 
 // The probing method
 // ------------------
-// Linear probing
-// #define JUMP_(key, num_probes)    ( 1 )
-// Quadratic probing
-#define JUMP_(key, num_probes)    ( num_probes )
+// Probing policies, selected with the last template parameter of
+// sparse_hash_map and sparse_hash_set.  next() returns the bucket to
+// look at after bucknum, num_probes being the number of buckets already
+// probed (starting at 1).  The sequence must visit every bucket of the
+// table, whose size is a power of two.
+//
+// linear_probing looks at the following bucket, which is the most cache
+// friendly but makes long runs of occupied buckets more likely.
+//
+// quadratic_probing (the default) jumps further and further away, so
+// collisions on nearby buckets don't make long runs.
+//
+// group_local_probing first looks at all the buckets of the home group,
+// whose bitmap is already in cache, and only then jumps (quadratically)
+// to other groups.
+//
+// These three mark erased buckets so that the probe chains going through
+// them are kept.
+//
+// robin_hood_probing probes linearly, and keeps the items of a run
+// ordered by their distance to their home bucket: an insert takes the
+// place of the first item closer to its home than the new one, pushing
+// the rest of the run up by one bucket.  Lookups can stop as soon as they
+// pass the place where the key would be, and erase shifts the following
+// items back instead of leaving an erased marker, so probe chains don't
+// degrade with churn.  The distance of each item to its home bucket is
+// kept in a byte per bucket (see group_distances), so the probes don't
+// hash the keys they pass.  Also, erasing an item may move an item from
+// the start of the table to its end, so erasing while iterating may visit
+// that item twice.
+// -------------------------------------------------------------------------
+struct linear_probing
+{
+    static const bool robin_hood = false;
+
+    static size_t next(size_t bucknum, size_t /*num_probes*/, size_t bucket_count_minus_one)
+    {
+        return (bucknum + 1) & bucket_count_minus_one;
+    }
+};
+
+struct quadratic_probing
+{
+    static const bool robin_hood = false;
+
+    static size_t next(size_t bucknum, size_t num_probes, size_t bucket_count_minus_one)
+    {
+        return (bucknum + num_probes) & bucket_count_minus_one;
+    }
+};
+
+struct group_local_probing
+{
+    static const bool robin_hood = false;
+
+    static size_t next(size_t bucknum, size_t num_probes, size_t bucket_count_minus_one)
+    {
+        if (bucket_count_minus_one < SPP_GROUP_SIZE)
+            return (bucknum + 1) & bucket_count_minus_one;     // only one group
+
+        // next position in the group, wrapping around
+        size_t pos = (bucknum + 1) & SPP_MASK_;
+        size_t grp = bucknum >> SPP_SHIFT_;
 
+        if ((num_probes & SPP_MASK_) == 0)
+            grp += num_probes >> SPP_SHIFT_;   // whole group probed, jump
+        return ((grp << SPP_SHIFT_) | pos) & bucket_count_minus_one;
+    }
+};
+
+struct robin_hood_probing : public linear_probing
+{
+    static const bool robin_hood = true;
+};
 
 // -------------------------------------------------------------------
 // -------------------------------------------------------------------
 template <class Value, class Key, class HashFcn,
-          class ExtractKey, class SetKey, class EqualKey, class Alloc>
-class sparse_hashtable
+          class ExtractKey, class SetKey, class EqualKey, class Alloc,
+          class Probing = quadratic_probing>
+class sparse_hashtable : private version_counter<spp_::use_versions<Alloc>::value>
 {
 public:
     typedef Key                                        key_type;
@@ -2524,7 +3266,9 @@ public:
     typedef const value_type*                          const_pointer;
 
     // Table is the main storage class.
-    typedef sparsetable<value_type, allocator_type>   Table;
+    typedef sparsetable<value_type, allocator_type,
+                        spp_::use_fingerprints<HashFcn>::value,
+                        Probing::robin_hood>                      Table;
     typedef typename Table::ne_iterator               ne_it;
     typedef typename Table::const_ne_iterator         cne_it;
     typedef typename Table::destructive_iterator      dest_it;
@@ -2564,11 +3308,23 @@ public:
 
     // iterators
     // ---------
-    iterator       begin()        { return _mk_iterator(table.ne_begin());  }
+    // While an incremental resize is in progress, they go over the items
+    // left in the old table first, then over the items of table.
+    // ---------------------------------------------------------------------
+    iterator begin()
+    {
+        return _mk_iterator(_resizing() ? extras->old->table.ne_begin(table) : table.ne_begin());
+    }
+
     iterator       end()          { return _mk_iterator(table.ne_end());    }
-    const_iterator begin() const  { return _mk_const_iterator(table.ne_cbegin()); }
+
+    const_iterator begin() const
+    {
+        return _mk_const_iterator(_resizing() ? extras->old->table.ne_cbegin(table) : table.ne_cbegin());
+    }
+
     const_iterator end() const    { return _mk_const_iterator(table.ne_cend());   }
-    const_iterator cbegin() const { return _mk_const_iterator(table.ne_cbegin()); }
+    const_iterator cbegin() const { return begin(); }
     const_iterator cend() const   { return _mk_const_iterator(table.ne_cend());   }
 
     // These come from tr1 unordered_map.  They iterate over 'bucket' n.
@@ -2621,6 +3377,21 @@ public:
     // Accessor function for statistics gathering.
     unsigned int num_table_copies() const { return settings.num_ht_copies(); }
 
+    // Heterogeneous lookup: when both the hasher and key_equal are
+    // transparent (see spp_::is_transparent), lookups accept any key type K
+    // they can handle, without constructing a key_type.
+    // if_transparent<K, R>::type is R in that case, and otherwise removes
+    // the overload, so K is converted to key_type as usual.
+    // ---------------------------------------------------------------------
+    template <class K, class R>
+    struct if_transparent :
+        public spp_::enable_if<spp_::is_transparent<hasher>::value &&
+                               spp_::is_transparent<key_equal>::value &&
+                               !spp_::is_same<K, iterator>::value &&
+                               !spp_::is_same<K, const_iterator>::value, R>
+    {
+    };
+
 private:
     // This is used as a tag for the copy constructor, saying to destroy its
     // arg We have two ways of destructively copying: with potentially growing
@@ -2629,6 +3400,10 @@ private:
     // -----------------------------------------------------------------------
     enum MoveDontCopyT {MoveDontCopy, MoveDontGrow};
 
+    // Made odd while the layout of the tables changes (see version_counter)
+    typedef version_counter<spp_::use_versions<Alloc>::value> version_type;
+    typedef version_guard<version_type>                      write_guard;
+
     // creating iterators from sparsetable::ne_iterators
     // -------------------------------------------------
     iterator             _mk_iterator(ne_it it) const               { return it; }
@@ -2636,7 +3411,7 @@ private:
     destructive_iterator _mk_destructive_iterator(dest_it it) const { return it; }
 
 public:
-    size_type size() const              { return table.num_nonempty(); }
+    size_type size() const              { return table.num_nonempty() + (_resizing() ? extras->old->table.num_nonempty() : 0); }
     size_type max_size() const          { return table.max_size(); }
     bool empty() const                  { return size() == 0; }
     size_type bucket_count() const      { return table.size(); }
@@ -2669,7 +3444,7 @@ private:
         // like "dense_hash_set<int> x; x.insert(4); x.erase(4);" will
         // shrink us down to HT_MIN_BUCKETS buckets, which is too small.
         // ---------------------------------------------------------------
-        const size_type num_remain = table.num_nonempty();
+        const size_type num_remain = size();
         const size_type shrink_threshold = settings.shrink_threshold();
         if (shrink_threshold > 0 && num_remain < shrink_threshold &&
             bucket_count() > HT_DEFAULT_STARTING_BUCKETS)
@@ -2681,8 +3456,15 @@ private:
             {
                 sz /= 2;                            // stay a power of 2
             }
-            sparse_hashtable tmp(MoveDontCopy, *this, sz);
-            swap(tmp);                            // now we are tmp
+            _finish_resize();
+            if (_groups_per_step())
+                _start_resize(sz);                // see set_incremental_resize()
+            else
+            {
+                write_guard w(*this);
+                sparse_hashtable tmp(MoveDontCopy, *this, sz);
+                swap(tmp);                        // now we are tmp
+            }
             retval = true;
         }
         settings.set_consider_shrink(false);   // because we just considered it
@@ -2696,19 +3478,35 @@ private:
     bool _resize_delta(size_type delta)
     {
         bool did_resize = false;
+        if (extras && extras->budget_bytes && _check_budget(delta))
+            did_resize = true;     // items were evicted, the positions may have changed
         if (settings.consider_shrink())
         {
             // see if lots of deletes happened
             if (_maybe_shrink())
                 did_resize = true;
         }
-        if (table.num_nonempty() >=
+        if (num_deleted && extras && extras->purge_factor &&
+            num_deleted > static_cast<size_type>(bucket_count() * extras->purge_factor) &&
+            !_resizing())
+        {
+            // too many erased buckets lengthening the probe sequences
+            purge_deleted();
+            did_resize = true;
+        }
+        if (_resizing())
+        {
+            // move along the incremental resize in progress
+            if (_resize_step(extras->resize_step))
+                did_resize = true;
+        }
+        if (size() >=
             (std::numeric_limits<size_type>::max)() - delta)
         {
             throw_exception(std::length_error("resize overflow"));
         }
 
-        size_type num_occupied = (size_type)(table.num_nonempty() + num_deleted);
+        size_type num_occupied = (size_type)(size() + num_deleted);
 
         if (bucket_count() >= HT_MIN_BUCKETS &&
              (num_occupied + delta) <= settings.enlarge_threshold())
@@ -2739,154 +3537,995 @@ private:
             // deleted elements).
             const size_type target =
                 static_cast<size_type>(settings.shrink_size((size_type)(resize_to*2)));
-            if (table.num_nonempty() + delta >= target)
+            if (size() + delta >= target)
             {
                 // Good, we won't be below the shrink threshhold even if we double.
                 resize_to *= 2;
             }
         }
 
+        _finish_resize();   // in case the new table filled up before the end
+        if (_groups_per_step())
+        {
+            _start_resize(resize_to);
+            return true;
+        }
+
+        write_guard w(*this);
         sparse_hashtable tmp(MoveDontCopy, *this, resize_to);
         swap(tmp);                             // now we are tmp
         return true;
     }
 
-    // Used to actually do the rehashing when we grow/shrink a hashtable
-    // -----------------------------------------------------------------
-    void _copy_from(const sparse_hashtable &ht, size_type min_buckets_wanted)
-    {
-        clear();            // clear table, set num_deleted to 0
-
-        // If we need to change the size of our table, do it now
-        const size_type resize_to = settings.min_buckets(ht.size(), min_buckets_wanted);
-
-        if (resize_to > bucket_count())
+    // Memory budget (see set_memory_budget())
+    // ---------------------------------------
+    // The bytes that inserting delta items may need: their room in the
+    // groups, and the new group array if the table has to grow for them
+    // (the old groups are freed as the items are moved).
+    size_t _budget_needed(size_type delta)
+    {
+        size_t needed = (size_t)delta * sizeof(value_type);
+        const size_type num_occupied = (size_type)(size() + num_deleted + delta);
+        if (num_occupied > settings.enlarge_threshold())
         {
-            // we don't have enough buckets
-            table.resize(resize_to);               // sets the number of buckets
-            settings.reset_thresholds(bucket_count());
-        }
-
-        // We use a normal iterator to get bcks from ht
-        // We could use insert() here, but since we know there are
-        // no duplicates, we can be more efficient
-        assert((bucket_count() & (bucket_count()-1)) == 0);      // a power of two
-        for (const_iterator it = ht.begin(); it != ht.end(); ++it)
-        {
-            size_type num_probes = 0;              // how many times we've probed
-            size_type bucknum;
-            const size_type bucket_count_minus_one = bucket_count() - 1;
-            for (bucknum = hash(get_key(*it)) & bucket_count_minus_one;
-                 table.test(bucknum);                                   // table.test() OK since no erase()
-                 bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one)
-            {
-                ++num_probes;
-                assert(num_probes < bucket_count()
-                       && "Hashtable is full: an error in key_equal<> or hash<>");
-            }
-            table.set(bucknum, *it);               // copies the value to here
+            size_type resize_to = settings.min_buckets(num_occupied, bucket_count());
+            needed += (size_t)(Table::num_groups(resize_to) + 1) * sizeof(typename Table::group_type);
         }
-        settings.inc_num_ht_copies();
+        return needed;
     }
 
-    // Implementation is like _copy_from, but it destroys the table of the
-    // "from" guy by freeing sparsetable memory as we iterate.  This is
-    // useful in resizing, since we're throwing away the "from" guy anyway.
-    // --------------------------------------------------------------------
-    void _move_from(MoveDontCopyT mover, sparse_hashtable &ht,
-                   size_type min_buckets_wanted)
+    // Calls the budget hook as long as inserting delta items would take us
+    // over the budget, and it evicts items.  Returns true if it did.
+    bool _check_budget(size_type delta)
     {
-        clear();
-
-        // If we need to change the size of our table, do it now
-        size_type resize_to;
-        if (mover == MoveDontGrow)
-            resize_to = ht.bucket_count();       // keep same size as old ht
-        else                                     // MoveDontCopy
-            resize_to = settings.min_buckets(ht.size(), min_buckets_wanted);
-        if (resize_to > bucket_count())
+        bool evicted = false;
+        while (1)
         {
-            // we don't have enough buckets
-            table.resize(resize_to);               // sets the number of buckets
-            settings.reset_thresholds(bucket_count());
+            const size_t used   = table.memory_bytes() +
+                (_resizing() ? sizeof(OldTable) + extras->old->table.memory_bytes() : 0);
+            const size_t needed = _budget_needed(delta);
+            if (used + needed <= extras->budget_bytes)
+                return evicted;
+
+            const memory_budget_hook hook = extras->budget_hook;
+            const size_type num_items = size();
+            memory_budget_action action =
+                hook ? hook(extras->budget_ctx, used, needed) : budget_refuse;
+            if (action == budget_allow)
+                return evicted;
+            if (action == budget_refuse || size() >= num_items)  // or nothing evicted
+                throw_exception(std::length_error("memory budget exceeded"));
+            evicted = true;
         }
+    }
 
-        // We use a normal iterator to get bcks from ht
-        // We could use insert() here, but since we know there are
-        // no duplicates, we can be more efficient
-        assert((bucket_count() & (bucket_count()-1)) == 0);      // a power of two
-        const size_type bucket_count_minus_one = (const size_type)(bucket_count() - 1);
+    // Incremental resizing (see set_incremental_resize())
+    // ---------------------------------------------------
+    // While a resize is in progress, the items not moved yet are in
+    // old->table, whose groups are moved to table one at a time, in order,
+    // starting with group number old->pos.  The moved items are erased
+    // from old->table (see sparsegroup::erase_all()), so its probe sequences
+    // stay valid, and lookups check table first, then old->table.
+    // New items always go to table, as do the old items that are looked up.
+    // extras->old is only allocated while a resize is in progress, and
+    // freed with the allocator of the tables, so that optimistic_find() can
+    // still read it (see spp::epoch_allocator).
+    // ----------------------------------------------------------------------
+    bool _resizing() const { return extras && extras->old; }
 
-        // THIS IS THE MAJOR LINE THAT DIFFERS FROM COPY_FROM():
-        for (destructive_iterator it = ht.destructive_begin();
-              it != ht.destructive_end(); ++it)
+    // groups moved per operation, 0 if not incremental
+    size_type _groups_per_step() const { return extras ? extras->resize_step : 0; }
+
+    void _start_resize(size_type resize_to)
+    {
+        assert(!_resizing());
+        Extras &e = _extras();
+        old_alloc_type alloc(table.get_allocator());
+        OldTable *o = alloc.allocate(1);
+        if (!o)
+            throw_exception(std::bad_alloc());
+        try
         {
-            size_type num_probes = 0;
-            size_type bucknum;
-            for (bucknum = hash(get_key(*it)) & bucket_count_minus_one;
-                 table.test(bucknum);                          // table.test() OK since no erase()
-                 bucknum = (size_type)((bucknum + JUMP_(key, num_probes)) & (bucket_count()-1)))
-            {
-                ++num_probes;
-                assert(num_probes < bucket_count()
-                       && "Hashtable is full: an error in key_equal<> or hash<>");
-            }
-            table.move(bucknum, *it);    // moves the value to here
+            new (o) OldTable(table.get_allocator());
+        }
+        catch (...)
+        {
+            alloc.deallocate(o, 1);
+            throw;
         }
+
+        write_guard w(*this);
+        o->table.swap(table);
+        e.old = o;
+        table.resize(resize_to);   // sets the number of buckets
+        num_deleted = 0;           // the erased buckets are left in old->table
+        settings.reset_thresholds(bucket_count());
         settings.inc_num_ht_copies();
+        _resize_step(e.resize_step);
     }
 
-
-    // Required by the spec for hashed associative container
-public:
-    // Though the docs say this should be num_buckets, I think it's much
-    // more useful as num_elements.  As a special feature, calling with
-    // req_elements==0 will cause us to shrink if we can, saving space.
-    // -----------------------------------------------------------------
-    void resize(size_type req_elements)
+    // Ends the resize in progress, if any, dropping the items not moved yet
+    void _free_old_table()
     {
-        // resize to this or larger
-        if (settings.consider_shrink() || req_elements == 0)
-            _maybe_shrink();
-        if (req_elements > table.num_nonempty())    // we only grow
-            _resize_delta((size_type)(req_elements - table.num_nonempty()));
+        if (!_resizing())
+            return;
+        write_guard w(*this);
+        OldTable *o = extras->old;
+        extras->old = 0;
+        old_alloc_type alloc(o->table.get_allocator());
+        o->~OldTable();
+        alloc.deallocate(o, 1);
     }
 
-    // Get and change the value of shrink_factor and enlarge_factor.  The
-    // description at the beginning of this file explains how to choose
-    // the values.  Setting the shrink parameter to 0.0 ensures that the
-    // table never shrinks.
-    // ------------------------------------------------------------------
-    void get_resizing_parameters(float* shrink, float* grow) const
+    // Moves the items of the next num_groups groups of old->table to table.
+    // Returns true if anything was moved (positions in table are then stale)
+    bool _resize_step(size_type num_groups)
     {
-        *shrink = settings.shrink_factor();
-        *grow = settings.enlarge_factor();
-    }
+        if (!_resizing())
+            return false;
 
-    float get_shrink_factor() const  { return settings.shrink_factor(); }
-    float get_enlarge_factor() const { return settings.enlarge_factor(); }
+        write_guard w(*this);
+        OldTable &old = *extras->old;
+        const size_type last_group = (old.table.size() - 1) / SPP_GROUP_SIZE + 1;
+        for (; num_groups && old.pos < last_group; --num_groups, ++old.pos)
+        {
+            typename Table::GroupsReference grp(old.table.which_group(old.pos * SPP_GROUP_SIZE));
+            for (typename Table::ColIterator it = grp.ne_begin(); it != grp.ne_end(); ++it)
+                _move_old_value(*it);
+            old.table.erase_group(old.pos);  // frees the group's memory
+        }
+        if (old.pos == last_group)
+            _free_old_table();
+        return true;
+    }
 
-    void set_resizing_parameters(float shrink, float grow) 
+    // Completes the resize in progress, if any
+    void _finish_resize()
     {
-        settings.set_resizing_parameters(shrink, grow);
-        settings.reset_thresholds(bucket_count());
+        if (_resizing())
+            _resize_step(ILLEGAL_BUCKET);
     }
 
-    void set_shrink_factor(float shrink)
+    // Moves v, from old->table, to table where its key cannot already be.
+    // Returns the bucket where it went.
+    size_type _move_old_value(reference v)
     {
-        set_resizing_parameters(shrink, get_enlarge_factor());
+        const size_t hashval = hash(get_key(v));
+        size_type bucknum = _free_position(hashval);
+        if (table.test_strict(bucknum))
+        {
+            // reusing an erased bucket
+            assert(num_deleted);
+            --num_deleted;
+        }
+        table.move(bucknum, v);
+        table.set_hash(bucknum, hashval);
+        return bucknum;
     }
 
-    void set_enlarge_factor(float grow)
+    // Moves the item in bucket oldbuck of old->table to table, where the
+    // caller wants an iterator to it
+    iterator _move_old_bucket(size_type oldbuck)
     {
-        set_resizing_parameters(get_shrink_factor(), grow);
+        write_guard w(*this);
+        size_type bucknum = _move_old_value(extras->old->table.unsafe_get(oldbuck));
+        extras->old->table.erase(oldbuck);
+        return _mk_iterator(table.get_iter(bucknum));
     }
 
-    // CONSTRUCTORS -- as required by the specs, we take a size,
-    // but also let you specify a hashfunction, key comparator,
-    // and key extractor.  We also define a copy constructor and =.
-    // DESTRUCTOR -- the default is fine, surprisingly.
-    // ------------------------------------------------------------
+    // Returns the bucket of old->table holding key, or ILLEGAL_BUCKET.
+    // Like in _find_position(), but there are erased buckets with robin
+    // hood probing as well, so we can only stop early on an actual item.
+    template <class K>
+    size_type _find_old_bucket(const K &key, size_t hashval) const
+    {
+        if (!_resizing())
+            return ILLEGAL_BUCKET;
+
+        const Table &old_table = extras->old->table;
+        size_type num_probes = 0;              // how many times we've probed
+        const size_type bucket_count_minus_one = old_table.size() - 1;
+        size_type bucknum = hashval & bucket_count_minus_one;
+
+        while (1)                        // probe until something happens
+        {
+            typename Table::GrpPos grp_pos(old_table, bucknum);
+
+            if (!grp_pos.test_strict())
+                return ILLEGAL_BUCKET;   // bucket is empty
+            if (grp_pos.test())
+            {
+                const_reference ref(grp_pos.unsafe_get());
+
+                if (grp_pos.match_fingerprint(hashval) && equals(key, get_key(ref)))
+                    return bucknum;
+                if (Probing::robin_hood && _rh_distance(old_table, bucknum) < num_probes)
+                    return ILLEGAL_BUCKET;   // key would be here
+            }
+            ++num_probes;                        // we're doing another probe
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
+            assert(num_probes < old_table.size()
+                   && "Hashtable is full: an error in key_equal<> or hash<>");
+        }
+    }
+
+    // find() while resizing: an item found in old->table is moved to table,
+    // so that we can return an iterator to it
+    template <class K>
+    iterator _find_resizing(const K &key, size_t hashval)
+    {
+        Position pos = _find_position(key, hashval);
+        if (pos._t == pt_full)
+            return _mk_iterator(table.get_iter(pos._idx));
+        size_type oldbuck = _find_old_bucket(key, hashval);
+        return oldbuck == ILLEGAL_BUCKET ? end() : _move_old_bucket(oldbuck);
+    }
+
+    // find() const while resizing: looks in table, then in old->table,
+    // without moving anything
+    template <class K>
+    const_iterator _find_resizing(const K &key, size_t hashval) const
+    {
+        Position pos = _find_position(key, hashval);
+        if (pos._t == pt_full)
+            return _mk_const_iterator(table.get_iter(pos._idx));
+        size_type oldbuck = _find_old_bucket(key, hashval);
+        return oldbuck == ILLEGAL_BUCKET ? end() : _mk_const_iterator(extras->old->table.get_iter(oldbuck, table));
+    }
+
+    // Robin hood hashing support (see robin_hood_probing)
+    // --------------------------------------------------
+    // How far the item in bucket bucknum of t is from its home bucket.  It
+    // is stored with the item, unless too large to fit in a byte.
+    size_type _rh_distance(const Table &t, size_type bucknum) const
+    {
+        const size_type dist = t.distance(bucknum);
+        if (dist != Table::group_type::far_distance)
+            return dist;
+        return (bucknum - hash(get_key(t.unsafe_get(bucknum)))) & (t.size() - 1);
+    }
+
+    // Pushes the run of items starting at bucknum up by one bucket, so
+    // that bucknum is free for a new item
+    void _rh_make_room(size_type bucknum)
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        size_type free_bucket = bucknum;
+        while (table.test(free_bucket))
+            free_bucket = (free_bucket + 1) & bucket_count_minus_one;
+
+        while (free_bucket != bucknum)
+        {
+            size_type prev = (free_bucket - 1) & bucket_count_minus_one;
+            table.relocate(prev, free_bucket);
+            free_bucket = prev;
+        }
+    }
+
+    // Takes the item out of bucknum, and shifts the following items of the
+    // run back, so no erased marker is needed
+    void _rh_erase_bucket(size_type bucknum)
+    {
+        table.remove(bucknum);
+        _rh_close_gap(bucknum);
+        settings.set_consider_shrink(true); // will think about shrink after next insert
+    }
+
+    // Shifts the items of the run following the empty bucket bucknum back
+    // by one bucket.  Also undoes _rh_make_room(bucknum) when the new item
+    // could not be built.
+    void _rh_close_gap(size_type bucknum)
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        for (size_type next = (bucknum + 1) & bucket_count_minus_one;
+             table.test(next) && _rh_distance(table, next) != 0;
+             next = (next + 1) & bucket_count_minus_one)
+        {
+            table.relocate(next, bucknum);
+            bucknum = next;
+        }
+    }
+
+    // Returns the bucket where an item with hash hashval, which we know is
+    // not in the table, should go, making room for it if needed.  Used when
+    // rehashing, as we know there are no duplicates nor erased buckets.
+    // ----------------------------------------------------------------------
+    size_type _free_position(size_t hashval)
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        size_type bucknum = hashval & bucket_count_minus_one;
+
+        if (Probing::robin_hood)
+        {
+            for (size_type dist = 0; table.test(bucknum) && _rh_distance(table, bucknum) >= dist; ++dist)
+                bucknum = (bucknum + 1) & bucket_count_minus_one;
+            _rh_make_room(bucknum);
+            return bucknum;
+        }
+
+        size_type num_probes = 0;              // how many times we've probed
+        while (table.test(bucknum))            // table.test() OK since no erase()
+        {
+            ++num_probes;
+            assert(num_probes < bucket_count()
+                   && "Hashtable is full: an error in key_equal<> or hash<>");
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
+        }
+        return bucknum;
+    }
+
+    // Used to actually do the rehashing when we grow/shrink a hashtable
+    // -----------------------------------------------------------------
+    void _copy_from(const sparse_hashtable &ht, size_type min_buckets_wanted)
+    {
+        clear();            // clear table, set num_deleted to 0
+
+        // If we need to change the size of our table, do it now
+        const size_type resize_to = settings.min_buckets(ht.size(), min_buckets_wanted);
+
+        if (resize_to == ht.bucket_count() && !ht._resizing())
+        {
+            // Same number of buckets: the items can stay in their buckets,
+            // so clone ht's groups without hashing anything.  The erased
+            // buckets are kept as well, since the items after them in a
+            // probe sequence could not be found otherwise.
+            table.clone(ht.table);
+            num_deleted = ht.num_deleted;
+            settings.reset_thresholds(bucket_count());
+            settings.inc_num_ht_copies();
+            return;
+        }
+
+        if (resize_to > bucket_count())
+        {
+            // we don't have enough buckets
+            table.resize(resize_to);               // sets the number of buckets
+            settings.reset_thresholds(bucket_count());
+        }
+
+        // We use a normal iterator to get bcks from ht
+        // We could use insert() here, but since we know there are
+        // no duplicates, we can be more efficient
+        assert((bucket_count() & (bucket_count()-1)) == 0);      // a power of two
+        _copy_table(ht.table);
+        if (ht._resizing())
+            _copy_table(ht.extras->old->table);
+        settings.inc_num_ht_copies();
+    }
+
+    void _copy_table(const Table &t)
+    {
+        for (cne_it it = t.ne_cbegin(); it != t.ne_cend(); ++it)
+        {
+            const size_t hashval = hash(get_key(*it));
+            size_type bucknum = _free_position(hashval);
+            table.set(bucknum, *it);               // copies the value to here
+            table.set_hash(bucknum, hashval);
+        }
+    }
+
+    // Implementation is like _copy_from, but it destroys the table of the
+    // "from" guy by freeing sparsetable memory as we iterate.  This is
+    // useful in resizing, since we're throwing away the "from" guy anyway.
+    // --------------------------------------------------------------------
+    void _move_from(MoveDontCopyT mover, sparse_hashtable &ht,
+                   size_type min_buckets_wanted)
+    {
+        clear();
+        ht._finish_resize();
+
+        // If we need to change the size of our table, do it now
+        size_type resize_to;
+        if (mover == MoveDontGrow)
+            resize_to = ht.bucket_count();       // keep same size as old ht
+        else                                     // MoveDontCopy
+            resize_to = settings.min_buckets(ht.size(), min_buckets_wanted);
+        if (resize_to > bucket_count())
+        {
+            // we don't have enough buckets
+            table.resize(resize_to);               // sets the number of buckets
+            settings.reset_thresholds(bucket_count());
+        }
+
+        // We use a normal iterator to get bcks from ht
+        // We could use insert() here, but since we know there are
+        // no duplicates, we can be more efficient
+        assert((bucket_count() & (bucket_count()-1)) == 0);      // a power of two
+
+#ifdef SPP_PARALLEL_RESIZE
+        if (mover == MoveDontCopy && _parallel_move_from(ht))
+        {
+            settings.inc_num_ht_copies();
+            return;
+        }
+#endif
+
+        // THIS IS THE MAJOR LINE THAT DIFFERS FROM COPY_FROM():
+        for (destructive_iterator it = ht.destructive_begin();
+              it != ht.destructive_end(); ++it)
+        {
+            const size_t hashval = hash(get_key(*it));
+            size_type bucknum = _free_position(hashval);
+            table.move(bucknum, *it);    // moves the value to here
+            table.set_hash(bucknum, hashval);
+        }
+        settings.inc_num_ht_copies();
+    }
+
+#ifdef SPP_PARALLEL_RESIZE
+    // Calls work(t) for each t in [0, num_threads), each one in its own
+    // thread (work(0) in the calling thread), and rethrows the first
+    // exception they threw once they are all done
+    // ----------------------------------------------------------------------
+    template <class Work>
+    static void _run_threads(size_t num_threads, const Work &work)
+    {
+        std::vector<std::exception_ptr> errors(num_threads);
+
+        auto run = [&](size_t t)
+        {
+            try
+            {
+                work(t);
+            }
+            catch (...)
+            {
+                errors[t] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (size_t t = 1; t < num_threads; ++t)
+        {
+            try
+            {
+                threads.push_back(std::thread(run, t));
+            }
+            catch (...)
+            {
+                run(t);          // could not start a thread, do it here
+            }
+        }
+        run(0);
+        for (size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+
+        for (size_t t = 0; t < num_threads; ++t)
+            if (errors[t])
+                std::rethrow_exception(errors[t]);
+    }
+
+    // Parallel rehashing (see set_resize_threads())
+    // ---------------------------------------------
+    // When growing, an item's new home bucket, modulo the old bucket count,
+    // is its old home bucket.  So the old buckets are split in ranges of
+    // whole groups, one per thread, and each thread moves the items of its
+    // old groups whose home is in its range to the new buckets equal to
+    // its range modulo the old bucket count, which no other thread touches,
+    // freeing its old groups as it goes.  The few items that probe out of
+    // these buckets, or that are not in the range of their home bucket, are
+    // set aside, and moved by the calling thread once the others are done.
+    // Returns false, having done nothing, when a single thread would do.
+    // ----------------------------------------------------------------------
+    bool _parallel_move_from(sparse_hashtable &ht)
+    {
+        static const size_t min_groups_per_thread = 1024;
+
+        const size_t num_groups = ht.table.size() / SPP_GROUP_SIZE;
+        const size_t num_threads = (std::min)((size_t)get_resize_threads(),
+                                              num_groups / min_groups_per_thread);
+        if (num_threads <= 1 || Probing::robin_hood ||   // robin hood moves items around
+            !spp_::is_thread_safe_allocator<allocator_type>::value ||
+            bucket_count() < ht.bucket_count())
+            return false;
+
+        std::vector<std::vector<value_type> > set_aside(num_threads);
+        std::vector<size_type> num_moved(num_threads, 0);
+
+        _run_threads(num_threads, [&](size_t t)
+        {
+            _move_groups(ht, (size_type)(num_groups * t / num_threads),
+                         (size_type)(num_groups * (t + 1) / num_threads),
+                         set_aside[t], num_moved[t]);
+        });
+
+        size_type num_buckets = 0;
+        for (size_t t = 0; t < num_threads; ++t)
+            num_buckets += num_moved[t];
+        table.set_num_nonempty(num_buckets);
+        ht.table.clear();
+
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            for (size_t i = 0; i < set_aside[t].size(); ++i)
+            {
+                reference v = set_aside[t][i];
+                const size_t hashval = hash(get_key(v));
+                size_type bucknum = _free_position(hashval);
+                table.move(bucknum, v);
+                table.set_hash(bucknum, hashval);
+            }
+        }
+        return true;
+    }
+
+    // The work of one thread for _parallel_move_from(): moves the items of
+    // ht's groups [first_group, last_group) to table
+    void _move_groups(sparse_hashtable &ht, size_type first_group, size_type last_group,
+                      std::vector<value_type> &set_aside, size_type &num_moved)
+    {
+        const size_type old_mask = ht.bucket_count() - 1;
+        const size_type first = first_group * SPP_GROUP_SIZE;
+        const size_type len = (last_group - first_group) * SPP_GROUP_SIZE;
+
+        for (size_type g = first_group; g < last_group; ++g)
+        {
+            typename Table::GroupsReference grp(ht.table.which_group(g * SPP_GROUP_SIZE));
+            for (typename Table::ColIterator it = grp.ne_begin(); it != grp.ne_end(); ++it)
+            {
+                const size_t hashval = hash(get_key(*it));
+                size_type bucknum = ILLEGAL_BUCKET;
+                if (((hashval & old_mask) - first) < len)
+                    bucknum = _free_position_in(hashval, first, len, old_mask);
+
+                if (bucknum == ILLEGAL_BUCKET)
+                    set_aside.push_back(std::move(*it));
+                else
+                {
+                    table.move_uncounted(bucknum, *it);
+                    table.set_hash(bucknum, hashval);
+                    ++num_moved;
+                }
+            }
+            ht.table.clear_group_uncounted(g);
+        }
+    }
+
+    // Same as _free_position(), but only using the buckets whose number
+    // modulo the old bucket count is in [first, first + len).  Returns
+    // ILLEGAL_BUCKET if the probe sequence goes out of them first.
+    size_type _free_position_in(size_t hashval, size_type first, size_type len,
+                                size_type old_mask) const
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        size_type bucknum = hashval & bucket_count_minus_one;
+        size_type num_probes = 0;
+
+        while (table.test(bucknum))
+        {
+            ++num_probes;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
+            if (((bucknum & old_mask) - first) >= len)
+                return ILLEGAL_BUCKET;
+        }
+        return bucknum;
+    }
+
+    // Parallel build (see parallel_build()), into this empty table, already
+    // sized for the n items at first, with num_parts partitions of its
+    // buckets.  Index holds the positions of the items in the range.
+    // ----------------------------------------------------------------------
+    template <class Index, class RandomIt>
+    void _parallel_build(RandomIt first, size_type n, size_t num_threads, size_t num_parts)
+    {
+        const size_type mask = bucket_count() - 1;
+        const size_type part_len = bucket_count() / (size_type)num_parts;
+        size_t shift = 0;
+        while (((size_type)1 << shift) < part_len)
+            ++shift;
+
+        // List the items by partition, keeping their order in each one, each
+        // thread counting and then placing the items of its part of the range
+        // ------------------------------------------------------------------
+        std::vector<size_type> pos(num_threads * num_parts, 0);
+
+        _run_threads(num_threads, [&](size_t t)
+        {
+            size_type *cnt = &pos[t * num_parts];
+            for (size_type i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+            {
+                const value_type &v = first[i];
+                ++cnt[(hash(get_key(v)) & mask) >> shift];
+            }
+        });
+
+        std::vector<size_type> part_start(num_parts + 1);
+        size_type start = 0;
+        for (size_t p = 0; p < num_parts; ++p)
+        {
+            part_start[p] = start;
+            for (size_t t = 0; t < num_threads; ++t)
+            {
+                const size_type cnt = pos[t * num_parts + p];
+                pos[t * num_parts + p] = start;
+                start += cnt;
+            }
+        }
+        part_start[num_parts] = n;
+
+        std::vector<Index> order(n);
+        _run_threads(num_threads, [&](size_t t)
+        {
+            size_type *next = &pos[t * num_parts];
+            for (size_type i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+            {
+                const value_type &v = first[i];
+                order[next[(hash(get_key(v)) & mask) >> shift]++] = (Index)i;
+            }
+        });
+
+        // Each thread builds the partitions it takes, one at a time
+        // ---------------------------------------------------------
+        std::vector<std::vector<Index> > set_aside(num_parts);
+        std::vector<size_type> num_built(num_parts, 0);
+        std::atomic<size_t> next_part(0);
+
+        try
+        {
+            _run_threads(num_threads, [&](size_t)
+            {
+                std::vector<Index> slots(part_len, (Index)-1);
+                for (size_t p; (p = next_part++) < num_parts; )
+                    _build_part(first, &order[part_start[p]], part_start[p + 1] - part_start[p],
+                                p * part_len, slots, set_aside[p], num_built[p]);
+            });
+        }
+        catch (...)
+        {
+            size_type num = 0;
+            for (size_t p = 0; p < num_parts; ++p)
+                num += num_built[p];
+            table.set_num_nonempty(num);
+            throw;
+        }
+
+        size_type num = 0;
+        for (size_t p = 0; p < num_parts; ++p)
+            num += num_built[p];
+        table.set_num_nonempty(num);
+
+        for (size_t p = 0; p < num_parts; ++p)
+        {
+            for (size_t i = 0; i < set_aside[p].size(); ++i)
+            {
+                const value_type &v = first[set_aside[p][i]];
+                _insert_noresize(v);
+            }
+        }
+    }
+
+    // Builds the buckets [first_bucket, first_bucket + slots.size()) from the
+    // items at idx[0, cnt): first finds the bucket of each one, skipping the
+    // keys already seen, or sets it aside if its probe sequence leaves these
+    // buckets, then fills each group at once
+    template <class Index, class RandomIt>
+    void _build_part(RandomIt first, const Index *idx, size_type cnt, size_type first_bucket,
+                     std::vector<Index> &slots, std::vector<Index> &set_aside,
+                     size_type &num_built)
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        const size_type len = (size_type)slots.size();
+
+        for (size_type i = 0; i < cnt; ++i)
+        {
+            const value_type &v = first[idx[i]];
+            size_type bucknum = hash(get_key(v)) & bucket_count_minus_one;
+            size_type num_probes = 0;
+
+            while (1)
+            {
+                const size_type slot = bucknum - first_bucket;
+                if (slot >= len)
+                {
+                    set_aside.push_back(idx[i]);
+                    break;
+                }
+                if (slots[slot] == (Index)-1)
+                {
+                    slots[slot] = idx[i];
+                    break;
+                }
+                const value_type &o = first[slots[slot]];
+                if (equals(get_key(v), get_key(o)))
+                    break;                       // a duplicate, the first one stays
+                ++num_probes;
+                bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
+            }
+        }
+
+        for (size_type g = 0; g < len; g += SPP_GROUP_SIZE)
+        {
+            const Index *grp_slots = &slots[g];
+            group_bm_type bm = 0;
+            for (size_type i = 0; i < SPP_GROUP_SIZE; ++i)
+                if (grp_slots[i] != (Index)-1)
+                    bm |= static_cast<group_bm_type>(1) << i;
+            if (!bm)
+                continue;
+
+            auto init = [&](void *p, size_type i)
+            {
+                ::new (p) value_type(first[grp_slots[i]]);
+            };
+            table.fill_group_uncounted((first_bucket + g) / SPP_GROUP_SIZE, bm, init);
+            num_built += spp_popcount(bm);
+
+            if (Table::has_fingerprints)
+            {
+                for (size_type i = 0; i < SPP_GROUP_SIZE; ++i)
+                {
+                    if (grp_slots[i] != (Index)-1)
+                    {
+                        const value_type &o = first[grp_slots[i]];
+                        table.set_hash(first_bucket + g + i, hash(get_key(o)));
+                    }
+                }
+            }
+        }
+        std::fill(slots.begin(), slots.end(), (Index)-1);
+    }
+#endif
+
+    // Required by the spec for hashed associative container
+public:
+    // Though the docs say this should be num_buckets, I think it's much
+    // more useful as num_elements.  As a special feature, calling with
+    // req_elements==0 will cause us to shrink if we can, saving space.
+    // -----------------------------------------------------------------
+    void resize(size_type req_elements)
+    {
+        // resize to this or larger
+        if (settings.consider_shrink() || req_elements == 0)
+            _maybe_shrink();
+        if (req_elements > size())    // we only grow
+            _resize_delta((size_type)(req_elements - size()));
+    }
+
+    // Incremental resizing: instead of moving all the items to a new table
+    // at once, when an insert finds the table full, or shrinks it after
+    // many erases, keep both tables and move groups_per_op groups (of
+    // SPP_GROUP_SIZE buckets) of the old one to the new one on each
+    // following insert, erase and non-const find(), which bounds the time
+    // taken by any single call.  As the old groups are freed when moved,
+    // the peak memory use is the same.
+    // Lookups check both tables while a resize is in progress.  The non
+    // const ones move the item they find in the old table, but the const
+    // ones change nothing, so they can run concurrently as usual.  The
+    // iterators go over both tables, but while a resize is in progress,
+    // an insert, an erase of a key, or a non-const find() or at() (which
+    // may move the item it finds) invalidates iterators, pointers and
+    // references to the items.
+    // groups_per_op == 0 (the default) resizes all at once.
+    // ---------------------------------------------------------------------
+    void set_incremental_resize(size_type groups_per_op)
+    {
+        if (groups_per_op || extras)
+            _extras().resize_step = groups_per_op;
+        if (groups_per_op == 0)
+            _finish_resize();
+    }
+
+    size_type get_incremental_resize() const { return _groups_per_step(); }
+
+    // Erased buckets stay marked as such, and make lookups probe further,
+    // until the table is rebuilt.  purge_deleted() rebuilds it with the
+    // same number of buckets, which gets rid of them.  In incremental
+    // resize mode, this is done group by group over the next operations,
+    // like a resize, otherwise all at once.
+    // Setting a purge factor f > 0 does it automatically on insert, when
+    // more than bucket_count() * f buckets are erased (0, the default,
+    // never does).
+    // ---------------------------------------------------------------------
+    void purge_deleted()
+    {
+        _finish_resize();
+        if (num_deleted == 0)
+            return;
+        if (_groups_per_step())
+            _start_resize(bucket_count());
+        else
+        {
+            write_guard w(*this);
+            sparse_hashtable tmp(MoveDontGrow, *this, bucket_count());
+            swap(tmp);                            // now we are tmp
+        }
+    }
+
+    // Frees all the memory we can: shrinks the table if resize(0) would,
+    // gets rid of the erased buckets, and reallocates the item array of
+    // each group to its exact size.  Useful after a bulk load, or after
+    // erasing many items from a table which will not grow again soon.
+    // ---------------------------------------------------------------------
+    void shrink_to_fit()
+    {
+        _finish_resize();
+        _maybe_shrink();
+        _finish_resize();
+        if (num_deleted)
+        {
+            write_guard w(*this);
+            sparse_hashtable tmp(MoveDontGrow, *this, bucket_count());
+            swap(tmp);                            // now we are tmp
+        }
+        table.shrink_to_fit();
+    }
+
+    // The memory used by the table, in O(bucket_count() / SPP_GROUP_SIZE),
+    // see memory_usage_info.  During an incremental resize, the groups
+    // not moved yet from the old table, and the old table itself, are included.
+    // ---------------------------------------------------------------------
+    memory_usage_info memory_usage() const
+    {
+        memory_usage_info mu;
+        table.add_memory_usage(mu);
+        if (_resizing())
+        {
+            mu.group_bytes += sizeof(OldTable);
+            extras->old->table.add_memory_usage(mu);
+        }
+        mu.num_erased = num_deleted;
+        return mu;
+    }
+
+    // The memory obtained from the system by the allocator, when it manages
+    // its own space (spp_allocator, spp_slab_allocator), 0 otherwise.  This
+    // space may be shared with other tables, see spp_allocator(MSpace *).
+    // trim_allocator() gives the unused part of it back to the system,
+    // keeping pad bytes, and returns 1 if it released some memory.
+    // ---------------------------------------------------------------------
+    size_t allocator_footprint() const
+    {
+        return spp_::allocator_hooks<allocator_type>::footprint(get_allocator());
+    }
+
+    size_t allocator_max_footprint() const
+    {
+        return spp_::allocator_hooks<allocator_type>::max_footprint(get_allocator());
+    }
+
+    int trim_allocator(size_t pad = 0)
+    {
+        allocator_type alloc = get_allocator();    // shares the space with ours
+        return spp_::allocator_hooks<allocator_type>::trim(alloc, pad);
+    }
+
+    // Caps the memory used by the table to bytes, 0 for no limit (the
+    // default).  This counts the group array and the items, that is
+    // memory_usage().total() less the slack_bytes allocated ahead.  When
+    // an insert, or the resize that it triggers, would need more,
+    // hook(ctx, used, needed) is called first, and may refuse the insert,
+    // erase items from the table to make room (but not insert any), or let
+    // the table go over the budget.
+    // Without a hook, the insert is refused.  A refused insert throws
+    // std::length_error and leaves the table unchanged.  The check happens
+    // before the key is looked up (as for growing the table), in O(1).
+    // The budget is copied and swapped with the table, but a copy does not
+    // keep the hook, which would still see the original table.
+    // ---------------------------------------------------------------------
+    void set_memory_budget(size_t bytes, memory_budget_hook hook = 0, void *ctx = 0)
+    {
+        if (!bytes && !extras)
+            return;
+        Extras &e = _extras();
+        e.budget_bytes = bytes;
+        e.budget_hook  = bytes ? hook : 0;
+        e.budget_ctx   = bytes ? ctx : 0;
+    }
+
+    size_t get_memory_budget() const { return extras ? extras->budget_bytes : 0; }
+
+    float get_purge_factor() const  { return extras ? extras->purge_factor : 0; }
+
+    void set_purge_factor(float f)
+    {
+        if (f || extras)
+            _extras().purge_factor = f;
+    }
+
+#ifdef SPP_PARALLEL_RESIZE
+    // Lets the rehashing done when the table grows use up to num_threads
+    // threads (1 by default), for large tables.  Only available when
+    // SPP_PARALLEL_RESIZE is defined, with C++11.  The allocator must then
+    // support being used from several threads at once, and the hasher
+    // must support concurrent calls.  The resizes done by shrinking, by an
+    // incremental resize (see above), or with robin_hood_probing, which
+    // moves items around as it inserts, still use a single thread.
+    // ---------------------------------------------------------------------
+    void set_resize_threads(unsigned int num_threads)
+    {
+        if (num_threads != 1 || extras)
+            _extras().resize_threads = num_threads;
+    }
+
+    unsigned int get_resize_threads() const { return extras ? extras->resize_threads : 1; }
+
+    // Inserts the items of [first, last), as insert(first, last) does, with
+    // up to num_threads threads, to build large tables.  The items are
+    // partitioned by the high bits of their home bucket, then each thread
+    // fills the groups of the partitions it takes, allocating each item
+    // array once.  The few items whose probe sequence leaves their partition
+    // are inserted by the calling thread at the end.  The iterators must be
+    // random access, and a range of value_type avoids a conversion at each
+    // access.  The requirements of set_resize_threads() apply.  Into a table
+    // which is not empty, with robin_hood_probing, or for small ranges, this
+    // is the same as insert(first, last).
+    // ----------------------------------------------------------------------
+    template <class RandomIt>
+    void parallel_build(RandomIt first, RandomIt last, unsigned int num_threads)
+    {
+        static const size_t min_groups_per_part = 1024;
+
+        const size_type n = static_cast<size_type>(last - first);
+        if (!empty() || num_threads <= 1 || Probing::robin_hood ||
+            !spp_::is_thread_safe_allocator<allocator_type>::value)
+        {
+            insert(first, last);
+            return;
+        }
+
+        clear();                        // drops the erased marks, if any
+        _resize_delta(n);
+        _finish_resize();
+
+        // a few partitions per thread, for balance
+        const size_t num_groups = bucket_count() / SPP_GROUP_SIZE;
+        size_t num_parts = 1;
+        while (num_parts < 4 * (size_t)num_threads &&
+               num_parts * 2 * min_groups_per_part <= num_groups)
+            num_parts *= 2;
+        if (num_parts == 1)
+        {
+            insert(first, last);
+            return;
+        }
+
+        write_guard w(*this);
+        const size_t threads = (std::min)((size_t)num_threads, num_parts);
+        if (n < (size_type)(std::numeric_limits<uint32_t>::max)())
+            _parallel_build<uint32_t>(first, n, threads, num_parts);
+        else
+            _parallel_build<size_type>(first, n, threads, num_parts);
+    }
+#endif
+
+    bool resize_in_progress() const { return _resizing(); }
+
+    // Get and change the value of shrink_factor and enlarge_factor.  The
+    // description at the beginning of this file explains how to choose
+    // the values.  Setting the shrink parameter to 0.0 ensures that the
+    // table never shrinks.
+    // ------------------------------------------------------------------
+    void get_resizing_parameters(float* shrink, float* grow) const
+    {
+        *shrink = settings.shrink_factor();
+        *grow = settings.enlarge_factor();
+    }
+
+    float get_shrink_factor() const  { return settings.shrink_factor(); }
+    float get_enlarge_factor() const { return settings.enlarge_factor(); }
+
+    void set_resizing_parameters(float shrink, float grow) 
+    {
+        settings.set_resizing_parameters(shrink, grow);
+        settings.reset_thresholds(bucket_count());
+    }
+
+    void set_shrink_factor(float shrink)
+    {
+        set_resizing_parameters(shrink, get_enlarge_factor());
+    }
+
+    void set_enlarge_factor(float grow)
+    {
+        set_resizing_parameters(get_shrink_factor(), grow);
+    }
+
+    // CONSTRUCTORS -- as required by the specs, we take a size,
+    // but also let you specify a hashfunction, key comparator,
+    // and key extractor.  We also define a copy constructor and =.
+    // DESTRUCTOR -- only frees the extras, see Extras.
+    // ------------------------------------------------------------
     explicit sparse_hashtable(size_type expected_max_items_in_table = 0,
                               const HashFcn& hf = HashFcn(),
                               const EqualKey& eql = EqualKey(),
@@ -2899,11 +4538,18 @@ public:
           table((expected_max_items_in_table == 0
                  ? HT_DEFAULT_STARTING_BUCKETS
                  : settings.min_buckets(expected_max_items_in_table, 0)),
-                alloc)
+                alloc),
+          extras(0)
     {
         settings.reset_thresholds(bucket_count());
     }
 
+    ~sparse_hashtable()
+    {
+        _free_old_table();
+        delete extras;
+    }
+
     // As a convenience for resize(), we allow an optional second argument
     // which lets you make this new hashtable a different size than ht.
     // We also provide a mechanism of saying you want to "move" the ht argument
@@ -2914,10 +4560,12 @@ public:
         : settings(ht.settings),
           key_info(ht.key_info),
           num_deleted(0),
-          table(0)
+          table(0),
+          extras(0)
     {
         settings.reset_thresholds(bucket_count());
         _copy_from(ht, min_buckets_wanted);
+        _copy_extras(ht);
     }
 
 #if !defined(SPP_NO_CXX11_RVALUE_REFERENCES)
@@ -2926,7 +4574,8 @@ public:
         settings(o.settings),
         key_info(o.key_info),
         num_deleted(0),
-        table(HT_DEFAULT_STARTING_BUCKETS, alloc)
+        table(HT_DEFAULT_STARTING_BUCKETS, alloc),
+        extras(0)
     {
         settings.reset_thresholds(bucket_count());
         this->swap(o);
@@ -2945,23 +4594,36 @@ public:
         : settings(ht.settings),
           key_info(ht.key_info),
           num_deleted(0),
-          table(min_buckets_wanted, ht.table.get_allocator())
+          table(min_buckets_wanted, ht.table.get_allocator()),
           //table(min_buckets_wanted)
+          extras(0)
     {
         settings.reset_thresholds(bucket_count());
-        _move_from(mover, ht, min_buckets_wanted);
+        ht._finish_resize();
+        std::swap(extras, ht.extras);   // given back when a resize swaps us with ht
+        try
+        {
+            _move_from(mover, ht, min_buckets_wanted);
+        }
+        catch (...)
+        {
+            std::swap(extras, ht.extras);
+            throw;
+        }
     }
 
     sparse_hashtable& operator=(const sparse_hashtable& ht)
     {
         if (&ht == this)
             return *this;        // don't copy onto ourselves
+        write_guard w(*this);
         settings = ht.settings;
         key_info = ht.key_info;
         num_deleted = ht.num_deleted;
 
         // _copy_from() calls clear and sets num_deleted to 0 too
         _copy_from(ht, HT_MIN_BUCKETS);
+        _copy_extras(ht);
 
         // we purposefully don't copy the allocator, which may not be copyable
         return *this;
@@ -2971,11 +4633,13 @@ public:
     void swap(sparse_hashtable& ht)
     {
         using std::swap;
+        write_guard w(*this), wht(ht);
 
         swap(settings, ht.settings);
         swap(key_info, ht.key_info);
         swap(num_deleted, ht.num_deleted);
         table.swap(ht.table);
+        swap(extras, ht.extras);
         settings.reset_thresholds(bucket_count());  // also resets consider_shrink
         ht.settings.reset_thresholds(ht.bucket_count());
         // we purposefully don't swap the allocator, which may not be swap-able
@@ -2984,11 +4648,13 @@ public:
     // It's always nice to be able to clear a table without deallocating it
     void clear()
     {
+        write_guard w(*this);
         if (!empty() || num_deleted != 0)
         {
             table.clear();
             table = Table(HT_DEFAULT_STARTING_BUCKETS, table.get_allocator());
         }
+        _free_old_table();
         settings.reset_thresholds(bucket_count());
         num_deleted = 0;
     }
@@ -3009,17 +4675,55 @@ private:
         size_type _idx;
     };
 
+    // With robin hood probing, the search stops at the first item closer
+    // to its home bucket than key would be.  When key is not found, the
+    // returned position is where it should be inserted, which may be
+    // occupied (_insert_at() then makes room).
+    // -------------------------------------------------------------------
+    template <class K>
+    Position _rh_find_position(const K &key, size_t hashval) const
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        size_type bucknum = hashval & bucket_count_minus_one;
+
+        for (size_type dist = 0; ; ++dist)
+        {
+            typename Table::GrpPos grp_pos(table, bucknum);
+
+            if (!grp_pos.test())
+                return Position(pt_empty, bucknum);
+            if (grp_pos.match_fingerprint(hashval) &&
+                equals(key, get_key(grp_pos.unsafe_get())))
+                return Position(pt_full, bucknum);
+            if (_rh_distance(table, bucknum) < dist)
+                return Position(pt_empty, bucknum);   // key would be here
+            bucknum = (bucknum + 1) & bucket_count_minus_one;
+            assert(dist < bucket_count()
+                   && "Hashtable is full: an error in key_equal<> or hash<>");
+        }
+    }
+
     // Returns a pair:
     //   - 'first' is a code, 2 if key already present, 0 or 1 otherwise.
     //   - 'second' is a position, where the key should go
     // Note: because of deletions where-to-insert is not trivial: it's the
     // first deleted bucket we see, as long as we don't find the key later
     // -------------------------------------------------------------------
-    Position _find_position(const key_type &key) const
+    template <class K>
+    Position _find_position(const K &key) const
+    {
+        return _find_position(key, hash(key));
+    }
+
+    template <class K>
+    Position _find_position(const K &key, size_t hashval) const
     {
+        if (Probing::robin_hood)
+            return _rh_find_position(key, hashval);
+
         size_type num_probes = 0;                    // how many times we've probed
         const size_type bucket_count_minus_one = (const size_type)(bucket_count() - 1);
-        size_type bucknum = hash(key) & bucket_count_minus_one;
+        size_type bucknum = hashval & bucket_count_minus_one;
         Position pos;
 
         while (1)
@@ -3035,9 +4739,8 @@ private:
             }
             else if (grp_pos.test())
             {
-                reference ref(grp_pos.unsafe_get());
-
-                if (equals(key, get_key(ref)))
+                if (grp_pos.match_fingerprint(hashval) &&
+                    equals(key, get_key(grp_pos.unsafe_get())))
                     return Position(pt_full, bucknum);
             }
             else if (pos._t == pt_empty)
@@ -3048,7 +4751,7 @@ private:
             }
 
             ++num_probes;                        // we're doing another probe
-            bucknum = (size_type)((bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one);
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
             assert(num_probes < bucket_count()
                    && "Hashtable is full: an error in key_equal<> or hash<>");
         }
@@ -3058,11 +4761,30 @@ public:
     // I hate to duplicate find() like that, but it is
     // significantly faster to not have the intermediate pair
     // ------------------------------------------------------------------
-    iterator find(const key_type& key)
+    template <class K>
+    iterator find(const K& key)
     {
+        return find(key, hash(key));
+    }
+
+    // hashval must be hash(key), see hash() below
+    template <class K>
+    iterator find(const K& key, size_t hashval)
+    {
+        if (_resizing())
+        {
+            _resize_step(extras->resize_step);
+            return _find_resizing(key, hashval);
+        }
+        if (Probing::robin_hood)
+        {
+            Position pos = _rh_find_position(key, hashval);
+            return pos._t == pt_full ? _mk_iterator(table.get_iter(pos._idx)) : end();
+        }
+
         size_type num_probes = 0;              // how many times we've probed
         const size_type bucket_count_minus_one = bucket_count() - 1;
-        size_type bucknum = hash(key) & bucket_count_minus_one;
+        size_type bucknum = hashval & bucket_count_minus_one;
 
         while (1)                        // probe until something happens
         {
@@ -3070,7 +4792,7 @@ public:
 
             if (!grp_pos.test_strict())
                 return end();            // bucket is empty
-            if (grp_pos.test())
+            if (grp_pos.test() && grp_pos.match_fingerprint(hashval))
             {
                 reference ref(grp_pos.unsafe_get());
 
@@ -3078,7 +4800,7 @@ public:
                     return grp_pos.get_iter(ref);
             }
             ++num_probes;                        // we're doing another probe
-            bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
             assert(num_probes < bucket_count()
                    && "Hashtable is full: an error in key_equal<> or hash<>");
         }
@@ -3086,11 +4808,26 @@ public:
 
     // Wish I could avoid the duplicate find() const and non-const.
     // ------------------------------------------------------------
-    const_iterator find(const key_type& key) const
+    template <class K>
+    const_iterator find(const K& key) const
+    {
+        return find(key, hash(key));
+    }
+
+    template <class K>
+    const_iterator find(const K& key, size_t hashval) const
     {
+        if (_resizing())
+            return _find_resizing(key, hashval);
+        if (Probing::robin_hood)
+        {
+            Position pos = _rh_find_position(key, hashval);
+            return pos._t == pt_full ? _mk_const_iterator(table.get_iter(pos._idx)) : end();
+        }
+
         size_type num_probes = 0;              // how many times we've probed
         const size_type bucket_count_minus_one = bucket_count() - 1;
-        size_type bucknum = hash(key) & bucket_count_minus_one;
+        size_type bucknum = hashval & bucket_count_minus_one;
 
         while (1)                        // probe until something happens
         {
@@ -3098,7 +4835,7 @@ public:
 
             if (!grp_pos.test_strict())
                 return end();            // bucket is empty
-            else if (grp_pos.test())
+            else if (grp_pos.test() && grp_pos.match_fingerprint(hashval))
             {
                 reference ref(grp_pos.unsafe_get());
 
@@ -3106,12 +4843,152 @@ public:
                     return _mk_const_iterator(table.get_iter(bucknum, &ref));
             }
             ++num_probes;                        // we're doing another probe
-            bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
             assert(num_probes < bucket_count()
                    && "Hashtable is full: an error in key_equal<> or hash<>");
         }
     }
 
+private:
+    // Hashes a batch of keys, then prefetches their groups, then the slots
+    // within the groups, so that the cache misses of independent lookups
+    // overlap instead of being taken one after the other.
+    // --------------------------------------------------------------------
+    template <class K>
+    void _prefetch_batch(const K *keys, size_type n, size_t *hashes) const
+    {
+        const size_type bucket_count_minus_one = bucket_count() - 1;
+        for (size_type i = 0; i < n; ++i)
+        {
+            hashes[i] = hash(keys[i]);
+            table.prefetch_group(hashes[i] & bucket_count_minus_one);
+        }
+        for (size_type i = 0; i < n; ++i)
+            table.prefetch_slot(hashes[i] & bucket_count_minus_one);
+    }
+
+public:
+    // Hints that key will be looked up soon: prefetches its home bucket's
+    // group and, through the group's bitmap, the slot where the value is
+    // (or would be) stored.  Does not compare keys nor change anything.
+    // ---------------------------------------------------------------------
+    template <class K>
+    void prefetch(const K& key) const
+    {
+        prefetch(key, hash(key));
+    }
+
+    template <class K>
+    void prefetch(const K&, size_t hashval) const
+    {
+        const size_type bucknum = hashval & (bucket_count() - 1);
+        table.prefetch_group(bucknum);
+        table.prefetch_slot(bucknum);
+    }
+
+    // Looks up the n keys starting at keys, and writes n iterators (end()
+    // for the missing keys) to out.  Faster than n calls to find() when the
+    // table does not fit in cache.  Returns out past the last iterator.
+    // ---------------------------------------------------------------------
+    template <class K, class OutputIterator>
+    OutputIterator find_many(const K *keys, size_type n, OutputIterator out)
+    {
+        const size_type batch_size = 16;
+        size_t hashes[batch_size];
+
+        for (size_type i = 0; i < n; i += batch_size)
+        {
+            size_type cnt = (std::min)(n - i, batch_size);
+            _prefetch_batch(keys + i, cnt, hashes);
+            for (size_type j = 0; j < cnt; ++j)
+                *out++ = find(keys[i + j], hashes[j]);
+        }
+        return out;
+    }
+
+    template <class K, class OutputIterator>
+    OutputIterator find_many(const K *keys, size_type n, OutputIterator out) const
+    {
+        const size_type batch_size = 16;
+        size_t hashes[batch_size];
+
+        for (size_type i = 0; i < n; i += batch_size)
+        {
+            size_type cnt = (std::min)(n - i, batch_size);
+            _prefetch_batch(keys + i, cnt, hashes);
+            for (size_type j = 0; j < cnt; ++j)
+                *out++ = find(keys[i + j], hashes[j]);
+        }
+        return out;
+    }
+
+    // Looks up key while a single writer may be changing the table, which
+    // needs an allocator declaring use_versions (see spp_optimistic.h).
+    // Copies the item found to out, raw storage for a value_type.  The
+    // copy is only used once the versions of the table, and of the group it
+    // was read from, show it was not changed meanwhile, otherwise it is
+    // read again.  The memory the writer frees must stay readable until
+    // the lookup returns (see spp::epoch_allocator).
+    // ---------------------------------------------------------------------
+    template <class K>
+    bool optimistic_find(const K &key, void *out) const
+    {
+        typedef typename Table::group_type group_type;
+
+        const size_t hashval = hash(key);
+        while (1)
+        {
+            const uint32_t v = this->read_begin();
+            int res = _read_optimistic(table, v, key, hashval, out);
+            const Extras *e = extras;
+            const OldTable *o = e ? e->old : 0;
+            if (res == group_type::read_empty && o)
+                res = _read_optimistic(o->table, v, key, hashval, out);  // if resizing
+            if (res != group_type::read_retry && this->read_validate(v))
+                return res == group_type::read_full;
+        }
+    }
+
+private:
+    // The probe sequence of optimistic_find() in t, read in the layout of
+    // version v of the table.  Returns read_full, read_empty or read_retry.
+    template <class K>
+    int _read_optimistic(const Table &t, uint32_t v, const K &key, size_t hashval,
+                         void *out) const
+    {
+        typedef typename Table::group_type group_type;
+
+        const group_type *groups;
+        size_type num_buckets;
+        t.read_layout(groups, num_buckets);
+        if (!this->read_validate(v))
+            return group_type::read_retry;
+        if (num_buckets == 0)
+            return group_type::read_empty;
+
+        const size_type bucket_count_minus_one = num_buckets - 1;
+        size_type bucknum = hashval & bucket_count_minus_one;
+        for (size_type num_probes = 0; num_probes < num_buckets; )
+        {
+            int res = groups[t.group_num(bucknum)].read_optimistic(t.pos_in_group(bucknum), out);
+            if (res == group_type::read_retry)
+            {
+                if (!this->read_validate(v))
+                    return group_type::read_retry;
+                continue;                        // the group changed, read it again
+            }
+            if (res == group_type::read_empty)
+                return res;
+            if (res == group_type::read_full &&
+                equals(key, get_key(*static_cast<const value_type *>(out))))
+                return res;
+            ++num_probes;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
+        }
+        return group_type::read_empty;
+    }
+
+public:
     // This is a tr1 method: the bucket a given key is in, or what bucket
     // it would be put in, if it were to be inserted.  Shrug.
     // ------------------------------------------------------------------
@@ -3123,15 +5000,24 @@ public:
 
     // Counts how many elements have key key.  For maps, it's either 0 or 1.
     // ---------------------------------------------------------------------
-    size_type count(const key_type &key) const
+    template <class K>
+    size_type count(const K &key) const
     {
-        Position pos = _find_position(key);
-        return (size_type)(pos._t == pt_full ? 1 : 0);
+        return count(key, hash(key));
+    }
+
+    template <class K>
+    size_type count(const K &key, size_t hashval) const
+    {
+        Position pos = _find_position(key, hashval);
+        return (size_type)(pos._t == pt_full ||
+                           _find_old_bucket(key, hashval) != ILLEGAL_BUCKET ? 1 : 0);
     }
 
     // Likewise, equal_range doesn't really make sense for us.  Oh well.
     // -----------------------------------------------------------------
-    std::pair<iterator,iterator> equal_range(const key_type& key)
+    template <class K>
+    std::pair<iterator,iterator> equal_range(const K& key)
     {
         iterator pos = find(key);      // either an iterator or end
         if (pos == end())
@@ -3143,7 +5029,8 @@ public:
         }
     }
 
-    std::pair<const_iterator,const_iterator> equal_range(const key_type& key) const
+    template <class K>
+    std::pair<const_iterator,const_iterator> equal_range(const K& key) const
     {
         const_iterator pos = find(key);      // either an iterator or end
         if (pos == end())
@@ -3160,30 +5047,82 @@ public:
 private:
     // Private method used by insert_noresize and find_or_insert.
     template <class T>
-    reference _insert_at(T& obj, size_type pos, bool erased)
+    reference _insert_at(T& obj, size_type pos, bool erased, size_t hashval)
     {
         if (size() >= max_size())
         {
             throw_exception(std::length_error("insert overflow"));
         }
-        if (erased)
+        if (Probing::robin_hood)
+            _rh_make_room(pos);
+        try
         {
-            assert(num_deleted);
-            --num_deleted;
+            reference ref(table.set(pos, obj));
+            table.set_hash(pos, hashval);
+            if (erased)
+            {
+                assert(num_deleted);
+                --num_deleted;
+            }
+            return ref;
+        }
+        catch (...)
+        {
+            if (Probing::robin_hood)
+                _rh_close_gap(pos);    // or the items after pos can't be found
+            throw;
+        }
+    }
+
+    // Same as _insert_at, but constructs the value in place with init(p)
+    template <class Init>
+    reference _emplace_at(Init& init, size_type pos, bool erased, size_t hashval)
+    {
+        if (size() >= max_size())
+        {
+            throw_exception(std::length_error("insert overflow"));
+        }
+        if (Probing::robin_hood)
+            _rh_make_room(pos);
+        try
+        {
+            reference ref(table.emplace(pos, init));
+            table.set_hash(pos, hashval);
+            if (erased)
+            {
+                assert(num_deleted);
+                --num_deleted;
+            }
+            return ref;
+        }
+        catch (...)
+        {
+            if (Probing::robin_hood)
+                _rh_close_gap(pos);    // or the items after pos can't be found
+            throw;
         }
-        return table.set(pos, obj);
     }
 
     // If you know *this is big enough to hold obj, use this routine
     template <class T>
     std::pair<iterator, bool> _insert_noresize(T& obj)
     {
-        Position pos = _find_position(get_key(obj));
+        return _insert_noresize(obj, hash(get_key(obj)));
+    }
+
+    template <class T>
+    std::pair<iterator, bool> _insert_noresize(T& obj, size_t hashval)
+    {
+        Position pos = _find_position(get_key(obj), hashval);
         bool already_there = (pos._t == pt_full);
 
         if (!already_there)
         {
-            reference ref(_insert_at(obj, pos._idx, pos._t == pt_erased));
+            size_type oldbuck = _find_old_bucket(get_key(obj), hashval);
+            if (oldbuck != ILLEGAL_BUCKET)
+                return std::pair<iterator, bool>(_move_old_bucket(oldbuck), false);
+
+            reference ref(_insert_at(obj, pos._idx, pos._t == pt_erased, hashval));
             return std::pair<iterator, bool>(_mk_iterator(table.get_iter(pos._idx, &ref)), true);
         }
         return std::pair<iterator,bool>(_mk_iterator(table.get_iter(pos._idx)), false);
@@ -3200,8 +5139,12 @@ private:
 
         _resize_delta(static_cast<size_type>(dist));
 
+        // copies the items, even when *f is a non-const reference
         for (; dist > 0; --dist, ++f)
-            _insert_noresize(*f);
+        {
+            const_reference obj = *f;
+            _insert_noresize(obj);
+        }
     }
 
     // (2) Arbitrary iterator, can't tell how much to resize
@@ -3209,7 +5152,10 @@ private:
     void _insert(InputIterator f, InputIterator l, std::input_iterator_tag /*unused*/)
     {
         for (; f != l; ++f)
-            _insert(*f);
+        {
+            const_reference obj = *f;
+            insert(obj);
+        }
     }
 
 public:
@@ -3222,6 +5168,15 @@ public:
         value_type obj(std::forward<Args>(args)...);
         return _insert_noresize(obj);
     }
+
+    // hashval must be the hash() of the key of the constructed value
+    template <class... Args>
+    std::pair<iterator, bool> emplace_with_hash(size_t hashval, Args&&... args)
+    {
+        _resize_delta(1);
+        value_type obj(std::forward<Args>(args)...);
+        return _insert_noresize(obj, hashval);
+    }
 #endif
 
     // This is the normal insert routine, used by the outside world
@@ -3231,6 +5186,12 @@ public:
         return _insert_noresize(obj);
     }
 
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, const_reference obj)
+    {
+        _resize_delta(1);                      // adding an object, grow if need be
+        return _insert_noresize(obj, hashval);
+    }
+
 #if !defined(SPP_NO_CXX11_RVALUE_REFERENCES)
     template< class P >
     std::pair<iterator, bool> insert(P &&obj)
@@ -3239,6 +5200,14 @@ public:
         value_type val(std::forward<P>(obj));
         return _insert_noresize(val);
     }
+
+    template< class P >
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, P &&obj)
+    {
+        _resize_delta(1);                      // adding an object, grow if need be
+        value_type val(std::forward<P>(obj));
+        return _insert_noresize(val, hashval);
+    }
 #endif
 
     // When inserting a lot at a time, we specialize on the type of iterator
@@ -3250,20 +5219,79 @@ public:
                typename std::iterator_traits<InputIterator>::iterator_category());
     }
 
-    // DefaultValue is a functor that takes a key and returns a value_type
-    // representing the default value to be inserted if none is found.
+private:
+    // Used by find_or_insert() to construct the default value in place
+    // -----------------------------------------------------------------
 #if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
     template <class DefaultValue, class KT>
-    value_type& find_or_insert(KT&& key)
+    class _default_init
+    {
+    public:
+        explicit _default_init(KT &key) : _key(key) {}
+        void operator()(void *p)
+        {
+            DefaultValue default_value;
+            ::new (p) value_type(default_value(std::forward<KT>(_key)));
+        }
+
+    private:
+        _default_init &operator=(const _default_init &);
+        KT &_key;
+    };
 #else
-    template <class DefaultValue>
-    value_type& find_or_insert(const key_type& key)
+    template <class DefaultValue, class KT>
+    class _default_init
+    {
+    public:
+        explicit _default_init(const KT &key) : _key(key) {}
+        void operator()(void *p)
+        {
+            DefaultValue default_value;
+            ::new (p) value_type(default_value(_key));
+        }
+
+    private:
+        _default_init &operator=(const _default_init &);
+        const KT &_key;
+    };
 #endif
+
+public:
+    // Looks up key, and if it is not present constructs a new value in the
+    // bucket where it belongs by calling init(p), with p pointing to the
+    // uninitialized slot.  The table is probed only once (unless we have to
+    // resize), init is only called when the key is missing, and the first
+    // erased bucket seen while probing is reused.  The value constructed by
+    // init must have a key equal to key.
+    // Returns the iterator and whether the value was inserted.
+    // ---------------------------------------------------------------------
+    template <class K, class Init>
+    std::pair<iterator, bool> find_or_emplace(const K& key, Init& init)
+    {
+        return find_or_emplace(key, hash(key), init);
+    }
+
+    // Same, with hashval being hash(key)
+    template <class K, class Init>
+    std::pair<iterator, bool> find_or_emplace(const K& key, size_t hashval, Init& init)
     {
+        if (Probing::robin_hood)
+        {
+            Position pos = _rh_find_position(key, hashval);
+            if (pos._t == pt_full)
+                return std::pair<iterator, bool>(_mk_iterator(table.get_iter(pos._idx)), false);
+            size_type oldbuck = _find_old_bucket(key, hashval);
+            if (oldbuck != ILLEGAL_BUCKET)
+                return std::pair<iterator, bool>(_move_old_bucket(oldbuck), false);
+            if (_resize_delta(1))
+                pos = _rh_find_position(key, hashval);
+            reference ref(_emplace_at(init, pos._idx, false, hashval));
+            return std::pair<iterator, bool>(_mk_iterator(table.get_iter(pos._idx, &ref)), true);
+        }
+
         size_type num_probes = 0;              // how many times we've probed
         const size_type bucket_count_minus_one = bucket_count() - 1;
-        size_type bucknum = hash(key) & bucket_count_minus_one;
-        DefaultValue default_value;
+        size_type bucknum = hashval & bucket_count_minus_one;
         size_type erased_pos = 0;
         bool erased = false;
 
@@ -3274,29 +5302,34 @@ public:
             if (!grp_pos.test_strict())
             {
                 // not found
-#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
-                auto&& def(default_value(std::forward<KT>(key)));
-#else
-                value_type def(default_value(key));
-#endif                
+                size_type oldbuck = _find_old_bucket(key, hashval);
+                if (oldbuck != ILLEGAL_BUCKET)
+                    return std::pair<iterator, bool>(_move_old_bucket(oldbuck), false);
+
                 if (_resize_delta(1))
                 {
                     // needed to rehash to make room
                     // Since we resized, we can't use pos, so recalculate where to insert.
-                    return *(_insert_noresize(def).first);
-                }
-                else
-                {
-                    // no need to rehash, insert right here
-                    return _insert_at(def, erased ? erased_pos : bucknum, erased);
+                    Position pos = _find_position(key, hashval);
+                    assert(pos._t != pt_full);
+                    bucknum = pos._idx;
+                    erased  = (pos._t == pt_erased);
                 }
+                else if (erased)
+                    bucknum = erased_pos;   // no need to rehash, reuse the first erased bucket
+
+                reference ref(_emplace_at(init, bucknum, erased, hashval));
+                return std::pair<iterator, bool>(_mk_iterator(table.get_iter(bucknum, &ref)), true);
             }
             if (grp_pos.test())
             {
-                reference ref(grp_pos.unsafe_get());
+                if (grp_pos.match_fingerprint(hashval))
+                {
+                    reference ref(grp_pos.unsafe_get());
 
-                if (equals(key, get_key(ref)))
-                    return ref;
+                    if (equals(key, get_key(ref)))
+                        return std::pair<iterator, bool>(grp_pos.get_iter(ref), false);
+                }
             }
             else if (!erased)
             {
@@ -3306,24 +5339,89 @@ public:
             }
 
             ++num_probes;                        // we're doing another probe
-            bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
             assert(num_probes < bucket_count()
                    && "Hashtable is full: an error in key_equal<> or hash<>");
         }
     }
 
-    size_type erase(const key_type& key)
+    // DefaultValue is a functor that takes a key and returns a value_type
+    // representing the default value to be inserted if none is found.
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    template <class DefaultValue, class KT>
+    value_type& find_or_insert(KT&& key)
+    {
+        _default_init<DefaultValue, KT> init(key);
+        return *find_or_emplace(key, init).first;
+    }
+#else
+    template <class DefaultValue>
+    value_type& find_or_insert(const key_type& key)
     {
+        _default_init<DefaultValue, key_type> init(key);
+        return *find_or_emplace(key, init).first;
+    }
+#endif
+
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    // Passed to the lazy_emplace() callback.  Calling it with args
+    // constructs value_type(args...) in the bucket found for the key.
+    // ---------------------------------------------------------------
+    class constructor
+    {
+    public:
+        explicit constructor(void *p) : _p(p) {}
+
+        template <class... Args>
+        void operator()(Args&&... args) const
+        {
+            assert(_p);
+            ::new (_p) value_type(std::forward<Args>(args)...);
+            _p = NULL;                  // construct only once
+        }
+
+    private:
+        mutable void *_p;
+    };
+
+    // Looks up key, and if it is missing calls f(constructor) to build the
+    // value in place.  f must call the constructor exactly once, with
+    // arguments producing a value whose key equals key.
+    // ---------------------------------------------------------------------
+    template <class K, class F>
+    iterator lazy_emplace(const K& key, F&& f)
+    {
+        auto init = [&](void *p) { f(constructor(p)); };
+        return find_or_emplace(key, init).first;
+    }
+#endif
+
+private:
+    template <class K>
+    size_type _erase(const K& key, size_t hashval)
+    {
+        if (_resizing())
+            _resize_step(extras->resize_step);
+
+        if (Probing::robin_hood)
+        {
+            Position pos = _rh_find_position(key, hashval);
+            if (pos._t != pt_full)
+                return _erase_old(key, hashval);
+            _rh_erase_bucket(pos._idx);
+            return 1;
+        }
+
         size_type num_probes = 0;              // how many times we've probed
         const size_type bucket_count_minus_one = bucket_count() - 1;
-        size_type bucknum = hash(key) & bucket_count_minus_one;
+        size_type bucknum = hashval & bucket_count_minus_one;
 
         while (1)                        // probe until something happens
         {
             typename Table::GrpPos grp_pos(table, bucknum);
 
             if (!grp_pos.test_strict())
-                return 0;            // bucket is empty, we deleted nothing
+                return _erase_old(key, hashval);   // bucket is empty, not in table
             if (grp_pos.test())
             {
                 reference ref(grp_pos.unsafe_get());
@@ -3337,17 +5435,64 @@ public:
                 }
             }
             ++num_probes;                        // we're doing another probe
-            bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+            bucknum = (size_type)Probing::next(bucknum, num_probes, bucket_count_minus_one);
             assert(num_probes < bucket_count()
                    && "Hashtable is full: an error in key_equal<> or hash<>");
         }
     }
 
+    // Erases key from old->table, if a resize is in progress.  The erased
+    // marker left keeps the probe sequences of old->table valid.
+    template <class K>
+    size_type _erase_old(const K& key, size_t hashval)
+    {
+        size_type oldbuck = _find_old_bucket(key, hashval);
+        if (oldbuck == ILLEGAL_BUCKET)
+            return 0;
+        extras->old->table.erase(oldbuck);
+        return 1;
+    }
+
+public:
+    size_type erase(const key_type& key)
+    {
+        return _erase(key, hash(key));
+    }
+
+    template <class K>
+    typename if_transparent<K, size_type>::type erase(const K& key)
+    {
+        return _erase(key, hash(key));
+    }
+
+    // hashval must be hash(key)
+    size_type erase(const key_type& key, size_t hashval)
+    {
+        return _erase(key, hashval);
+    }
+
+    template <class K>
+    typename if_transparent<K, size_type>::type erase(const K& key, size_t hashval)
+    {
+        return _erase(key, hashval);
+    }
+
     const_iterator erase(const_iterator pos)
     {
         if (pos == cend())
             return cend();                 // sanity check
 
+        if (_resizing() && extras->old->table.owns(pos))
+            return extras->old->table.erase(pos);   // the erased marker keeps its probe sequences valid
+
+        if (Probing::robin_hood)
+        {
+            // the next item may be shifted back into pos
+            size_type bucknum = table.get_pos(pos);
+            _rh_erase_bucket(bucknum);
+            return table.get_iter_from(bucknum);
+        }
+
         const_iterator nextpos = table.erase(pos);
         ++num_deleted;
         settings.set_consider_shrink(true);
@@ -3359,6 +5504,16 @@ public:
         if (f == cend())
             return cend();                // sanity check
 
+        if (Probing::robin_hood || _resizing())
+        {
+            // erase one at a time, as l may be shifted back, or f and l
+            // be in different tables
+            size_t num_to_erase = l - f;
+            while (num_to_erase--)
+                f = erase(f);
+            return f;
+        }
+
         size_type num_before = table.num_nonempty();
         const_iterator nextpos = table.erase(f, l);
         num_deleted += num_before - table.num_nonempty();
@@ -3417,12 +5572,15 @@ public:
     template <typename OUTPUT>
     bool write_metadata(OUTPUT *fp)
     {
+        _finish_resize();
         return table.write_metadata(fp);
     }
 
     template <typename INPUT>
     bool read_metadata(INPUT *fp)
     {
+        _finish_resize();
+        write_guard w(*this);
         num_deleted = 0;            // since we got rid before writing
         const bool result = table.read_metadata(fp);
         settings.reset_thresholds(bucket_count());
@@ -3433,6 +5591,7 @@ public:
     template <typename OUTPUT>
     bool write_nopointer_data(OUTPUT *fp)
     {
+        _finish_resize();
         return table.write_nopointer_data(fp);
     }
 
@@ -3440,6 +5599,7 @@ public:
     template <typename INPUT>
     bool read_nopointer_data(INPUT *fp)
     {
+        write_guard w(*this);
         return table.read_nopointer_data(fp);
     }
 
@@ -3455,6 +5615,7 @@ public:
     template <typename ValueSerializer, typename OUTPUT>
     bool serialize(ValueSerializer serializer, OUTPUT *fp)
     {
+        _finish_resize();
         return table.serialize(serializer, fp);
     }
 
@@ -3462,9 +5623,18 @@ public:
     template <typename ValueSerializer, typename INPUT>
     bool unserialize(ValueSerializer serializer, INPUT *fp)
     {
+        _finish_resize();
+        write_guard w(*this);
         num_deleted = 0;            // since we got rid before writing
         const bool result = table.unserialize(serializer, fp);
         settings.reset_thresholds(bucket_count());
+        if (Table::has_fingerprints || Table::has_distances)
+        {
+            // fingerprints and distances are not serialized, recompute them
+            for (size_type i = 0; i < bucket_count(); ++i)
+                if (table.test(i))
+                    table.set_hash(i, hash(get_key(table.unsafe_get(i))));
+        }
         return result;
     }
 
@@ -3502,57 +5672,131 @@ private:
             return ExtractKey::operator()(v);
         }
 
-        bool equals(const key_type& a, const key_type& b) const
+        template <class K>
+        bool equals(const K& a, const key_type& b) const
         {
             return EqualKey::operator()(a, b);
         }
     };
 
-    // Utility functions to access the templated operators
+public:
+    // The hash value used to place a key in the table: the hasher's value,
+    // mixed if SPP_MIX_HASH is defined.  This is the value expected by the
+    // functions taking a precomputed hash, and it can be reused across
+    // tables sharing the same hasher.
+    // Unless the hasher and key_equal are transparent, keys of other types
+    // are converted to key_type as before.
+    // ---------------------------------------------------------------------
     size_t hash(const key_type& v) const
     {
         return settings.hash(v);
     }
 
+    template <class K>
+    typename if_transparent<K, size_t>::type hash(const K& v) const
+    {
+        return settings.hash(v);
+    }
+
+private:
+    // Utility functions to access the templated operators
     bool equals(const key_type& a, const key_type& b) const
     {
         return key_info.equals(a, b);
     }
 
+    template <class K>
+    typename if_transparent<K, bool>::type equals(const K& a, const key_type& b) const
+    {
+        return key_info.equals(a, b);
+    }
+
     typename ExtractKey::result_type get_key(const_reference v) const
     {
         return key_info.get_key(v);
     }
 
 private:
+    // The items not moved yet by an incremental resize, with the group to
+    // move next
+    struct OldTable
+    {
+        explicit OldTable(const allocator_type &alloc) : table(0, alloc), pos(0) {}
+
+        Table     table;
+        size_type pos;
+    };
+    typedef typename Alloc::template rebind<OldTable>::other old_alloc_type;
+
+    // The settings which are seldom changed from their defaults, and the
+    // old table of an incremental resize, allocated the first time one of
+    // them is needed, so that the tables which use none stay small.  Once
+    // allocated, they live as long as the table.
+    struct Extras
+    {
+        Extras() : old(0), resize_step(0), purge_factor(0), resize_threads(1),
+                   budget_bytes(0), budget_hook(0), budget_ctx(0) {}
+
+        OldTable          *old;             // items not moved yet by an incremental resize, or 0
+        size_type          resize_step;     // groups moved per operation, 0 if not incremental
+        float              purge_factor;    // erased buckets before purge, 0 for never
+        unsigned int       resize_threads;  // threads rehashing when growing (SPP_PARALLEL_RESIZE)
+        size_t             budget_bytes;    // see set_memory_budget(), 0 for none
+        memory_budget_hook budget_hook;
+        void              *budget_ctx;
+    };
+
+    Extras &_extras()
+    {
+        if (!extras)
+            extras = new Extras;
+        return *extras;
+    }
+
+    // Copies the settings of ht, but not its old table, nor the hook of its
+    // memory budget, which would still see ht
+    void _copy_extras(const sparse_hashtable &ht)
+    {
+        if (!ht.extras && !extras)
+            return;
+        const Extras defaults;
+        const Extras &o = ht.extras ? *ht.extras : defaults;
+        Extras &e = _extras();
+        e.resize_step    = o.resize_step;
+        e.purge_factor   = o.purge_factor;
+        e.resize_threads = o.resize_threads;
+        e.budget_bytes   = o.budget_bytes;
+        e.budget_hook    = 0;
+        e.budget_ctx     = 0;
+    }
+
     // Actual data
     // -----------
     Settings  settings;
     KeyInfo   key_info;
     size_type num_deleted;
     Table     table;         // holds num_buckets and num_elements too
+    Extras   *extras;        // 0 until needed, see Extras
 };
 
-#undef JUMP_
-
 // -----------------------------------------------------------------------------
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const typename sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::size_type
-sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::ILLEGAL_BUCKET;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A, class P>
+const typename sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P>::size_type
+sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P>::ILLEGAL_BUCKET;
 
 // How full we let the table get before we resize.  Knuth says .8 is
 // good -- higher causes us to probe too much, though saves memory
 // -----------------------------------------------------------------------------
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::HT_OCCUPANCY_PCT = 50;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A, class P>
+const int sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P>::HT_OCCUPANCY_PCT = 50;
 
 // How empty we let the table get before we resize lower.
 // It should be less than OCCUPANCY_PCT / 2 or we thrash resizing
 // -----------------------------------------------------------------------------
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::HT_EMPTY_PCT
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A, class P>
+const int sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P>::HT_EMPTY_PCT
 = static_cast<int>(0.4 *
-                   sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::HT_OCCUPANCY_PCT);
+                   sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P>::HT_OCCUPANCY_PCT);
 
 
 //  ----------------------------------------------------------------------
@@ -3561,7 +5805,8 @@ const int sparse_hashtable<V,K,HF,ExK,SetK,EqK,A>::HT_EMPTY_PCT
 template <class Key, class T,
           class HashFcn  = spp_hash<Key>,
           class EqualKey = std::equal_to<Key>,
-          class Alloc    = SPP_DEFAULT_ALLOCATOR<std::pair<const Key, T> > >
+          class Alloc    = SPP_DEFAULT_ALLOCATOR<std::pair<const Key, T> >,
+          class Probing  = quadratic_probing>
 class sparse_hash_map
 {
 public:
@@ -3606,7 +5851,7 @@ private:
 
     // The actual data
     typedef sparse_hashtable<value_type, Key, HashFcn, SelectKey,
-                             SetKey, EqualKey, Alloc> ht;
+                             SetKey, EqualKey, Alloc, Probing> ht;
 
 public:
     typedef typename ht::key_type             key_type;
@@ -3800,6 +6045,45 @@ public:
         rep.set_resizing_parameters(shrink, grow);
     }
 
+    // Spreads the cost of growing the table over the following operations,
+    // see sparse_hashtable::set_incremental_resize()
+    void set_incremental_resize(size_type groups_per_op) { rep.set_incremental_resize(groups_per_op); }
+    size_type get_incremental_resize() const  { return rep.get_incremental_resize(); }
+    bool resize_in_progress() const           { return rep.resize_in_progress(); }
+
+    // Gets rid of the erased buckets, see sparse_hashtable::purge_deleted()
+    void purge_deleted()                      { rep.purge_deleted(); }
+    void shrink_to_fit()                      { rep.shrink_to_fit(); }
+
+    // Caps the memory used by the table, see sparse_hashtable::set_memory_budget()
+    void set_memory_budget(size_t bytes, memory_budget_hook hook = 0, void *ctx = 0)
+    {
+        rep.set_memory_budget(bytes, hook, ctx);
+    }
+    size_t get_memory_budget() const          { return rep.get_memory_budget(); }
+
+    float get_purge_factor() const            { return rep.get_purge_factor(); }
+    void set_purge_factor(float f)            { rep.set_purge_factor(f); }
+
+    // Memory used by the table, see memory_usage_info
+    memory_usage_info memory_usage() const    { return rep.memory_usage(); }
+
+    // Memory held by the allocator, see sparse_hashtable::allocator_footprint()
+    size_t allocator_footprint() const        { return rep.allocator_footprint(); }
+    size_t allocator_max_footprint() const    { return rep.allocator_max_footprint(); }
+    int trim_allocator(size_t pad = 0)        { return rep.trim_allocator(pad); }
+
+#ifdef SPP_PARALLEL_RESIZE
+    void set_resize_threads(unsigned int num_threads) { rep.set_resize_threads(num_threads); }
+    unsigned int get_resize_threads() const   { return rep.get_resize_threads(); }
+
+    template <class RandomIt>
+    void parallel_build(RandomIt first, RandomIt last, unsigned int num_threads)
+    {
+        rep.parallel_build(first, last, num_threads);
+    }
+#endif
+
     void resize(size_type cnt)        { rep.resize(cnt); }
     void rehash(size_type cnt)        { resize(cnt); } // c++11 name
     void reserve(size_type cnt)       { resize(cnt); } // c++11
@@ -3810,6 +6094,20 @@ public:
     const_iterator find(const key_type& key) const     { return rep.find(key); }
     bool contains(const key_type& key) const           { return rep.find(key) != rep.end(); }
 
+    // Heterogeneous lookup, only available when both HashFcn and EqualKey
+    // declare is_transparent.
+    template <class K>
+    typename ht::template if_transparent<K, iterator>::type
+    find(const K& key)                                 { return rep.find(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, const_iterator>::type
+    find(const K& key) const                           { return rep.find(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, bool>::type
+    contains(const K& key) const                       { return rep.find(key) != rep.end(); }
+
 #if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
     template <class KT>
     mapped_type& operator[](KT&& key)
@@ -3825,26 +6123,46 @@ public:
 
     size_type count(const key_type& key) const         { return rep.count(key); }
 
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    count(const K& key) const                          { return rep.count(key); }
+
     std::pair<iterator, iterator>
     equal_range(const key_type& key)             { return rep.equal_range(key); }
 
     std::pair<const_iterator, const_iterator>
     equal_range(const key_type& key) const       { return rep.equal_range(key); }
 
+    template <class K>
+    typename ht::template if_transparent<K, std::pair<iterator, iterator> >::type
+    equal_range(const K& key)                    { return rep.equal_range(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, std::pair<const_iterator, const_iterator> >::type
+    equal_range(const K& key) const              { return rep.equal_range(key); }
+
     mapped_type& at(const key_type& key)
     {
-        iterator it = rep.find(key);
-        if (it == rep.end())
-            throw_exception(std::out_of_range("at: key not present"));
-        return it->second;
+        return _at(key);
     }
 
     const mapped_type& at(const key_type& key) const
     {
-        const_iterator it = rep.find(key);
-        if (it == rep.cend())
-            throw_exception(std::out_of_range("at: key not present"));
-        return it->second;
+        return _at(key);
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, mapped_type&>::type
+    at(const K& key)
+    {
+        return _at(key);
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, const mapped_type&>::type
+    at(const K& key) const
+    {
+        return _at(key);
     }
 
 #if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
@@ -3859,6 +6177,88 @@ public:
     {
         return rep.emplace(std::forward<Args>(args)...).first;
     }
+
+    // If key is missing, calls f(ctor), where ctor(args...) constructs the
+    // new value_type(args...) directly in its bucket.  Nothing is built
+    // when key is already present.  f must call ctor exactly once, with
+    // arguments giving a value whose key equals key.
+    // --------------------------------------------------------------------
+    typedef typename ht::constructor constructor;
+
+    template <class F>
+    iterator lazy_emplace(const key_type& key, F&& f)
+    {
+        return rep.lazy_emplace(key, std::forward<F>(f));
+    }
+
+    template <class K, class F>
+    typename ht::template if_transparent<K, iterator>::type
+    lazy_emplace(const K& key, F&& f)
+    {
+        return rep.lazy_emplace(key, std::forward<F>(f));
+    }
+
+    // If key is not present, inserts a value constructed in place from
+    // (key, mapped_type(args...)).  Otherwise does nothing: args are not
+    // moved from and no mapped_type is constructed.  Probes only once.
+    // --------------------------------------------------------------------
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const key_type& key, Args&&... args)
+    {
+        return try_emplace_with_hash(rep.hash(key), key, std::forward<Args>(args)...);
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(key_type&& key, Args&&... args)
+    {
+        size_t hashval = rep.hash(key);
+        return try_emplace_with_hash(hashval, std::move(key), std::forward<Args>(args)...);
+    }
+
+    template <class... Args>
+    iterator try_emplace(const_iterator , const key_type& key, Args&&... args)
+    {
+        return try_emplace(key, std::forward<Args>(args)...).first;
+    }
+
+    template <class... Args>
+    iterator try_emplace(const_iterator , key_type&& key, Args&&... args)
+    {
+        return try_emplace(std::move(key), std::forward<Args>(args)...).first;
+    }
+
+    // Inserts (key, obj) if key is not present, otherwise assigns obj to
+    // the existing mapped value.  Probes only once.
+    // ------------------------------------------------------------------
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const key_type& key, M&& obj)
+    {
+        std::pair<iterator, bool> res = try_emplace(key, std::forward<M>(obj));
+        if (!res.second)
+            res.first->second = std::forward<M>(obj);
+        return res;
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(key_type&& key, M&& obj)
+    {
+        std::pair<iterator, bool> res = try_emplace(std::move(key), std::forward<M>(obj));
+        if (!res.second)
+            res.first->second = std::forward<M>(obj);
+        return res;
+    }
+
+    template <class M>
+    iterator insert_or_assign(const_iterator , const key_type& key, M&& obj)
+    {
+        return insert_or_assign(key, std::forward<M>(obj)).first;
+    }
+
+    template <class M>
+    iterator insert_or_assign(const_iterator , key_type&& key, M&& obj)
+    {
+        return insert_or_assign(std::move(key), std::forward<M>(obj)).first;
+    }
 #endif
 
     // Insert
@@ -3890,10 +6290,147 @@ public:
     // -----
     size_type erase(const key_type& key)               { return rep.erase(key); }
     iterator  erase(iterator it)                       { return rep.erase(it); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    erase(const K& key)                                { return rep.erase(key); }
+
     iterator  erase(iterator f, iterator l)            { return rep.erase(f, l); }
     iterator  erase(const_iterator it)                 { return rep.erase(it); }
     iterator  erase(const_iterator f, const_iterator l){ return rep.erase(f, l); }
 
+    // Precomputed hash
+    // ----------------
+    // hash(key) returns the value the map uses to place key.  When the same
+    // key is looked up in several maps with the same hasher, it can be
+    // computed once and passed to the overloads below, which then skip
+    // hashing the key.  hashval *must* be the hash() of the key.
+    // ------------------------------------------------------------------------
+    size_t hash(const key_type& key) const             { return rep.hash(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_t>::type
+    hash(const K& key) const                           { return rep.hash(key); }
+
+    iterator find(const key_type& key, size_t hashval) { return rep.find(key, hashval); }
+
+    const_iterator find(const key_type& key, size_t hashval) const
+    {
+        return rep.find(key, hashval);
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, iterator>::type
+    find(const K& key, size_t hashval)                 { return rep.find(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, const_iterator>::type
+    find(const K& key, size_t hashval) const           { return rep.find(key, hashval); }
+
+    bool contains(const key_type& key, size_t hashval) const
+    {
+        return rep.find(key, hashval) != rep.end();
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, bool>::type
+    contains(const K& key, size_t hashval) const       { return rep.find(key, hashval) != rep.end(); }
+
+    size_type count(const key_type& key, size_t hashval) const
+    {
+        return rep.count(key, hashval);
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    count(const K& key, size_t hashval) const          { return rep.count(key, hashval); }
+
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, const value_type& obj)
+    {
+        return rep.insert_with_hash(hashval, obj);
+    }
+
+#if !defined(SPP_NO_CXX11_RVALUE_REFERENCES)
+    template< class P >
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, P&& obj)
+    {
+        return rep.insert_with_hash(hashval, std::forward<P>(obj));
+    }
+#endif
+
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    template <class... Args>
+    std::pair<iterator, bool> emplace_with_hash(size_t hashval, Args&&... args)
+    {
+        return rep.emplace_with_hash(hashval, std::forward<Args>(args)...);
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace_with_hash(size_t hashval, const key_type& key, Args&&... args)
+    {
+        auto init = [&](void *p) {
+            ::new (p) value_type(std::piecewise_construct,
+                                 std::forward_as_tuple(key),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+        };
+        return rep.find_or_emplace(key, hashval, init);
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace_with_hash(size_t hashval, key_type&& key, Args&&... args)
+    {
+        auto init = [&](void *p) {
+            ::new (p) value_type(std::piecewise_construct,
+                                 std::forward_as_tuple(std::move(key)),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+        };
+        return rep.find_or_emplace(key, hashval, init);
+    }
+#endif
+
+    size_type erase(const key_type& key, size_t hashval) { return rep.erase(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    erase(const K& key, size_t hashval)                { return rep.erase(key, hashval); }
+
+    // Batched lookup
+    // --------------
+    // Looks up keys[0..n), writing one iterator per key (end() if missing)
+    // to out.  The keys are hashed and their buckets prefetched in small
+    // batches, which hides most of the memory latency of random lookups
+    // in a large map.
+    // --------------------------------------------------------------------
+    template <class OutputIterator>
+    OutputIterator find_many(const key_type *keys, size_type n, OutputIterator out)
+    {
+        return rep.find_many(keys, n, out);
+    }
+
+    template <class OutputIterator>
+    OutputIterator find_many(const key_type *keys, size_type n, OutputIterator out) const
+    {
+        return rep.find_many(keys, n, out);
+    }
+
+    // Lookup racing with a single writer, for the maps whose allocator
+    // declares use_versions (see spp::optimistic_sparse_hash_map)
+    bool optimistic_find(const key_type& key, void *out) const { return rep.optimistic_find(key, out); }
+
+    // Prefetches the memory a lookup of key would touch first, so that
+    // other work can be done while it is brought into the cache.
+    // ----------------------------------------------------------------
+    void prefetch(const key_type& key) const             { rep.prefetch(key); }
+    void prefetch(const key_type& key, size_t hashval) const { rep.prefetch(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, void>::type
+    prefetch(const K& key) const                         { rep.prefetch(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, void>::type
+    prefetch(const K& key, size_t hashval) const         { rep.prefetch(key, hashval); }
+
     // Comparison
     // ----------
     bool operator==(const sparse_hash_map& hs) const   { return rep == hs.rep; }
@@ -3966,6 +6503,24 @@ public:
 
 
 private:
+    template <class K>
+    mapped_type& _at(const K& key)
+    {
+        iterator it = rep.find(key);
+        if (it == rep.end())
+            throw_exception(std::out_of_range("at: key not present"));
+        return it->second;
+    }
+
+    template <class K>
+    const mapped_type& _at(const K& key) const
+    {
+        const_iterator it = rep.find(key);
+        if (it == rep.cend())
+            throw_exception(std::out_of_range("at: key not present"));
+        return it->second;
+    }
+
     // The actual data
     // ---------------
     ht rep;
@@ -3978,7 +6533,8 @@ private:
 template <class Value,
           class HashFcn  = spp_hash<Value>,
           class EqualKey = std::equal_to<Value>,
-          class Alloc    = SPP_DEFAULT_ALLOCATOR<Value> >
+          class Alloc    = SPP_DEFAULT_ALLOCATOR<Value>,
+          class Probing  = quadratic_probing>
 class sparse_hash_set
 {
 private:
@@ -3998,7 +6554,7 @@ private:
     };
 
     typedef sparse_hashtable<Value, Value, HashFcn, Identity, SetKey,
-                             EqualKey, Alloc> ht;
+                             EqualKey, Alloc, Probing> ht;
 
 public:
     typedef typename ht::key_type              key_type;
@@ -4188,6 +6744,45 @@ public:
         rep.set_resizing_parameters(shrink, grow);
     }
 
+    // Spreads the cost of growing the table over the following operations,
+    // see sparse_hashtable::set_incremental_resize()
+    void set_incremental_resize(size_type groups_per_op) { rep.set_incremental_resize(groups_per_op); }
+    size_type get_incremental_resize() const  { return rep.get_incremental_resize(); }
+    bool resize_in_progress() const           { return rep.resize_in_progress(); }
+
+    // Gets rid of the erased buckets, see sparse_hashtable::purge_deleted()
+    void purge_deleted()                      { rep.purge_deleted(); }
+    void shrink_to_fit()                      { rep.shrink_to_fit(); }
+
+    // Caps the memory used by the table, see sparse_hashtable::set_memory_budget()
+    void set_memory_budget(size_t bytes, memory_budget_hook hook = 0, void *ctx = 0)
+    {
+        rep.set_memory_budget(bytes, hook, ctx);
+    }
+    size_t get_memory_budget() const          { return rep.get_memory_budget(); }
+
+    float get_purge_factor() const            { return rep.get_purge_factor(); }
+    void set_purge_factor(float f)            { rep.set_purge_factor(f); }
+
+    // Memory used by the table, see memory_usage_info
+    memory_usage_info memory_usage() const    { return rep.memory_usage(); }
+
+    // Memory held by the allocator, see sparse_hashtable::allocator_footprint()
+    size_t allocator_footprint() const        { return rep.allocator_footprint(); }
+    size_t allocator_max_footprint() const    { return rep.allocator_max_footprint(); }
+    int trim_allocator(size_t pad = 0)        { return rep.trim_allocator(pad); }
+
+#ifdef SPP_PARALLEL_RESIZE
+    void set_resize_threads(unsigned int num_threads) { rep.set_resize_threads(num_threads); }
+    unsigned int get_resize_threads() const   { return rep.get_resize_threads(); }
+
+    template <class RandomIt>
+    void parallel_build(RandomIt first, RandomIt last, unsigned int num_threads)
+    {
+        rep.parallel_build(first, last, num_threads);
+    }
+#endif
+
     void resize(size_type cnt)        { rep.resize(cnt); }
     void rehash(size_type cnt)        { resize(cnt); } // c++11 name
     void reserve(size_type cnt)       { resize(cnt); } // c++11
@@ -4202,6 +6797,24 @@ public:
     std::pair<iterator, iterator>
     equal_range(const key_type& key) const       { return rep.equal_range(key); }
 
+    // Heterogeneous lookup, only available when both HashFcn and EqualKey
+    // declare is_transparent.
+    template <class K>
+    typename ht::template if_transparent<K, iterator>::type
+    find(const K& key) const                     { return rep.find(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, bool>::type
+    contains(const K& key) const                 { return rep.find(key) != rep.end(); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    count(const K& key) const                    { return rep.count(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, std::pair<iterator, iterator> >::type
+    equal_range(const K& key) const              { return rep.equal_range(key); }
+
 #if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
     template <class... Args>
     std::pair<iterator, bool> emplace(Args&&... args)
@@ -4214,6 +6827,26 @@ public:
     {
         return rep.emplace(std::forward<Args>(args)...).first;
     }
+
+    // If key is missing, calls f(ctor), where ctor(args...) constructs the
+    // new value_type(args...) directly in its bucket.  Nothing is built
+    // when key is already present.  f must call ctor exactly once, with
+    // arguments giving a value whose key equals key.
+    // --------------------------------------------------------------------
+    typedef typename ht::constructor constructor;
+
+    template <class F>
+    iterator lazy_emplace(const key_type& key, F&& f)
+    {
+        return rep.lazy_emplace(key, std::forward<F>(f));
+    }
+
+    template <class K, class F>
+    typename ht::template if_transparent<K, iterator>::type
+    lazy_emplace(const K& key, F&& f)
+    {
+        return rep.lazy_emplace(key, std::forward<F>(f));
+    }
 #endif
 
     // Insert
@@ -4248,6 +6881,102 @@ public:
     iterator  erase(iterator it)              { return rep.erase(it); }
     iterator  erase(iterator f, iterator l)   { return rep.erase(f, l); }
 
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    erase(const K& key)                       { return rep.erase(key); }
+
+    // Precomputed hash
+    // ----------------
+    // hash(key) returns the value the set uses to place key.  When the same
+    // key is looked up in several sets with the same hasher, it can be
+    // computed once and passed to the overloads below, which then skip
+    // hashing the key.  hashval *must* be the hash() of the key.
+    // ------------------------------------------------------------------------
+    size_t hash(const key_type& key) const    { return rep.hash(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_t>::type
+    hash(const K& key) const                  { return rep.hash(key); }
+
+    iterator find(const key_type& key, size_t hashval) const { return rep.find(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, iterator>::type
+    find(const K& key, size_t hashval) const  { return rep.find(key, hashval); }
+
+    bool contains(const key_type& key, size_t hashval) const
+    {
+        return rep.find(key, hashval) != rep.end();
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, bool>::type
+    contains(const K& key, size_t hashval) const { return rep.find(key, hashval) != rep.end(); }
+
+    size_type count(const key_type& key, size_t hashval) const
+    {
+        return rep.count(key, hashval);
+    }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    count(const K& key, size_t hashval) const { return rep.count(key, hashval); }
+
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, const value_type& obj)
+    {
+        std::pair<typename ht::iterator, bool> p = rep.insert_with_hash(hashval, obj);
+        return std::pair<iterator, bool>(p.first, p.second);   // const to non-const
+    }
+
+#if !defined(SPP_NO_CXX11_RVALUE_REFERENCES)
+    template<class P>
+    std::pair<iterator, bool> insert_with_hash(size_t hashval, P&& obj)
+    {
+        return rep.insert_with_hash(hashval, std::forward<P>(obj));
+    }
+#endif
+
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    template <class... Args>
+    std::pair<iterator, bool> emplace_with_hash(size_t hashval, Args&&... args)
+    {
+        return rep.emplace_with_hash(hashval, std::forward<Args>(args)...);
+    }
+#endif
+
+    size_type erase(const key_type& key, size_t hashval) { return rep.erase(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, size_type>::type
+    erase(const K& key, size_t hashval)       { return rep.erase(key, hashval); }
+
+    // Batched lookup
+    // --------------
+    // Looks up keys[0..n), writing one iterator per key (end() if missing)
+    // to out.  The keys are hashed and their buckets prefetched in small
+    // batches, which hides most of the memory latency of random lookups
+    // in a large set.
+    // --------------------------------------------------------------------
+    template <class OutputIterator>
+    OutputIterator find_many(const key_type *keys, size_type n, OutputIterator out) const
+    {
+        return rep.find_many(keys, n, out);
+    }
+
+    // Prefetches the memory a lookup of key would touch first, so that
+    // other work can be done while it is brought into the cache.
+    // ----------------------------------------------------------------
+    void prefetch(const key_type& key) const             { rep.prefetch(key); }
+    void prefetch(const key_type& key, size_t hashval) const { rep.prefetch(key, hashval); }
+
+    template <class K>
+    typename ht::template if_transparent<K, void>::type
+    prefetch(const K& key) const                         { rep.prefetch(key); }
+
+    template <class K>
+    typename ht::template if_transparent<K, void>::type
+    prefetch(const K& key, size_t hashval) const         { rep.prefetch(key, hashval); }
+
     // Comparison
     // ----------
     bool operator==(const sparse_hash_set& hs) const { return rep == hs.rep; }
@@ -4330,35 +7059,35 @@ private:
 // We need a global swap for all our classes as well
 // -------------------------------------------------
 
-template <class T, class Alloc>
-inline void swap(spp_::sparsegroup<T,Alloc> &x, spp_::sparsegroup<T,Alloc> &y)
+template <class T, class Alloc, bool FP, bool RH>
+inline void swap(spp_::sparsegroup<T,Alloc,FP,RH> &x, spp_::sparsegroup<T,Alloc,FP,RH> &y)
 {
     x.swap(y);
 }
 
-template <class T, class Alloc>
-inline void swap(spp_::sparsetable<T,Alloc> &x, spp_::sparsetable<T,Alloc> &y)
+template <class T, class Alloc, bool FP, bool RH>
+inline void swap(spp_::sparsetable<T,Alloc,FP,RH> &x, spp_::sparsetable<T,Alloc,FP,RH> &y)
 {
     x.swap(y);
 }
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-inline void swap(spp_::sparse_hashtable<V,K,HF,ExK,SetK,EqK,A> &x,
-                 spp_::sparse_hashtable<V,K,HF,ExK,SetK,EqK,A> &y)
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A, class P>
+inline void swap(spp_::sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P> &x,
+                 spp_::sparse_hashtable<V,K,HF,ExK,SetK,EqK,A,P> &y)
 {
     x.swap(y);
 }
 
-template <class Key, class T, class HashFcn, class EqualKey, class Alloc>
-inline void swap(spp_::sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc>& hm1,
-                 spp_::sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc>& hm2)
+template <class Key, class T, class HashFcn, class EqualKey, class Alloc, class Probing>
+inline void swap(spp_::sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc, Probing>& hm1,
+                 spp_::sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc, Probing>& hm2)
 {
     hm1.swap(hm2);
 }
 
-template <class Val, class HashFcn, class EqualKey, class Alloc>
-inline void swap(spp_::sparse_hash_set<Val, HashFcn, EqualKey, Alloc>& hs1,
-                 spp_::sparse_hash_set<Val, HashFcn, EqualKey, Alloc>& hs2)
+template <class Val, class HashFcn, class EqualKey, class Alloc, class Probing>
+inline void swap(spp_::sparse_hash_set<Val, HashFcn, EqualKey, Alloc, Probing>& hs1,
+                 spp_::sparse_hash_set<Val, HashFcn, EqualKey, Alloc, Probing>& hs2)
 {
     hs1.swap(hs2);
 }
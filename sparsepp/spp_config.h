@@ -14,12 +14,13 @@
 #endif
 
 #ifndef SPP_DEFAULT_ALLOCATOR
-    #if (defined(SPP_USE_SPP_ALLOC) && SPP_USE_SPP_ALLOC) && defined(_MSC_VER)
+    #if (defined(SPP_USE_SPP_ALLOC) && SPP_USE_SPP_ALLOC)
         // -----------------------------------------------------------------------------
-        // When building with the Microsoft compiler, we use a custom allocator because
-        // the default one fragments memory when reallocating. This is desirable only 
-        // when creating large sparsepp hash maps. If you create lots of small hash_maps,
-        // define the following before including spp.h:
+        // When SPP_USE_SPP_ALLOC is defined, we use a custom allocator (a dlmalloc
+        // mspace per map), because the default one (the Visual C++ runtime, or glibc
+        // in long running processes) fragments memory when reallocating. This is 
+        // desirable only when creating large sparsepp hash maps. If you create lots 
+        // of small hash_maps, define the following before including spp.h:
         //     #define SPP_DEFAULT_ALLOCATOR spp::libc_allocator
         // -----------------------------------------------------------------------------
         #define SPP_DEFAULT_ALLOCATOR spp_::spp_allocator
@@ -777,5 +778,19 @@
     #endif
 #endif
 
+/*
+  Hint that the cache line at addr will be read soon.
+*/
+#ifndef SPP_PREFETCH
+    #if defined(__GNUC__)
+        #define SPP_PREFETCH(addr) __builtin_prefetch((const void *)(addr))
+    #elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        #include <xmmintrin.h>
+        #define SPP_PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+    #else
+        #define SPP_PREFETCH(addr) ((void)0)
+    #endif
+#endif
+
 
 #endif // spp_config_h_guard
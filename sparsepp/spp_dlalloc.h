@@ -52,6 +52,17 @@ namespace spp
     SPP_API void   mspace_free(mspace msp, void* mem);
     SPP_API void*  mspace_realloc(mspace msp, void* mem, size_t newsize);
 
+    /*
+      mspace_trim gives the unused memory at the top of the space, and the
+      unused mmapped segments, back to the system, keeping pad bytes. It
+      returns 1 if some memory was released. mspace_footprint and
+      mspace_max_footprint return the (current and peak) number of bytes
+      obtained from the system for the space.
+    */
+    SPP_API int    mspace_trim(mspace msp, size_t pad);
+    SPP_API size_t mspace_footprint(mspace msp);
+    SPP_API size_t mspace_max_footprint(mspace msp);
+
 #if 0
     SPP_API mspace create_mspace_with_base(void* base, size_t capacity, int locked);
     SPP_API int    mspace_track_large_chunks(mspace msp, int enable);
@@ -61,10 +72,7 @@ namespace spp
                                              size_t elem_size, void* chunks[]);
     SPP_API void** mspace_independent_comalloc(mspace msp, size_t n_elements,
                                                size_t sizes[], void* chunks[]);
-    SPP_API size_t mspace_footprint(mspace msp);
-    SPP_API size_t mspace_max_footprint(mspace msp);
     SPP_API size_t mspace_usable_size(const void* mem);
-    SPP_API int    mspace_trim(mspace msp, size_t pad);
     SPP_API int    mspace_mallopt(int, int);
 #endif
 
@@ -99,6 +107,13 @@ namespace spp
         MSpace *getSpace() const { return _space.get(); }
 
         spp_allocator() : _space(new MSpace) {}
+
+        // To share one space between several maps (which then must all be
+        // used from the same thread, as the space has no lock):
+        //     spp_allocator<V> alloc;
+        //     Map m1(0, hasher(), key_equal(), alloc), m2(0, hasher(), key_equal(), alloc);
+        // or, to keep the space outside of any map, spp_allocator<V>(new MSpace).
+        explicit spp_allocator(MSpace *space) : _space(space) {}
         
         template<class U>
         spp_allocator(const spp_allocator<U> &o) : _space(o.getSpace()) {}
@@ -165,6 +180,11 @@ namespace spp
 
         mspace space() const { return _space->_sp; }
 
+        // see mspace_trim() and mspace_footprint()
+        int    trim(size_t pad = 0)  { return mspace_trim(_space->_sp, pad); }
+        size_t footprint() const     { return mspace_footprint(_space->_sp); }
+        size_t max_footprint() const { return mspace_max_footprint(_space->_sp); }
+
         // check if we can clear the whole allocator memory at once => works only if the allocator 
         // is not be shared. If can_clear() returns true, we expect that the next allocator call
         // will be clear() - not allocate() or deallocate()
@@ -191,20 +211,21 @@ namespace spp
         spp_sptr<MSpace> _space;
         spp_sptr<MSpace> _space_to_clear;
     };
-}
-
 
-// allocators are "equal" whenever memory allocated with one can be deallocated with the other
-template<class T>
-inline bool operator==(const spp_::spp_allocator<T> &a, const spp_::spp_allocator<T> &b)
-{
-    return a.space() == b.space();
-}
+    // allocators are "equal" whenever memory allocated with one can be
+    // deallocated with the other. Declared in the namespace, so that gcc and
+    // clang find them from the sparsepp containers.
+    template<class T>
+    inline bool operator==(const spp_allocator<T> &a, const spp_allocator<T> &b)
+    {
+        return a.space() == b.space();
+    }
 
-template<class T>
-inline bool operator!=(const spp_::spp_allocator<T> &a, const spp_::spp_allocator<T> &b)
-{
-    return !(a == b);
+    template<class T>
+    inline bool operator!=(const spp_allocator<T> &a, const spp_allocator<T> &b)
+    {
+        return !(a == b);
+    }
 }
 
 namespace std
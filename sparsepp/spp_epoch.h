@@ -0,0 +1,131 @@
+#if !defined(spp_epoch_h_guard)
+#define spp_epoch_h_guard
+
+/* Epochs of the readers which access a table without locks while a
+   single writer changes it (see spp_snapshot.h and spp_optimistic.h).
+
+   A reader pins the current epoch in a slot of its own while it reads.
+   Once the writer has unlinked memory the readers may be using, it starts
+   a new epoch: when no slot holds an older epoch anymore (the grace
+   period), no reader can be using that memory.
+
+   At most SPP_EPOCH_READERS readers can be pinned at once, further ones
+   wait for a free slot.
+
+   Requires C++11.
+*/
+
+#include <atomic>
+#include <thread>
+#include <functional>
+#include "spp_stdint.h"
+
+#ifndef SPP_EPOCH_READERS
+    // how many readers can pin an epoch at the same time
+    #define SPP_EPOCH_READERS 128
+#endif
+
+namespace spp_
+{
+
+class reader_epochs
+{
+public:
+    typedef std::atomic<uint64_t> slot_type;
+
+    reader_epochs() : _epoch(1)
+    {
+        for (size_t i = 0; i < SPP_EPOCH_READERS; ++i)
+            _slots[i].epoch.store(0, std::memory_order_relaxed);
+    }
+
+    // Takes a free slot, and stores the current epoch in it.  The writer
+    // publishes, then scans the slots (oldest(), wait_before()), while the
+    // reader stores its slot, then loads what was published: a store then
+    // a load on each side, which only seq_cst fences on both sides order.
+    // So either the writer's scan sees the slot, or the reader sees what
+    // the writer published before scanning.
+    // ------------------------------------------------------------------
+    slot_type *pin() const
+    {
+        static thread_local size_t hint =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) % SPP_EPOCH_READERS;
+
+        while (1)
+        {
+            for (size_t n = 0; n < SPP_EPOCH_READERS; ++n)
+            {
+                Slot &slot = _slots[(hint + n) % SPP_EPOCH_READERS];
+                uint64_t expected = 0;
+                if (slot.epoch.load(std::memory_order_relaxed) == 0 &&
+                    slot.epoch.compare_exchange_strong(expected, _epoch.load(std::memory_order_seq_cst),
+                                                       std::memory_order_seq_cst))
+                {
+                    std::atomic_thread_fence(std::memory_order_seq_cst);  // before the reads
+                    hint = (hint + n) % SPP_EPOCH_READERS;
+                    return &slot.epoch;
+                }
+            }
+            std::this_thread::yield();       // all the slots are taken
+        }
+    }
+
+    static void unpin(slot_type *slot)
+    {
+        slot->store(0, std::memory_order_release);
+    }
+
+    uint64_t current() const { return _epoch.load(std::memory_order_seq_cst); }
+
+    // Starts a new epoch, once the writer has unlinked what the readers of
+    // the previous ones may be using.  Returns it.
+    uint64_t advance() { return _epoch.fetch_add(1, std::memory_order_seq_cst) + 1; }
+
+    // The oldest epoch pinned by a reader, or current() if none
+    uint64_t oldest() const
+    {
+        uint64_t res = current();
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // see pin()
+        for (size_t i = 0; i < SPP_EPOCH_READERS; ++i)
+        {
+            uint64_t e = _slots[i].epoch.load(std::memory_order_seq_cst);
+            if (e && e < res)
+                res = e;
+        }
+        return res;
+    }
+
+    // Waits for the readers which pinned an epoch before epoch to unpin it
+    void wait_before(uint64_t epoch) const
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // see pin()
+        for (size_t i = 0; i < SPP_EPOCH_READERS; ++i)
+        {
+            while (1)
+            {
+                uint64_t e = _slots[i].epoch.load(std::memory_order_seq_cst);
+                if (e == 0 || e >= epoch)
+                    break;
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    reader_epochs(const reader_epochs &);
+    reader_epochs& operator=(const reader_epochs &);
+
+    // one cache line per slot, so that readers do not slow each other down
+    struct Slot
+    {
+        slot_type epoch;                     // of the reader using it, 0 if free
+        char pad[64 - sizeof(slot_type)];
+    };
+
+    std::atomic<uint64_t> _epoch;
+    mutable Slot          _slots[SPP_EPOCH_READERS];
+};
+
+}  // spp_ namespace
+
+#endif // spp_epoch_h_guard
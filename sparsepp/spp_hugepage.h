@@ -0,0 +1,178 @@
+#if !defined(spp_hugepage_h_guard)
+#define spp_hugepage_h_guard
+
+/* Huge page backed storage for the large arrays of sparsepp tables.
+
+   The group array of a sparsetable (one sparsegroup header per
+   SPP_GROUP_SIZE buckets) is touched by every lookup. For tables with
+   hundreds of millions of buckets, the TLB misses on that array show in
+   profiles. huge_page_allocator<Alloc> allocates the blocks of at least
+   SPP_HUGE_PAGE_MIN_BYTES bytes with mmap, aligned on 2MB and advised
+   with MADV_HUGEPAGE, so that the kernel backs them with transparent huge
+   pages. Smaller blocks (such as the item arrays of the groups) are left
+   to Alloc:
+
+       typedef spp::huge_page_allocator<spp::libc_allocator<std::pair<const K, V> > > A;
+       sparse_hash_map<K, V, spp_hash<K>, std::equal_to<K>, A> m;
+
+   When huge pages are not available (THP disabled, or madvise failing),
+   the blocks are still mmapped, with regular pages. On systems without
+   mmap, everything goes to Alloc.
+
+   The item arrays themselves can be kept in huge pages by using the slab
+   allocator (spp_slab.h) with SPP_SLAB_HUGE_PAGES defined: its pages are
+   then carved out of 2MB huge page chunks.
+*/
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include "spp_stdint.h"
+#include "spp_utils.h"
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__unix__)
+    #include <sys/mman.h>
+    #define SPP_HAS_MMAP
+#endif
+
+#ifndef SPP_HUGE_PAGE_SIZE
+    #define SPP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef SPP_HUGE_PAGE_MIN_BYTES
+    // smaller blocks are allocated from the wrapped allocator
+    #define SPP_HUGE_PAGE_MIN_BYTES SPP_HUGE_PAGE_SIZE
+#endif
+
+namespace spp_
+{
+    // Returns a block of bytes (rounded up to SPP_HUGE_PAGE_SIZE) aligned on
+    // SPP_HUGE_PAGE_SIZE, or NULL if mmap is not available or fails.
+    // ----------------------------------------------------------------------
+    inline void *huge_page_alloc(size_t bytes)
+    {
+#ifdef SPP_HAS_MMAP
+        const size_t size = (bytes + SPP_HUGE_PAGE_SIZE - 1) & ~(size_t)(SPP_HUGE_PAGE_SIZE - 1);
+
+        // map one more huge page, and unmap what is not aligned
+        char *p = static_cast<char *>(mmap(0, size + SPP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED)
+            return 0;
+        char *aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(p) + SPP_HUGE_PAGE_SIZE - 1) &
+                                                 ~(uintptr_t)(SPP_HUGE_PAGE_SIZE - 1));
+        if (aligned > p)
+            munmap(p, (size_t)(aligned - p));
+        if (aligned + size < p + size + SPP_HUGE_PAGE_SIZE)
+            munmap(aligned + size, (size_t)(p + size + SPP_HUGE_PAGE_SIZE - (aligned + size)));
+
+    #ifdef MADV_HUGEPAGE
+        madvise(aligned, size, MADV_HUGEPAGE);   // just a hint, regular pages otherwise
+    #endif
+        return aligned;
+#else
+        (void)bytes;
+        return 0;
+#endif
+    }
+
+    inline void huge_page_free(void *p, size_t bytes)
+    {
+#ifdef SPP_HAS_MMAP
+        const size_t size = (bytes + SPP_HUGE_PAGE_SIZE - 1) & ~(size_t)(SPP_HUGE_PAGE_SIZE - 1);
+        munmap(p, size);
+#else
+        (void)p;
+        (void)bytes;
+#endif
+    }
+
+    // Wraps the allocator Alloc, so that its large blocks are allocated in
+    // huge pages (see above).
+    // ---------------------------------------------------------------------
+    template <class Alloc, size_t MinBytes = SPP_HUGE_PAGE_MIN_BYTES>
+    class huge_page_allocator : public Alloc
+    {
+    public:
+        typedef typename Alloc::value_type value_type;
+        typedef typename Alloc::pointer    pointer;
+        typedef typename Alloc::size_type  size_type;
+
+        huge_page_allocator() {}
+        huge_page_allocator(const Alloc &a) : Alloc(a) {}
+
+        template <class A2>
+        huge_page_allocator(const huge_page_allocator<A2, MinBytes> &o) : Alloc(o) {}
+
+        pointer allocate(size_type n, const void * = 0)
+        {
+            if (_is_large(n))
+            {
+                void *p = huge_page_alloc(n * sizeof(value_type));
+                if (!p)
+                    throw std::bad_alloc();
+                return static_cast<pointer>(p);
+            }
+            return Alloc::allocate(n);
+        }
+
+        void deallocate(pointer p, size_type n)
+        {
+            if (_is_large(n))
+                huge_page_free(p, n * sizeof(value_type));
+            else
+                Alloc::deallocate(p, n);
+        }
+
+        // for the sparsegroup realloc path (which checks that Alloc supports it)
+        pointer reallocate(pointer p, size_type old_size, size_type new_size)
+        {
+            if (!_is_large(old_size) && !_is_large(new_size))
+                return Alloc::reallocate(p, old_size, new_size);
+
+            pointer res = allocate(new_size);
+            if (p)
+            {
+                memcpy(static_cast<void *>(res), p, (old_size < new_size ? old_size : new_size) * sizeof(value_type));
+                deallocate(p, old_size);
+            }
+            return res;
+        }
+
+        template <class U>
+        struct rebind
+        {
+            typedef huge_page_allocator<typename Alloc::template rebind<U>::other, MinBytes> other;
+        };
+
+    private:
+        static bool _is_large(size_type n)
+        {
+#ifdef SPP_HAS_MMAP
+            return (size_t)n * sizeof(value_type) >= MinBytes;
+#else
+            (void)n;
+            return false;
+#endif
+        }
+    };
+
+    template <class A, size_t MinBytes>
+    struct base_allocator<huge_page_allocator<A, MinBytes> >
+    {
+        typedef typename base_allocator<A>::type type;
+    };
+
+    template <class A, size_t MinBytes>
+    struct is_thread_safe_allocator<huge_page_allocator<A, MinBytes> >
+    {
+        static const bool value = is_thread_safe_allocator<A>::value;
+    };
+
+    template <class A, size_t MinBytes>
+    struct allocator_hooks<huge_page_allocator<A, MinBytes> > : public allocator_hooks<A>
+    {
+    };
+}
+
+#endif // spp_hugepage_h_guard
@@ -0,0 +1,361 @@
+#if !defined(spp_optimistic_h_guard)
+#define spp_optimistic_h_guard
+
+/* optimistic_sparse_hash_map: a sparse_hash_map for mostly read caches,
+   whose lookups run without locks while a single writer thread changes it.
+
+   Each group of the table carries a version counter, which the writer
+   makes odd while it changes the group's bitmaps or item array, and the
+   table carries another one, odd while its layout changes (resize, clear,
+   swap).  A lookup reads the buckets of its probe sequence, copying the
+   item it finds, and checks that the versions did not move meanwhile,
+   otherwise it reads the group (or the whole probe sequence) again.  So a
+   lookup costs about the same as a find(), and only waits for the writer
+   when both use the same group at the same time, or while the writer
+   changes the layout of the table.
+
+   To keep these waits short, the map resizes incrementally (see
+   sparse_hashtable::set_incremental_resize()): a resize only allocates the
+   new group array, then each writer call moves SPP_OPTIMISTIC_RESIZE_STEP
+   groups, while the lookups look in both tables.  clear() and reserve(),
+   which may finish a resize in progress, still make the lookups wait
+   until they are done, for a time proportional to the number of groups.
+
+   As a lookup may still be reading an item array the writer just
+   replaced, the arrays are not freed right away: epoch_allocator hands
+   them to an epoch_reclaimer, which frees them once the readers which
+   could be using them are done (see spp_epoch.h).  The same goes for the
+   group array replaced by a resize.
+
+   The lookups return a copy of the value, so the keys and values must
+   be trivially copyable.  The writer must only change the values through
+   insert_or_assign(), which updates the group version.  Robin hood
+   probing, which moves items between buckets on insert and erase, cannot
+   be used.
+
+   Requires C++11.
+*/
+
+#include "spp.h"
+#include "spp_epoch.h"
+
+#if defined(SPP_NO_CXX11_RVALUE_REFERENCES) || defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    #error "spp_optimistic.h requires C++11"
+#endif
+
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <type_traits>
+
+#ifndef SPP_OPTIMISTIC_RESIZE_STEP
+    // how many groups each writer call moves to the new table during a
+    // resize, during which the lookups wait
+    #define SPP_OPTIMISTIC_RESIZE_STEP 4
+#endif
+
+#ifndef SPP_RECLAIM_BATCH
+    // how many arrays the writer retires before it frees the ones no
+    // reader uses anymore
+    #define SPP_RECLAIM_BATCH 64
+#endif
+
+namespace spp_
+{
+
+// The version counter of sparsegroup and sparse_hashtable, when the
+// allocator asks for one (a seqlock)
+// ---------------------------------------------------------------------------
+template <>
+class version_counter<true>
+{
+public:
+    version_counter() : _v(0) {}
+    version_counter(const version_counter &) : _v(0) {}
+    version_counter& operator=(const version_counter &) { return *this; }
+
+    // writer: returns false if the counter is already odd
+    bool begin_write()
+    {
+        uint32_t v = _v.load(std::memory_order_relaxed);
+        if (v & 1)
+            return false;
+        _v.store(v + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);  // before the changes
+        return true;
+    }
+
+    void end_write()
+    {
+        _v.store(_v.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // reader: read_validate(read_begin()) is true if nothing changed in between
+    uint32_t read_begin() const
+    {
+        uint32_t v;
+        while ((v = _v.load(std::memory_order_acquire)) & 1)
+            std::this_thread::yield();
+        return v;
+    }
+
+    bool read_validate(uint32_t v) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);  // after the reads
+        return _v.load(std::memory_order_relaxed) == v;
+    }
+
+private:
+    std::atomic<uint32_t> _v;
+};
+
+// Frees the memory retired by the writer once no reader can be using it
+// ---------------------------------------------------------------------------
+class epoch_reclaimer
+{
+public:
+    epoch_reclaimer() {}
+
+    ~epoch_reclaimer()
+    {
+        for (size_t i = 0; i < _retired.size(); ++i)
+            free(_retired[i].p);
+    }
+
+    const reader_epochs& epochs() const { return _epochs; }
+
+    // p is unlinked, or will be before the writer calls reclaim()
+    void retire(void *p)
+    {
+        _retired.push_back(retired(p, _epochs.current()));
+    }
+
+    // Frees the memory retired before the oldest epoch still pinned
+    void reclaim()
+    {
+        if (_retired.empty())
+            return;
+        _epochs.advance();
+        const uint64_t oldest = _epochs.oldest();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < _retired.size(); ++i)
+        {
+            if (_retired[i].epoch < oldest)
+                free(_retired[i].p);
+            else
+                _retired[kept++] = _retired[i];
+        }
+        _retired.erase(_retired.begin() + kept, _retired.end());
+    }
+
+    size_t num_retired() const { return _retired.size(); }
+
+private:
+    epoch_reclaimer(const epoch_reclaimer &);
+    epoch_reclaimer& operator=(const epoch_reclaimer &);
+
+    struct retired
+    {
+        retired(void *ptr, uint64_t e) : p(ptr), epoch(e) {}
+
+        void    *p;
+        uint64_t epoch;          // when it was retired
+    };
+
+    reader_epochs        _epochs;
+    std::vector<retired> _retired;
+};
+
+// A libc_allocator which gives the memory it deallocates to an
+// epoch_reclaimer (or frees it right away without one), and asks the
+// tables using it for version counters.
+// ---------------------------------------------------------------------------
+template <class T>
+class epoch_allocator : public libc_allocator<T>
+{
+public:
+    typedef void      use_versions;
+    typedef T*        pointer;
+    typedef size_t    size_type;
+
+    epoch_allocator() : _reclaimer(0) {}
+    explicit epoch_allocator(epoch_reclaimer *r) : _reclaimer(r) {}
+
+    template <class U>
+    epoch_allocator(const epoch_allocator<U> &o) : _reclaimer(o.reclaimer()) {}
+
+    void deallocate(pointer p, size_type)
+    {
+        if (_reclaimer)
+            _reclaimer->retire(p);
+        else
+            free(p);
+    }
+
+    // never in place, the readers may still be using the old array
+    pointer reallocate(pointer p, size_type old_size, size_type new_size)
+    {
+        pointer res = this->allocate(new_size);
+        if (p)
+        {
+            memcpy(static_cast<void *>(res), p, (old_size < new_size ? old_size : new_size) * sizeof(T));
+            deallocate(p, old_size);
+        }
+        return res;
+    }
+
+    epoch_reclaimer *reclaimer() const { return _reclaimer; }
+
+    template <class U>
+    struct rebind
+    {
+        typedef epoch_allocator<U> other;
+    };
+
+private:
+    epoch_reclaimer *_reclaimer;
+};
+
+template <class T, class U>
+inline bool operator==(const epoch_allocator<T> &a, const epoch_allocator<U> &b)
+{
+    return a.reclaimer() == b.reclaimer();
+}
+
+template <class T, class U>
+inline bool operator!=(const epoch_allocator<T> &a, const epoch_allocator<U> &b)
+{
+    return !(a == b);
+}
+
+// retire() is not thread safe
+template <class T>
+struct is_thread_safe_allocator<epoch_allocator<T> >
+{
+    static const bool value = false;
+};
+
+//  ----------------------------------------------------------------------
+//       O P T I M I S T I C _ S P A R S E _ H A S H _ M A P
+//  ----------------------------------------------------------------------
+template <class Key, class T,
+          class HashFcn  = spp_hash<Key>,
+          class EqualKey = std::equal_to<Key>,
+          class Probing  = quadratic_probing>
+class optimistic_sparse_hash_map
+{
+public:
+    typedef epoch_allocator<std::pair<const Key, T> >                          allocator_type;
+    typedef sparse_hash_map<Key, T, HashFcn, EqualKey, allocator_type, Probing> submap_type;
+
+    typedef typename submap_type::key_type         key_type;
+    typedef typename submap_type::mapped_type      mapped_type;
+    typedef typename submap_type::value_type       value_type;
+    typedef typename submap_type::hasher           hasher;
+    typedef typename submap_type::key_equal        key_equal;
+    typedef typename submap_type::size_type        size_type;
+
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                  "optimistic_sparse_hash_map needs trivially copyable keys and values");
+    static_assert(!Probing::robin_hood,
+                  "optimistic_sparse_hash_map cannot use robin hood probing");
+
+    explicit optimistic_sparse_hash_map(size_type n = 0,
+                                        const hasher& hf = hasher(),
+                                        const key_equal& eql = key_equal()) :
+        _map(n, hf, eql, allocator_type(&_reclaimer))
+    {
+        _map.set_incremental_resize(SPP_OPTIMISTIC_RESIZE_STEP);
+    }
+
+    // Reader functions: from any thread, at any time
+    // ----------------------------------------------
+    bool find(const key_type& key, mapped_type& val) const
+    {
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type item;
+
+        reader_epochs::slot_type *slot = _reclaimer.epochs().pin();
+        bool res = _map.optimistic_find(key, &item);
+        reader_epochs::unpin(slot);
+        if (res)
+            val = reinterpret_cast<const value_type *>(&item)->second;
+        return res;
+    }
+
+    bool contains(const key_type& key) const
+    {
+        mapped_type val;
+        return find(key, val);
+    }
+
+    // Writer functions: from a single thread (or with a lock)
+    // -------------------------------------------------------
+    bool insert(const value_type& obj)
+    {
+        bool res = _map.insert(obj).second;
+        _maybe_reclaim();
+        return res;
+    }
+
+    // Returns true if key was inserted, false if its value was assigned
+    bool insert_or_assign(const key_type& key, const mapped_type& val)
+    {
+        typename submap_type::iterator it = _map.find(key);
+        if (it != _map.end())
+        {
+            version_guard<version_counter<true> > w(*it.row_current);
+            it->second = val;
+            return false;
+        }
+        _map.insert(value_type(key, val));
+        _maybe_reclaim();
+        return true;
+    }
+
+    size_type erase(const key_type& key)
+    {
+        size_type res = _map.erase(key);
+        _maybe_reclaim();
+        return res;
+    }
+
+    void clear()
+    {
+        _map.clear();
+        _maybe_reclaim();
+    }
+
+    void reserve(size_type n)
+    {
+        _map.reserve(n);
+        _maybe_reclaim();
+    }
+
+    size_type size() const { return _map.size(); }
+    bool empty() const     { return _map.empty(); }
+
+    // Frees the memory retired by the writer that no reader uses anymore,
+    // which the writer functions do every SPP_RECLAIM_BATCH arrays
+    void reclaim() { _reclaimer.reclaim(); }
+
+    // The map, for the writer only
+    const submap_type& writer_view() const { return _map; }
+
+private:
+    optimistic_sparse_hash_map(const optimistic_sparse_hash_map &);
+    optimistic_sparse_hash_map& operator=(const optimistic_sparse_hash_map &);
+
+    void _maybe_reclaim()
+    {
+        if (_reclaimer.num_retired() >= SPP_RECLAIM_BATCH)
+            _reclaimer.reclaim();
+    }
+
+    epoch_reclaimer _reclaimer;     // destroyed last, frees what _map retired
+    submap_type     _map;
+};
+
+}  // spp_ namespace
+
+#endif // spp_optimistic_h_guard
@@ -0,0 +1,837 @@
+#if !defined(spp_parallel_h_guard)
+#define spp_parallel_h_guard
+
+/* parallel_sparse_hash_map: a sparse_hash_map split into 2^N submaps
+   (shards), each one with its own mutex, so that threads working on keys
+   of different shards do not wait for each other:
+
+       spp::parallel_sparse_hash_map<K, V> m;     // 16 shards
+
+   The shard of a key is given by the high bits of its hash, and the
+   submap uses the low bits as usual, so the hash is computed only once.
+   Each shard grows (or resizes incrementally) on its own, when it fills
+   up, and only blocks the threads using that shard meanwhile.
+
+   The functions taking a key (find, insert, operator[], erase, ...) lock
+   the shard of the key for their duration, and the functions on the
+   whole map (size, clear, swap, serialize, ...) lock the shards one at a
+   time.  But the iterators and references they return are not protected:
+   they may be invalidated by another thread modifying the same shard, so
+   they should only be used when the writers are done, or through the
+   locking operations on values.  Iterating over the map is not locked.
+
+   These locking operations (if_contains, modify_if, try_emplace_l,
+   erase_if, for_each and for_each_m) call a function on the value while
+   the shard of its key is locked, and probe for the key only once, so a
+   read-modify-write needs neither a second lookup nor another lock:
+
+       m.try_emplace_l(word, [](value_type &v) { ++v.second; }, 1);
+
+   With N == 0, the map is a single sparse_hash_map carrying its own
+   lock, whose type is selected by Mutex (any class with lock() and
+   unlock()).
+
+   Requires C++11.
+*/
+
+#include "spp.h"
+
+#if defined(SPP_NO_CXX11_RVALUE_REFERENCES) || defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    #error "spp_parallel.h requires C++11"
+#endif
+
+#include <mutex>
+#include <iterator>
+
+namespace spp_
+{
+
+//  ----------------------------------------------------------------------
+//          P A R A L L E L _ S P A R S E _ H A S H _ M A P
+//  ----------------------------------------------------------------------
+template <class Key, class T,
+          class HashFcn  = spp_hash<Key>,
+          class EqualKey = std::equal_to<Key>,
+          class Alloc    = SPP_DEFAULT_ALLOCATOR<std::pair<const Key, T> >,
+          class Probing  = quadratic_probing,
+          size_t N       = 4,                  // 2^N shards
+          class Mutex    = std::mutex>
+class parallel_sparse_hash_map
+{
+public:
+    typedef sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc, Probing> submap_type;
+    typedef Mutex                                  mutex_type;
+
+    typedef typename submap_type::key_type         key_type;
+    typedef typename submap_type::data_type        data_type;
+    typedef typename submap_type::mapped_type      mapped_type;
+    typedef typename submap_type::value_type       value_type;
+    typedef typename submap_type::hasher           hasher;
+    typedef typename submap_type::key_equal        key_equal;
+    typedef typename submap_type::allocator_type   allocator_type;
+    typedef typename submap_type::size_type        size_type;
+    typedef typename submap_type::difference_type  difference_type;
+    typedef typename submap_type::pointer          pointer;
+    typedef typename submap_type::const_pointer    const_pointer;
+    typedef typename submap_type::reference        reference;
+    typedef typename submap_type::const_reference  const_reference;
+
+    static const size_t num_shards = (size_t)1 << N;
+
+private:
+    struct Shard
+    {
+        mutable mutex_type mutex;
+        submap_type        map;
+    };
+
+    typedef std::lock_guard<mutex_type> lock_guard;
+
+    // Goes over the items of the shards [shard, last) in order.  Stays on
+    // an item, or on last (for end()).
+    // -------------------------------------------------------------------
+    template <class ShardT, class SubIt, class Ref, class Ptr>
+    class iterator_impl
+    {
+    public:
+        typedef std::forward_iterator_tag  iterator_category;
+        typedef typename parallel_sparse_hash_map::value_type      value_type;
+        typedef typename parallel_sparse_hash_map::difference_type difference_type;
+        typedef Ref                        reference;
+        typedef Ptr                        pointer;
+
+        iterator_impl() : _shard(0), _last(0), _it() {}
+
+        // iterator to const_iterator
+        template <class S2, class It2, class R2, class P2>
+        iterator_impl(const iterator_impl<S2, It2, R2, P2> &o) :
+            _shard(o._shard), _last(o._last), _it(o._it) {}
+
+        reference operator*() const  { return *_it; }
+        pointer   operator->() const { return &*_it; }
+
+        iterator_impl& operator++()
+        {
+            ++_it;
+            _skip_empty();
+            return *this;
+        }
+
+        iterator_impl operator++(int)
+        {
+            iterator_impl tmp(*this);
+            ++*this;
+            return tmp;
+        }
+
+        template <class S2, class It2, class R2, class P2>
+        bool operator==(const iterator_impl<S2, It2, R2, P2> &o) const
+        {
+            return _shard == o._shard && (_shard == _last || _it == o._it);
+        }
+
+        template <class S2, class It2, class R2, class P2>
+        bool operator!=(const iterator_impl<S2, It2, R2, P2> &o) const
+        {
+            return !(*this == o);
+        }
+
+    private:
+        template <class S2, class It2, class R2, class P2> friend class iterator_impl;
+        friend class parallel_sparse_hash_map;
+
+        iterator_impl(ShardT *shard, ShardT *last, SubIt it) :
+            _shard(shard), _last(last), _it(it)
+        {
+            _skip_empty();
+        }
+
+        // begin() of the first shard from shard on which is not empty
+        iterator_impl(ShardT *shard, ShardT *last) : _shard(shard), _last(last), _it()
+        {
+            if (_shard != _last)
+            {
+                _it = _shard->map.begin();
+                _skip_empty();
+            }
+        }
+
+        void _skip_empty()
+        {
+            while (_shard != _last && _it == _shard->map.end())
+            {
+                if (++_shard != _last)
+                    _it = _shard->map.begin();
+            }
+        }
+
+        ShardT *_shard;
+        ShardT *_last;
+        SubIt   _it;
+    };
+
+public:
+    typedef iterator_impl<Shard, typename submap_type::iterator,
+                          reference, pointer>                         iterator;
+    typedef iterator_impl<const Shard, typename submap_type::const_iterator,
+                          const_reference, const_pointer>             const_iterator;
+
+    // Iterator functions (not locked)
+    // -------------------------------
+    iterator       begin()           { return iterator(_shards, _shards + num_shards); }
+    iterator       end()             { return iterator(_shards + num_shards, _shards + num_shards); }
+    const_iterator begin() const     { return const_iterator(_shards, _shards + num_shards); }
+    const_iterator end() const       { return const_iterator(_shards + num_shards, _shards + num_shards); }
+    const_iterator cbegin() const    { return begin(); }
+    const_iterator cend() const      { return end(); }
+
+    // Accessor functions
+    // ------------------
+    allocator_type get_allocator() const { return _shards[0].map.get_allocator(); }
+    hasher hash_funct() const            { return _shards[0].map.hash_funct(); }
+    hasher hash_function() const         { return hash_funct(); }
+    key_equal key_eq() const             { return _shards[0].map.key_eq(); }
+
+    // Constructors.  Unless an allocator is given, each shard gets its own
+    // default constructed one, so that allocators which are not thread safe
+    // (such as spp_allocator) are not shared between the shards.  n is the
+    // number of buckets for the whole map.
+    // ----------------------------------------------------------------------
+    explicit parallel_sparse_hash_map(size_type n = 0,
+                                      const hasher& hf = hasher(),
+                                      const key_equal& eql = key_equal())
+    {
+        _init(n, hf, eql, 0);
+    }
+
+    parallel_sparse_hash_map(size_type n,
+                             const hasher& hf,
+                             const key_equal& eql,
+                             const allocator_type& alloc)
+    {
+        _init(n, hf, eql, &alloc);
+    }
+
+    explicit parallel_sparse_hash_map(const allocator_type& alloc)
+    {
+        _init(0, hasher(), key_equal(), &alloc);
+    }
+
+    template <class InputIterator>
+    parallel_sparse_hash_map(InputIterator f, InputIterator l,
+                             size_type n = 0,
+                             const hasher& hf = hasher(),
+                             const key_equal& eql = key_equal())
+    {
+        _init(n, hf, eql, 0);
+        insert(f, l);
+    }
+
+    parallel_sparse_hash_map(std::initializer_list<value_type> init,
+                             size_type n = 0,
+                             const hasher& hf = hasher(),
+                             const key_equal& eql = key_equal())
+    {
+        _init(n, hf, eql, 0);
+        insert(init.begin(), init.end());
+    }
+
+    parallel_sparse_hash_map(const parallel_sparse_hash_map &o)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(o._shards[i].mutex);
+            _shards[i].map = o._shards[i].map;
+        }
+    }
+
+    parallel_sparse_hash_map(parallel_sparse_hash_map &&o)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(o._shards[i].mutex);
+            _shards[i].map.swap(o._shards[i].map);
+        }
+    }
+
+    parallel_sparse_hash_map& operator=(const parallel_sparse_hash_map &o)
+    {
+        if (&o != this)
+        {
+            for (size_t i = 0; i < num_shards; ++i)
+            {
+                _lock_pair lock(_shards[i], o._shards[i]);
+                _shards[i].map = o._shards[i].map;
+            }
+        }
+        return *this;
+    }
+
+    parallel_sparse_hash_map& operator=(parallel_sparse_hash_map &&o)
+    {
+        swap(o);
+        return *this;
+    }
+
+    parallel_sparse_hash_map& operator=(std::initializer_list<value_type> init)
+    {
+        clear();
+        insert(init.begin(), init.end());
+        return *this;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.clear();
+        }
+    }
+
+    void swap(parallel_sparse_hash_map &o)
+    {
+        if (&o == this)
+            return;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            _lock_pair lock(_shards[i], o._shards[i]);
+            _shards[i].map.swap(o._shards[i].map);
+        }
+    }
+
+    // Functions concerning size
+    // -------------------------
+    size_type size() const
+    {
+        size_type res = 0;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            res += _shards[i].map.size();
+        }
+        return res;
+    }
+
+    bool empty() const                  { return size() == 0; }
+    size_type max_size() const          { return _shards[0].map.max_size(); }
+
+    size_type bucket_count() const
+    {
+        size_type res = 0;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            res += _shards[i].map.bucket_count();
+        }
+        return res;
+    }
+
+    float load_factor() const           { return size() * 1.0f / bucket_count(); }
+
+    float max_load_factor() const       { return _shards[0].map.max_load_factor(); }
+    void  max_load_factor(float grow)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.max_load_factor(grow);
+        }
+    }
+
+    // Room for cnt items in the whole map, spread over the shards
+    void resize(size_type cnt)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.resize((cnt + num_shards - 1) / num_shards);
+        }
+    }
+
+    void rehash(size_type cnt)          { resize(cnt); }
+    void reserve(size_type cnt)         { resize(cnt); }
+
+    // Applies to each shard, see the sparse_hash_map versions
+    void set_incremental_resize(size_type groups_per_op)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.set_incremental_resize(groups_per_op);
+        }
+    }
+
+    void set_purge_factor(float f)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.set_purge_factor(f);
+        }
+    }
+
+    void purge_deleted()
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.purge_deleted();
+        }
+    }
+
+    void shrink_to_fit()
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            _shards[i].map.shrink_to_fit();
+        }
+    }
+
+    // The memory used by all the shards, see memory_usage_info
+    memory_usage_info memory_usage() const
+    {
+        memory_usage_info res;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            memory_usage_info mu = _shards[i].map.memory_usage();
+            res.group_bytes += mu.group_bytes;
+            res.item_bytes  += mu.item_bytes;
+            res.slack_bytes += mu.slack_bytes;
+            res.num_erased  += mu.num_erased;
+        }
+        return res;
+    }
+
+    // Precomputed hash: hash(key) selects the shard, and is then passed to
+    // the submap, see sparse_hash_map::hash().
+    // ---------------------------------------------------------------------
+    size_t hash(const key_type& key) const { return _shards[0].map.hash(key); }
+
+    // The submap holding key, and its mutex.  For use by a single thread,
+    // or with the mutex held.
+    size_t subidx(size_t hashval) const  { return _shard_of(hashval); }
+
+    submap_type& get_inner(size_t idx)               { return _shards[idx].map; }
+    const submap_type& get_inner(size_t idx) const   { return _shards[idx].map; }
+    mutex_type& get_mutex(size_t idx) const          { return _shards[idx].mutex; }
+
+    // Lookup
+    // ------
+    iterator find(const key_type& key)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.find(key, hashval));
+    }
+
+    const_iterator find(const key_type& key) const
+    {
+        size_t hashval = hash(key);
+        const Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.find(key, hashval));
+    }
+
+    bool contains(const key_type& key) const    { return count(key) != 0; }
+
+    size_type count(const key_type& key) const
+    {
+        size_t hashval = hash(key);
+        const Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return s.map.count(key, hashval);
+    }
+
+    std::pair<iterator, iterator> equal_range(const key_type& key)
+    {
+        iterator it = find(key);
+        iterator next = it;
+        if (it != end())
+            ++next;
+        return std::pair<iterator, iterator>(it, next);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const key_type& key) const
+    {
+        const_iterator it = find(key);
+        const_iterator next = it;
+        if (it != end())
+            ++next;
+        return std::pair<const_iterator, const_iterator>(it, next);
+    }
+
+    mapped_type& at(const key_type& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            throw_exception(std::out_of_range("at: key not present"));
+        return it->second;
+    }
+
+    const mapped_type& at(const key_type& key) const
+    {
+        const_iterator it = find(key);
+        if (it == end())
+            throw_exception(std::out_of_range("at: key not present"));
+        return it->second;
+    }
+
+    mapped_type& operator[](const key_type& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    mapped_type& operator[](key_type&& key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    // Insert
+    // ------
+    std::pair<iterator, bool> insert(const value_type& obj)
+    {
+        size_t hashval = hash(obj.first);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.insert_with_hash(hashval, obj));
+    }
+
+    template <class P>
+    std::pair<iterator, bool> insert(P&& obj)
+    {
+        value_type val(std::forward<P>(obj));
+        size_t hashval = hash(val.first);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.insert_with_hash(hashval, std::move(val)));
+    }
+
+    template <class InputIterator>
+    void insert(InputIterator f, InputIterator l)
+    {
+        for (; f != l; ++f)
+            insert(*f);
+    }
+
+    void insert(std::initializer_list<value_type> init)
+    {
+        insert(init.begin(), init.end());
+    }
+
+    iterator insert(const_iterator , const value_type& obj) { return insert(obj).first; }
+
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    template <class... Args>
+    iterator emplace_hint(const_iterator , Args&&... args)
+    {
+        return emplace(std::forward<Args>(args)...).first;
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const key_type& key, Args&&... args)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.try_emplace_with_hash(hashval, key, std::forward<Args>(args)...));
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(key_type&& key, Args&&... args)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return _mk_iterator(s, s.map.try_emplace_with_hash(hashval, std::move(key),
+                                                           std::forward<Args>(args)...));
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const key_type& key, M&& obj)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        std::pair<typename submap_type::iterator, bool> res =
+            s.map.try_emplace_with_hash(hashval, key, std::forward<M>(obj));   // not moved from if present
+        if (!res.second)
+            res.first->second = std::forward<M>(obj);
+        return _mk_iterator(s, res);
+    }
+
+    // Erase
+    // -----
+    size_type erase(const key_type& key)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        return s.map.erase(key, hashval);
+    }
+
+    iterator erase(const_iterator it)
+    {
+        Shard *s = const_cast<Shard *>(it._shard);
+        typename submap_type::iterator next;
+        {
+            lock_guard lock(s->mutex);
+            next = s->map.erase(it._it);
+        }
+        return iterator(s, _shards + num_shards, next);
+    }
+
+    iterator erase(iterator it)         { return erase(const_iterator(it)); }
+
+    iterator erase(iterator f, iterator l)
+    {
+        while (f != l)
+            f = erase(f);
+        return f;
+    }
+
+    // Locking operations, see above.  f (or pred) is called with the shard
+    // of the key locked, so it must not use the map.
+    // --------------------------------------------------------------------
+
+    // Calls f(const value_type&) if key is present.  Returns whether it is.
+    template <class F>
+    bool if_contains(const key_type& key, F&& f) const
+    {
+        size_t hashval = hash(key);
+        const Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        typename submap_type::const_iterator it = s.map.find(key, hashval);
+        if (it == s.map.end())
+            return false;
+        f(*it);
+        return true;
+    }
+
+    // Calls f(value_type&) if key is present.  Returns whether it is.
+    template <class F>
+    bool modify_if(const key_type& key, F&& f)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        typename submap_type::iterator it = s.map.find(key, hashval);
+        if (it == s.map.end())
+            return false;
+        f(*it);
+        return true;
+    }
+
+    // Inserts (key, mapped_type(args...)) if key is not present, otherwise
+    // calls f(value_type&) on the value already there.  Returns whether it
+    // inserted.
+    template <class F, class... Args>
+    bool try_emplace_l(const key_type& key, F&& f, Args&&... args)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        std::pair<typename submap_type::iterator, bool> res =
+            s.map.try_emplace_with_hash(hashval, key, std::forward<Args>(args)...);
+        if (!res.second)
+            f(*res.first);
+        return res.second;
+    }
+
+    template <class F, class... Args>
+    bool try_emplace_l(key_type&& key, F&& f, Args&&... args)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        std::pair<typename submap_type::iterator, bool> res =
+            s.map.try_emplace_with_hash(hashval, std::move(key), std::forward<Args>(args)...);
+        if (!res.second)
+            f(*res.first);
+        return res.second;
+    }
+
+    // Erases the value of key if pred(value_type&) returns true.  Returns
+    // whether it did.
+    template <class F>
+    bool erase_if(const key_type& key, F&& pred)
+    {
+        size_t hashval = hash(key);
+        Shard &s = _shard(hashval);
+        lock_guard lock(s.mutex);
+        typename submap_type::iterator it = s.map.find(key, hashval);
+        if (it == s.map.end() || !pred(*it))
+            return false;
+        s.map.erase(it);               // by position, without probing again
+        return true;
+    }
+
+    // Calls f(const value_type&), or f(value_type&) with for_each_m, on all
+    // the values, one shard at a time, each one locked meanwhile.
+    template <class F>
+    void for_each(F&& f) const
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            const submap_type &m = _shards[i].map;
+            for (typename submap_type::const_iterator it = m.begin(); it != m.end(); ++it)
+                f(*it);
+        }
+    }
+
+    template <class F>
+    void for_each_m(F&& f)
+    {
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            submap_type &m = _shards[i].map;
+            for (typename submap_type::iterator it = m.begin(); it != m.end(); ++it)
+                f(*it);
+        }
+    }
+
+    // Comparison
+    // ----------
+    bool operator==(const parallel_sparse_hash_map& o) const
+    {
+        if (&o == this)
+            return true;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            _lock_pair lock(_shards[i], o._shards[i]);
+            if (_shards[i].map != o._shards[i].map)
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const parallel_sparse_hash_map& o) const { return !(*this == o); }
+
+    // I/O: the shards are written one after the other, after a header
+    // holding their number, which must match when reading them back.  See
+    // sparse_hash_map::serialize() for the serializer and fp.
+    // -------------------------------------------------------------------
+    typedef typename submap_type::NopointerSerializer NopointerSerializer;
+
+    template <typename ValueSerializer, typename OUTPUT>
+    bool serialize(ValueSerializer serializer, OUTPUT* fp)
+    {
+        if (!sparsehash_internal::write_bigendian_number(fp, (uint32_t)MAGIC_NUMBER, 4) ||
+            !sparsehash_internal::write_bigendian_number(fp, (uint32_t)num_shards, 4))
+            return false;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            if (!_shards[i].map.serialize(serializer, fp))
+                return false;
+        }
+        return true;
+    }
+
+    template <typename ValueSerializer, typename INPUT>
+    bool unserialize(ValueSerializer serializer, INPUT* fp)
+    {
+        uint32_t magic = 0, shards = 0;
+        if (!sparsehash_internal::read_bigendian_number(fp, &magic, 4) || magic != MAGIC_NUMBER ||
+            !sparsehash_internal::read_bigendian_number(fp, &shards, 4) || shards != num_shards)
+            return false;
+        for (size_t i = 0; i < num_shards; ++i)
+        {
+            lock_guard lock(_shards[i].mutex);
+            if (!_shards[i].map.unserialize(serializer, fp))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static const uint32_t MAGIC_NUMBER = 0x5350504d;    // "SPPM"
+
+    void _init(size_type n, const hasher& hf, const key_equal& eql, const allocator_type *alloc)
+    {
+        const size_type per_shard = (n + num_shards - 1) / num_shards;
+        for (size_t i = 0; i < num_shards; ++i)
+            _shards[i].map = submap_type(per_shard, hf, eql, alloc ? *alloc : allocator_type());
+    }
+
+    // The high N bits of hashval, once mixed so that they depend on all
+    // its bits (the hash of an integer may have its high bits all zero).
+    // The submaps use the low bits.  Shifted twice, so that N == 0 works.
+    static size_t _shard_of(size_t hashval)
+    {
+        if (sizeof(size_t) == 8)
+            return (size_t)((((uint64_t)hashval * 0x9E3779B97F4A7C15ULL) >> (63 - N)) >> 1);
+        return (size_t)((((uint32_t)hashval * 0x9E3779B9U) >> (31 - N)) >> 1);
+    }
+
+    Shard&       _shard(size_t hashval)       { return _shards[subidx(hashval)]; }
+    const Shard& _shard(size_t hashval) const { return _shards[subidx(hashval)]; }
+
+    iterator _mk_iterator(Shard &s, typename submap_type::iterator it)
+    {
+        return it == s.map.end() ? end() : iterator(&s, _shards + num_shards, it);
+    }
+
+    const_iterator _mk_iterator(const Shard &s, typename submap_type::const_iterator it) const
+    {
+        return it == s.map.end() ? end() : const_iterator(&s, _shards + num_shards, it);
+    }
+
+    std::pair<iterator, bool> _mk_iterator(Shard &s, std::pair<typename submap_type::iterator, bool> res)
+    {
+        return std::pair<iterator, bool>(iterator(&s, _shards + num_shards, res.first), res.second);
+    }
+
+    // Locks the mutexes of two shards, in a consistent order
+    class _lock_pair
+    {
+    public:
+        _lock_pair(const Shard &a, const Shard &b) :
+            _first(&a < &b ? a.mutex : b.mutex), _second(&a < &b ? b.mutex : a.mutex)
+        {
+            _first.lock();
+            if (&_second != &_first)
+                _second.lock();
+        }
+
+        ~_lock_pair()
+        {
+            if (&_second != &_first)
+                _second.unlock();
+            _first.unlock();
+        }
+
+    private:
+        _lock_pair(const _lock_pair &);
+        _lock_pair& operator=(const _lock_pair &);
+
+        mutex_type &_first;
+        mutex_type &_second;
+    };
+
+    Shard _shards[num_shards];
+};
+
+template <class K, class T, class H, class E, class A, class P, size_t N, class M>
+const size_t parallel_sparse_hash_map<K, T, H, E, A, P, N, M>::num_shards;
+
+template <class K, class T, class H, class E, class A, class P, size_t N, class M>
+inline void swap(parallel_sparse_hash_map<K, T, H, E, A, P, N, M> &hm1,
+                 parallel_sparse_hash_map<K, T, H, E, A, P, N, M> &hm2)
+{
+    hm1.swap(hm2);
+}
+
+}  // spp_ namespace
+
+#endif // spp_parallel_h_guard
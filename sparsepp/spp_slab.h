@@ -0,0 +1,520 @@
+#if !defined(spp_slab_h_guard)
+#define spp_slab_h_guard
+
+/* A size-class slab allocator for the small item arrays of sparsepp groups.
+
+   A sparsegroup holds at most SPP_GROUP_SIZE items, and its array is
+   reallocated to the next growth policy size (see sparsegroup::_sizing) as
+   items are inserted and erased. With a general purpose malloc, millions of
+   these tiny blocks fragment the heap, and every resize takes the malloc lock.
+
+   A SlabArena carves pages of SPP_SLAB_PAGE_SIZE bytes into blocks of one
+   size class each (SPP_SLAB_GRANULE bytes apart, up to SPP_SLAB_MAX_BYTES).
+   A freed block is reused by the next array of the same class. A page is
+   given back to malloc when its last block is freed, as happens to the old
+   groups when a table is resized. Larger blocks (such as the group array of
+   a big sparsetable) go straight to malloc.
+
+   Growing an array within its class does not move it, but growing it into
+   another class does: as a page only holds blocks of one class, the block
+   after an array is never room for a larger size, so the array cannot grow
+   in place into the next class. And since the growth policy rounds the
+   array sizes up, most growths change class, and cost an allocation and a
+   memcpy, as they do with realloc.
+
+   The blocks freed as the arrays grow stay in their pages until an array
+   of the same class reuses them, so the arena may use more memory than
+   malloc: inserting 10M random int keys in a sparse_hash_map<int, int>
+   peaks about 17% higher (161MB instead of 137MB), while inserting keys
+   in order does not cost more.
+
+   The arena is not thread safe, and lives until the last allocator
+   referencing it goes away. By default, each map gets its own arena:
+
+       sparse_hash_map<K, V, spp_hash<K>, std::equal_to<K>,
+                       spp_slab_allocator<std::pair<const K, V> > > m;
+
+   Maps used by a single thread can share that thread's arena instead:
+
+       Map m(0, hasher(), key_equal(), Map::allocator_type(SlabArena::this_thread()));
+*/
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include "spp_stdint.h"
+#include "spp_utils.h"
+#include "spp_smartptr.h"
+
+#ifdef SPP_SLAB_HUGE_PAGES
+    // carve the pages out of huge pages, see spp_hugepage.h
+    #include "spp_hugepage.h"
+#endif
+
+#ifndef SPP_SLAB_GRANULE
+    // must be a power of 2, and a multiple of the alignment needed by the items
+    #define SPP_SLAB_GRANULE 16
+#endif
+
+#ifndef SPP_SLAB_MAX_BYTES
+    // blocks larger than this are allocated with malloc
+    #define SPP_SLAB_MAX_BYTES 2048
+#endif
+
+#ifndef SPP_SLAB_PAGE_SIZE
+    // must be a power of 2, and hold several blocks of SPP_SLAB_MAX_BYTES
+    #define SPP_SLAB_PAGE_SIZE (16 * 1024)
+#endif
+
+#ifndef SPP_SLAB_CHUNK_PAGES
+    // pages are allocated from malloc in chunks of up to this many pages.
+    // The first chunk is a single page, and each next one as large as the
+    // arena, so that small maps with their own arena stay small.
+    #define SPP_SLAB_CHUNK_PAGES 64
+#endif
+
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+    #define SPP_SLAB_THREAD_ARENA
+#endif
+
+namespace spp_
+{
+    // -----------------------------------------------------------
+    // -----------------------------------------------------------
+    class SlabArena : public spp_rc
+    {
+    public:
+        enum { num_classes = SPP_SLAB_MAX_BYTES / SPP_SLAB_GRANULE };
+
+        SlabArena() : _chunks(0), _num_pages(0), _max_pages(0)
+        {
+            memset(_partial, 0, sizeof(_partial));
+        }
+
+        // the maps using the arena are gone, so all its pages are empty
+        ~SlabArena()
+        {
+            while (_chunks)
+            {
+                Chunk *next = _chunks->next;
+                _free_chunk(_chunks);
+                _chunks = next;
+            }
+        }
+
+        // size class of a block of the given size, or 0 if it is too large
+        // for the arena.
+        static size_t size_class(size_t bytes)
+        {
+            if (bytes > SPP_SLAB_MAX_BYTES)
+                return 0;
+            return bytes ? (bytes + SPP_SLAB_GRANULE - 1) / SPP_SLAB_GRANULE : 1;
+        }
+
+        void *allocate(size_t bytes)
+        {
+            size_t c = size_class(bytes);
+            if (!c)
+                return _checked(malloc(bytes));
+
+            Page *page = _partial[c - 1];
+            if (!page)
+                page = _new_page(c);
+
+            void *res;
+            if (page->free_list)
+            {
+                res = page->free_list;
+                page->free_list = page->free_list->next;
+            }
+            else
+            {
+                res = page->bump;
+                page->bump += c * SPP_SLAB_GRANULE;
+            }
+            ++page->live;
+            if (!page->free_list && !_has_room(page))
+                _unlink(page);                        // full
+            return res;
+        }
+
+        void deallocate(void *p, size_t bytes)
+        {
+            if (!p)
+                return;
+            size_t c = size_class(bytes);
+            if (!c)
+            {
+                free(p);
+                return;
+            }
+
+            Page *page = _page_of(p);
+            assert(page->size_class == c);
+            if (!page->free_list && !_has_room(page))
+                _link(page);                          // was full
+
+            FreeBlock *b = static_cast<FreeBlock *>(p);
+            b->next = page->free_list;
+            page->free_list = b;
+            if (--page->live == 0)
+            {
+                _unlink(page);
+                _free_page(page);
+            }
+        }
+
+        // The block is only kept when the new size is in the same class
+        // (see above), otherwise its content is moved with memcpy, so this
+        // must only be used for relocatable types.
+        void *reallocate(void *p, size_t old_bytes, size_t new_bytes)
+        {
+            if (!p)
+                return allocate(new_bytes);
+
+            size_t old_class = size_class(old_bytes);
+            size_t new_class = size_class(new_bytes);
+            if (old_class == new_class)
+            {
+                if (old_class)
+                    return p;                          // still fits in the block
+                return _checked(realloc(p, new_bytes));
+            }
+
+            void *res = allocate(new_bytes);
+            memcpy(res, p, old_bytes < new_bytes ? old_bytes : new_bytes);
+            deallocate(p, old_bytes);
+            return res;
+        }
+
+        // memory held in chunks, not counting the large blocks.
+        size_t footprint() const     { return _num_pages * SPP_SLAB_PAGE_SIZE; }
+        size_t max_footprint() const { return _max_pages * SPP_SLAB_PAGE_SIZE; }
+
+        // Frees the empty chunk kept for the next allocations, if any.
+        // Returns 1 if some memory was released.
+        int trim()
+        {
+            int res = 0;
+            for (Chunk *chunk = _chunks; chunk; )
+            {
+                Chunk *next = chunk->next;
+                if (chunk->num_empty == chunk->num_pages)
+                {
+                    _release_chunk(chunk);
+                    res = 1;
+                }
+                chunk = next;
+            }
+            return res;
+        }
+
+#ifdef SPP_SLAB_THREAD_ARENA
+        // The arena of the calling thread. It lives as long as the thread or
+        // the last allocator using it, whichever comes last. The maps
+        // sharing it must only be used (and destroyed) by that thread.
+        static SlabArena *this_thread()
+        {
+            static thread_local spp_sptr<SlabArena> arena(new SlabArena);
+            return arena.get();
+        }
+#endif
+
+    private:
+        SlabArena(const SlabArena &);
+        SlabArena& operator=(const SlabArena &);
+
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        struct Chunk;
+
+        // Pages are aligned on their size, so that the page of a block is
+        // found from its address. The blocks follow this header.
+        struct Page
+        {
+            Page      *next;          // in the list of pages with free blocks,
+            Page      *prev;          // or of the empty pages of the chunk
+            FreeBlock *free_list;     // blocks freed in this page
+            char      *bump;          // blocks never allocated start here
+            size_t     live;
+            size_t     size_class;
+            Chunk     *chunk;
+        };
+
+        struct Chunk
+        {
+            Chunk     *next;          // in the list of chunks with empty pages
+            Chunk     *prev;
+            void      *mem;           // as returned by malloc
+            Page      *empty;         // pages freed in this chunk
+            char      *fresh;         // pages never used start here
+            size_t     num_pages;
+            size_t     num_empty;
+#ifdef SPP_SLAB_HUGE_PAGES
+            bool       huge;
+#endif
+        };
+
+        enum { header_size = (sizeof(Page) + SPP_SLAB_GRANULE - 1) & ~(SPP_SLAB_GRANULE - 1) };
+
+        static void *_checked(void *p)
+        {
+            if (!p)
+                throw std::bad_alloc();
+            return p;
+        }
+
+        static Page *_page_of(void *p)
+        {
+            return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(SPP_SLAB_PAGE_SIZE - 1));
+        }
+
+        static bool _has_room(const Page *page)
+        {
+            return page->bump + page->size_class * SPP_SLAB_GRANULE <=
+                reinterpret_cast<const char *>(page) + SPP_SLAB_PAGE_SIZE;
+        }
+
+        void _link(Page *page)
+        {
+            Page *&head = _partial[page->size_class - 1];
+            page->prev = 0;
+            page->next = head;
+            if (head)
+                head->prev = page;
+            head = page;
+        }
+
+        void _unlink(Page *page)
+        {
+            if (page->prev)
+                page->prev->next = page->next;
+            else
+                _partial[page->size_class - 1] = page->next;
+            if (page->next)
+                page->next->prev = page->prev;
+        }
+
+        Page *_new_page(size_t c)
+        {
+            if (!_chunks)
+                _new_chunk();
+
+            Chunk *chunk = _chunks;
+            Page *page = chunk->empty;
+            if (page)
+                chunk->empty = page->next;
+            else
+            {
+                page = reinterpret_cast<Page *>(chunk->fresh);
+                chunk->fresh += SPP_SLAB_PAGE_SIZE;
+            }
+            if (--chunk->num_empty == 0)
+                _unlink_chunk(chunk);
+
+            page->free_list = 0;
+            page->bump = reinterpret_cast<char *>(page) + header_size;
+            page->live = 0;
+            page->size_class = c;
+            page->chunk = chunk;
+            _link(page);
+            return page;
+        }
+
+        void _free_page(Page *page)
+        {
+            Chunk *chunk = page->chunk;
+            if (chunk->num_empty++ == 0)
+                _link_chunk(chunk);
+            page->next = chunk->empty;
+            chunk->empty = page;
+
+            // keep the last chunk, in case the next allocation needs a page
+            if (chunk->num_empty == chunk->num_pages && (chunk->next || chunk->prev))
+                _release_chunk(chunk);
+        }
+
+        void _release_chunk(Chunk *chunk)
+        {
+            _unlink_chunk(chunk);
+            _num_pages -= chunk->num_pages;
+            _free_chunk(chunk);
+        }
+
+        static void _free_chunk(Chunk *chunk)
+        {
+#ifdef SPP_SLAB_HUGE_PAGES
+            if (chunk->huge)
+                huge_page_free(chunk->mem, SPP_HUGE_PAGE_SIZE);
+            else
+#endif
+                free(chunk->mem);
+            free(chunk);
+        }
+
+        void _new_chunk()
+        {
+            size_t num_pages = _num_pages ? _num_pages : 1;
+            if (num_pages > SPP_SLAB_CHUNK_PAGES)
+                num_pages = SPP_SLAB_CHUNK_PAGES;
+
+            Chunk *chunk = static_cast<Chunk *>(_checked(malloc(sizeof(Chunk))));
+#ifdef SPP_SLAB_HUGE_PAGES
+            // a huge page is already aligned
+            chunk->mem = huge_page_alloc(SPP_HUGE_PAGE_SIZE);
+            chunk->huge = (chunk->mem != 0);
+            if (chunk->huge)
+                num_pages = SPP_HUGE_PAGE_SIZE / SPP_SLAB_PAGE_SIZE;
+            else
+#endif
+                chunk->mem = malloc((num_pages + 1) * SPP_SLAB_PAGE_SIZE);  // one more page, to align them
+            if (!chunk->mem)
+            {
+                free(chunk);
+                throw std::bad_alloc();
+            }
+            _num_pages += num_pages;
+            if (_num_pages > _max_pages)
+                _max_pages = _num_pages;
+
+            uintptr_t first = (reinterpret_cast<uintptr_t>(chunk->mem) + SPP_SLAB_PAGE_SIZE - 1) &
+                              ~(uintptr_t)(SPP_SLAB_PAGE_SIZE - 1);
+            chunk->empty = 0;
+            chunk->fresh = reinterpret_cast<char *>(first);
+            chunk->num_pages = chunk->num_empty = num_pages;
+            _link_chunk(chunk);
+        }
+
+        void _link_chunk(Chunk *chunk)
+        {
+            chunk->prev = 0;
+            chunk->next = _chunks;
+            if (_chunks)
+                _chunks->prev = chunk;
+            _chunks = chunk;
+        }
+
+        void _unlink_chunk(Chunk *chunk)
+        {
+            if (chunk->prev)
+                chunk->prev->next = chunk->next;
+            else
+                _chunks = chunk->next;
+            if (chunk->next)
+                chunk->next->prev = chunk->prev;
+        }
+
+        Page   *_partial[num_classes];     // pages with free blocks, per size class
+        Chunk  *_chunks;                   // chunks with empty pages
+        size_t  _num_pages;
+        size_t  _max_pages;
+    };
+
+    // -----------------------------------------------------------
+    // -----------------------------------------------------------
+    template<class T>
+    class spp_slab_allocator
+    {
+    public:
+        typedef T         value_type;
+        typedef T*        pointer;
+        typedef ptrdiff_t difference_type;
+        typedef const T*  const_pointer;
+        typedef size_t    size_type;
+
+        SlabArena *getArena() const { return _arena.get(); }
+
+        spp_slab_allocator() : _arena(new SlabArena) {}
+
+        explicit spp_slab_allocator(SlabArena *arena) : _arena(arena) {}
+
+        template<class U>
+        spp_slab_allocator(const spp_slab_allocator<U> &o) : _arena(o.getArena()) {}
+
+        template<class U>
+        spp_slab_allocator& operator=(const spp_slab_allocator<U> &o)
+        {
+            _arena.reset(o.getArena());
+            return *this;
+        }
+
+        void swap(spp_slab_allocator &o)
+        {
+            _arena.swap(o._arena);
+        }
+
+        pointer allocate(size_t n, const_pointer /* unused */ = 0)
+        {
+            return static_cast<pointer>(_arena->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(pointer p, size_t n)
+        {
+            _arena->deallocate(p, n * sizeof(T));
+        }
+
+        // unlike the libc and spp allocators, the slab allocator needs the
+        // old size to find the block's size class.
+        pointer reallocate(pointer p, size_type old_size, size_t new_size)
+        {
+            return static_cast<pointer>(_arena->reallocate(p, old_size * sizeof(T), new_size * sizeof(T)));
+        }
+
+        size_type max_size() const
+        {
+            return static_cast<size_type>(-1) / sizeof(value_type);
+        }
+
+        void construct(pointer p, const value_type& val)
+        {
+            new (p) value_type(val);
+        }
+
+        void destroy(pointer p) { p->~value_type(); }
+
+        template<class U>
+        struct rebind
+        {
+            typedef spp_::spp_slab_allocator<U> other;
+        };
+
+        // see SlabArena::trim() and SlabArena::footprint()
+        int    trim(size_t /* pad */ = 0) { return _arena->trim(); }
+        size_t footprint() const         { return _arena->footprint(); }
+        size_t max_footprint() const     { return _arena->max_footprint(); }
+
+    private:
+        spp_sptr<SlabArena> _arena;
+    };
+
+    // allocators are "equal" whenever memory allocated with one can be
+    // deallocated with the other. Declared in the namespace, so that they
+    // are found from the sparsepp containers.
+    template<class T>
+    inline bool operator==(const spp_slab_allocator<T> &a, const spp_slab_allocator<T> &b)
+    {
+        return a.getArena() == b.getArena();
+    }
+
+    template<class T>
+    inline bool operator!=(const spp_slab_allocator<T> &a, const spp_slab_allocator<T> &b)
+    {
+        return !(a == b);
+    }
+}
+
+namespace std
+{
+    template <class T>
+    inline void swap(spp_::spp_slab_allocator<T> &a, spp_::spp_slab_allocator<T> &b)
+    {
+        a.swap(b);
+    }
+}
+
+#endif // spp_slab_h_guard
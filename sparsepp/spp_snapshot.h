@@ -0,0 +1,199 @@
+#if !defined(spp_snapshot_h_guard)
+#define spp_snapshot_h_guard
+
+/* snapshot_sparse_hash_map: a sparse_hash_map updated by a single writer
+   thread, and read by any number of threads without locks.
+
+   The readers see the version last published by the writer, through a
+   reader guard which pins it while it is alive:
+
+       {
+           snapshot_sparse_hash_map<K, V>::reader r(m);
+           auto it = r->find(key);       // r is a const sparse_hash_map
+           ...
+       }
+
+   Pinning a version is a couple of atomic operations on a per-reader
+   slot, and never waits for the writer, so the read latency stays flat
+   while the writer inserts.
+
+   The writer updates its own copy of the map (insert, insert_or_assign,
+   erase, clear), and calls publish() to make its changes visible.  The
+   published copy is never modified: publish() swaps the two copies, and
+   waits for the readers still pinning the old one to release it (the
+   grace period) before bringing it up to date, by replaying on it the
+   keys changed since.  Only then may its groups be reallocated, or its
+   table resized, by the next updates.  So a publish costs the updates
+   since the last one (not a copy of the map), plus the grace period,
+   and the map takes twice the memory of a sparse_hash_map.
+
+   Reader guards should be short lived, as they delay publish().  At most
+   SPP_EPOCH_READERS of them can be alive at once (see spp_epoch.h).
+
+   Requires C++11.
+*/
+
+#include "spp.h"
+#include "spp_epoch.h"
+
+#if defined(SPP_NO_CXX11_RVALUE_REFERENCES) || defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    #error "spp_snapshot.h requires C++11"
+#endif
+
+#include <atomic>
+#include <vector>
+
+namespace spp_
+{
+
+//  ----------------------------------------------------------------------
+//          S N A P S H O T _ S P A R S E _ H A S H _ M A P
+//  ----------------------------------------------------------------------
+template <class Key, class T,
+          class HashFcn  = spp_hash<Key>,
+          class EqualKey = std::equal_to<Key>,
+          class Alloc    = SPP_DEFAULT_ALLOCATOR<std::pair<const Key, T> >,
+          class Probing  = quadratic_probing>
+class snapshot_sparse_hash_map
+{
+public:
+    typedef sparse_hash_map<Key, T, HashFcn, EqualKey, Alloc, Probing> submap_type;
+
+    typedef typename submap_type::key_type         key_type;
+    typedef typename submap_type::mapped_type      mapped_type;
+    typedef typename submap_type::value_type       value_type;
+    typedef typename submap_type::hasher           hasher;
+    typedef typename submap_type::key_equal        key_equal;
+    typedef typename submap_type::allocator_type   allocator_type;
+    typedef typename submap_type::size_type        size_type;
+
+    explicit snapshot_sparse_hash_map(size_type n = 0,
+                                      const hasher& hf = hasher(),
+                                      const key_equal& eql = key_equal()) :
+        _published(&_maps[0]),
+        _full_sync(false)
+    {
+        _maps[0] = submap_type(n, hf, eql);
+        _maps[1] = submap_type(n, hf, eql);
+    }
+
+    // Pins the published version of the map, see above
+    // -------------------------------------------------
+    class reader
+    {
+    public:
+        explicit reader(const snapshot_sparse_hash_map &m) :
+            _slot(m._epochs.pin()),
+            _map(m._published.load(std::memory_order_seq_cst))
+        {
+        }
+
+        ~reader()
+        {
+            reader_epochs::unpin(_slot);
+        }
+
+        const submap_type& operator*() const  { return *_map; }
+        const submap_type* operator->() const { return _map; }
+        const submap_type& get() const        { return *_map; }
+
+    private:
+        reader(const reader &);
+        reader& operator=(const reader &);
+
+        reader_epochs::slot_type *_slot;
+        const submap_type        *_map;
+    };
+
+    // Writer functions: to be called from a single thread (or with a lock).
+    // The changes are seen by the readers after the next publish().
+    // ---------------------------------------------------------------------
+    bool insert(const value_type& obj)
+    {
+        bool res = _writer().insert(obj).second;
+        if (res)
+            _dirty.push_back(obj.first);
+        return res;
+    }
+
+    template <class M>
+    bool insert_or_assign(const key_type& key, M&& obj)
+    {
+        _dirty.push_back(key);
+        return _writer().insert_or_assign(key, std::forward<M>(obj)).second;
+    }
+
+    size_type erase(const key_type& key)
+    {
+        size_type res = _writer().erase(key);
+        if (res)
+            _dirty.push_back(key);
+        return res;
+    }
+
+    void clear()
+    {
+        _writer().clear();
+        _dirty.clear();
+        _full_sync = true;
+    }
+
+    // The map with the changes not published yet, for the writer only
+    const submap_type& writer_view() const { return _maps[_writer_idx()]; }
+
+    // How many changes publish() will have to replay
+    size_type pending() const { return _full_sync ? writer_view().size() : _dirty.size(); }
+
+    // Makes the changes visible to the readers created from now on, and
+    // brings the copy they were reading up to date, once they are done.
+    // -----------------------------------------------------------------
+    void publish()
+    {
+        submap_type &old_map = const_cast<submap_type &>(*_published.load(std::memory_order_relaxed));
+        submap_type &new_map = _writer();
+
+        _published.store(&new_map, std::memory_order_seq_cst);
+
+        // grace period: wait for the readers which may be using old_map
+        _epochs.wait_before(_epochs.advance());
+
+        // replay the changes on old_map, which is now ours
+        if (_full_sync || _dirty.size() > new_map.size())
+            old_map = new_map;
+        else
+        {
+            for (size_t i = 0; i < _dirty.size(); ++i)
+            {
+                typename submap_type::const_iterator it = new_map.find(_dirty[i]);
+                if (it == new_map.end())
+                    old_map.erase(_dirty[i]);
+                else
+                    old_map.insert_or_assign(it->first, it->second);
+            }
+        }
+        _dirty.clear();
+        _full_sync = false;
+    }
+
+private:
+    snapshot_sparse_hash_map(const snapshot_sparse_hash_map &);
+    snapshot_sparse_hash_map& operator=(const snapshot_sparse_hash_map &);
+
+    size_t _writer_idx() const
+    {
+        return _published.load(std::memory_order_relaxed) == &_maps[0] ? 1 : 0;
+    }
+
+    submap_type& _writer() { return _maps[_writer_idx()]; }
+
+    submap_type                       _maps[2];
+    std::atomic<const submap_type *>  _published;
+    reader_epochs                     _epochs;
+
+    std::vector<key_type>             _dirty;       // keys changed since publish()
+    bool                              _full_sync;   // after clear()
+};
+
+}  // spp_ namespace
+
+#endif // spp_snapshot_h_guard
@@ -120,6 +120,100 @@ struct if_<false, A, B>
     typedef B type;
 };
 
+// A template helper used to remove an overload from the candidate set
+// unless cond is true.
+// -------------------------------------------------------------------
+template<bool cond, typename T = void>
+struct enable_if
+{
+    typedef T type;
+};
+
+template<typename T>
+struct enable_if<false, T>
+{
+};
+
+//  ---------------- is_transparent ----------------------------------------
+// A hash or comparison functor is transparent if it declares an
+// is_transparent member type (as std::less<> does), meaning that it accepts
+// arguments of other types than the key type (for example a string_view or a
+// const char * for a std::string key), so that lookups need not construct a
+// temporary key.
+// ------------------------------------------------------------------------
+template <class F>
+struct is_transparent
+{
+private:
+    template <class U> static char _test(typename U::is_transparent *);
+    template <class U> static long _test(...);
+
+public:
+    static const bool value = (sizeof(_test<F>(0)) == sizeof(char));
+};
+
+template <class F> const bool is_transparent<F>::value;
+
+//  ---------------- use_fingerprints --------------------------------------
+// A hash functor which declares a use_fingerprints member type asks the
+// hash table to store a few bits of each key's hash next to the bucket
+// bitmaps, so that probes can skip most non-matching keys without
+// comparing them (see spp::fingerprint_hash).
+// ------------------------------------------------------------------------
+template <class F>
+struct use_fingerprints
+{
+private:
+    template <class U> static char _test(typename U::use_fingerprints *);
+    template <class U> static long _test(...);
+
+public:
+    static const bool value = (sizeof(_test<F>(0)) == sizeof(char));
+};
+
+template <class F> const bool use_fingerprints<F>::value;
+
+//  ---------------- use_versions ------------------------------------------
+// An allocator which declares a use_versions member type asks the hash
+// table to keep version counters in its groups, for lookups running while
+// a writer changes the table (see spp::epoch_allocator).
+// ------------------------------------------------------------------------
+template <class A>
+struct use_versions
+{
+private:
+    template <class U> static char _test(typename U::use_versions *);
+    template <class U> static long _test(...);
+
+public:
+    static const bool value = (sizeof(_test<A>(0)) == sizeof(char));
+};
+
+template <class A> const bool use_versions<A>::value;
+
+//  ---------------- growth_policy -----------------------------------------
+// growth_policy<A, Default>::type is A::growth_policy when the allocator A
+// declares one, and Default otherwise.  It sets how the item arrays of the
+// sparse groups grow (see spp::growth_allocator).
+// ------------------------------------------------------------------------
+template <class T>
+struct void_type
+{
+    typedef void type;
+};
+
+template <class A, class Default, class Enable = void>
+struct growth_policy
+{
+    typedef Default type;
+};
+
+template <class A, class Default>
+struct growth_policy<A, Default, typename void_type<typename A::growth_policy>::type>
+{
+    typedef typename A::growth_policy type;
+};
+
 }  // spp_ namespace
 
 #endif // spp_traits_h_guard
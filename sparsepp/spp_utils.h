@@ -334,6 +334,19 @@ inline void hash_combine(std::size_t& seed, T const& v)
     combiner(seed, hasher(v));
 }
 
+// Wraps a hash functor so that hash tables using it store per-bucket
+// hash fingerprints.  Worth it for keys which are expensive to compare,
+// like long strings, at the cost of one byte per bucket.
+// ---------------------------------------------------------------------
+template <class Hash>
+struct fingerprint_hash : public Hash
+{
+    typedef void use_fingerprints;
+
+    fingerprint_hash() {}
+    fingerprint_hash(const Hash& h) : Hash(h) {}
+};
+
 static inline uint32_t s_spp_popcount_default(uint32_t i) SPP_NOEXCEPT
 {
     i = i - ((i >> 1) & 0x55555555);
@@ -431,7 +444,7 @@ public:
     // extra API to match spp_allocator interface
     pointer reallocate(pointer p, size_t /* old_size */, size_t new_size) 
     {
-        return static_cast<pointer>(realloc(p, new_size * sizeof(T)));
+        return reallocate(p, new_size);
     }
 
     size_type max_size() const
@@ -454,24 +467,128 @@ public:
 
 };
 
-// forward declaration
-// -------------------
+// Wraps the allocator Alloc, so that the tables using it grow the item
+// arrays of their groups according to Growth (spp::tight_growth,
+// spp::rounded_growth<N> or spp::aggressive_growth) instead of the
+// default set by SPP_ALLOC_SZ.  For example, for a large map where memory
+// matters more than insert speed:
+//    growth_allocator<libc_allocator<std::pair<const K, V> >, tight_growth>
+// -------------------------------------------------------------------------
+template <class Alloc, class Growth>
+class growth_allocator : public Alloc
+{
+public:
+    typedef Growth growth_policy;
+
+    growth_allocator() {}
+    growth_allocator(const Alloc &a) : Alloc(a) {}
+
+    template <class A2>
+    growth_allocator(const growth_allocator<A2, Growth> &o) : Alloc(o) {}
+
+    template <class U>
+    struct rebind
+    {
+        typedef growth_allocator<typename Alloc::template rebind<U>::other, Growth> other;
+    };
+};
+
+// The allocator that actually does the work, to see through growth_allocator
+template <class A>
+struct base_allocator
+{
+    typedef A type;
+};
+
+template <class A, class Growth>
+struct base_allocator<growth_allocator<A, Growth> >
+{
+    typedef typename base_allocator<A>::type type;
+};
+
+// forward declarations
+// --------------------
 template<class T>
 class spp_allocator;
 
-}
+template<class T>
+class spp_slab_allocator;
+
+// Whether several threads can allocate from copies of the same allocator
+// at once (see sparse_hashtable::set_resize_threads()). The spp and slab
+// allocators share an unlocked arena between copies.
+template <class A>
+struct is_thread_safe_allocator
+{
+    static const bool value = true;
+};
 
+template <class T>
+struct is_thread_safe_allocator<spp_allocator<T> >
+{
+    static const bool value = false;
+};
+
+template <class T>
+struct is_thread_safe_allocator<spp_slab_allocator<T> >
+{
+    static const bool value = false;
+};
+
+template <class A, class Growth>
+struct is_thread_safe_allocator<growth_allocator<A, Growth> >
+{
+    static const bool value = is_thread_safe_allocator<A>::value;
+};
+
+// Memory reporting and trimming for the allocators which manage their own
+// space (see sparse_hashtable::allocator_footprint()). Others report 0.
+template <class A>
+struct allocator_hooks
+{
+    static size_t footprint(const A &)     { return 0; }
+    static size_t max_footprint(const A &) { return 0; }
+    static int    trim(A &, size_t)        { return 0; }
+};
+
+template <class A>
+struct space_allocator_hooks
+{
+    static size_t footprint(const A &a)     { return a.footprint(); }
+    static size_t max_footprint(const A &a) { return a.max_footprint(); }
+    static int    trim(A &a, size_t pad)    { return a.trim(pad); }
+};
+
+template <class T>
+struct allocator_hooks<spp_allocator<T> > : public space_allocator_hooks<spp_allocator<T> >
+{
+};
+
+template <class T>
+struct allocator_hooks<spp_slab_allocator<T> > : public space_allocator_hooks<spp_slab_allocator<T> >
+{
+};
+
+template <class A, class Growth>
+struct allocator_hooks<growth_allocator<A, Growth> > : public allocator_hooks<A>
+{
+};
+
+// in the namespace, so that they are found (by ADL) from the sparsepp
+// containers, along with those of the other sparsepp allocators
 template<class T>
-inline bool operator==(const spp_::libc_allocator<T> &, const spp_::libc_allocator<T> &)
+inline bool operator==(const libc_allocator<T> &, const libc_allocator<T> &)
 {
     return true;
 }
 
 template<class T>
-inline bool operator!=(const spp_::libc_allocator<T> &, const spp_::libc_allocator<T> &)
+inline bool operator!=(const libc_allocator<T> &, const libc_allocator<T> &)
 {
     return false;
 }
 
+}
+
 #endif // spp_utils_h_guard_
 
@@ -11,6 +11,7 @@
 #include <sparsepp/spp_timer.h>
 #include <sparsepp/spp_memory.h>
 #include <sparsepp/spp_dlalloc.h>
+#include <sparsepp/spp_slab.h>
 
 using namespace std;
 
@@ -188,4 +189,5 @@ int main()
 
     run_test<X, spp::libc_allocator<X>>("libc_allocator");
     run_test<X, spp::spp_allocator<X>>("spp_allocator");
+    run_test<X, spp::spp_slab_allocator<X>>("spp_slab_allocator");
 }
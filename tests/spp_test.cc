@@ -41,7 +41,21 @@
     #pragma warning( disable : 4996 ) // 'fopen': This function or variable may be unsafe
 #endif
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1800)
+    #define SPP_PARALLEL_RESIZE      // to test set_resize_threads()
+#endif
+
 #include <sparsepp/spp.h>
+#include <sparsepp/spp_slab.h>
+#include <sparsepp/spp_dlalloc.h>
+#include <sparsepp/spp_hugepage.h>
+
+#ifdef SPP_PARALLEL_RESIZE     // C++11
+    #include <sparsepp/spp_parallel.h>
+    #include <sparsepp/spp_snapshot.h>
+    #include <sparsepp/spp_optimistic.h>
+    #include <thread>
+#endif
 
 #ifdef _MSC_VER 
     #pragma warning( disable : 4127 ) // conditional expression is constant
@@ -55,10 +69,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <map>
 #include <set>
 #include <sstream>
 #include <typeinfo>   // for class typeinfo (returned by typeid)
 #include <vector>
+#include <iterator>
 #include <stdexcept>   // for length_error
 
 namespace sparsehash_internal = SPP_NAMESPACE::sparsehash_internal;
@@ -1544,9 +1560,299 @@ TEST(HashtableTest, Emplace)
     
     movable_emplace_test(10, 50);
 }
+
+struct CountedValue
+{
+    static int num_constructed;
+
+    CountedValue() : _v(0) { ++num_constructed; }
+    explicit CountedValue(int v) : _v(v) { ++num_constructed; }
+    CountedValue(const CountedValue &o) : _v(o._v) { ++num_constructed; }
+    CountedValue& operator=(const CountedValue &o) { _v = o._v; return *this; }
+
+    int _v;
+};
+
+int CountedValue::num_constructed = 0;
+
+TEST(HashtableTest, TryEmplace) 
+{
+    sparse_hash_map<std::string, CountedValue> m;
+
+    CountedValue::num_constructed = 0;
+    auto res = m.try_emplace("a", 1);
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(res.first->second._v, 1);
+    EXPECT_EQ(CountedValue::num_constructed, 1);
+
+    // already present: mapped value must not be constructed
+    res = m.try_emplace("a", 2);
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(res.first->second._v, 1);
+    EXPECT_EQ(CountedValue::num_constructed, 1);
+
+    // key is only moved from when inserting
+    std::string key("b");
+    m.try_emplace(std::move(key), 3);
+    EXPECT_EQ(m.at("b")._v, 3);
+    key = "a";
+    m.try_emplace(std::move(key), 4);
+    EXPECT_EQ(key, std::string("a"));
+    EXPECT_EQ(m.at("a")._v, 1);
+
+    res = m.insert_or_assign("a", CountedValue(5));
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(m.at("a")._v, 5);
+    res = m.insert_or_assign("c", CountedValue(6));
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(m.at("c")._v, 6);
+    EXPECT_EQ(m.size(), 3u);
+
+    // with a hint
+    sparse_hash_map<std::string, CountedValue>::iterator it = m.try_emplace(m.cend(), "d", 7);
+    EXPECT_EQ(it->second._v, 7);
+    it = m.insert_or_assign(m.cend(), "d", CountedValue(8));
+    EXPECT_EQ(it->second._v, 8);
+
+    // erased buckets are reused without growing the table
+    sparse_hash_map<int, int> m2;
+    for (int i=0; i<10; ++i)
+        m2.try_emplace(i, i);
+    size_t num_buckets = m2.bucket_count();
+    for (int j=0; j<1000; ++j)
+    {
+        m2.erase(j % 10);
+        m2.try_emplace(j % 10, j);
+    }
+    EXPECT_EQ(m2.size(), 10u);
+    EXPECT_EQ(m2.bucket_count(), num_buckets);
+    EXPECT_EQ(m2[9], 999);
+
+    // works with move-only mapped types
+    sparse_hash_map<int, MovableOnlyType> m3;
+    m3.try_emplace(1);
+    m3.insert_or_assign(1, MovableOnlyType());
+    m3.insert_or_assign(2, MovableOnlyType());
+    EXPECT_EQ(m3.size(), 2u);
+}
+
+TEST(HashtableTest, LazyEmplace) 
+{
+    typedef sparse_hash_map<int, CountedValue> Map;
+    Map m;
+    CountedValue::num_constructed = 0;
+    int num_calls = 0;
+
+    Map::iterator it = m.lazy_emplace(1, [&](const Map::constructor& ctor) {
+            ++num_calls;
+            ctor(std::piecewise_construct, std::forward_as_tuple(1), std::forward_as_tuple(10));
+        });
+    EXPECT_EQ(it->second._v, 10);
+    EXPECT_EQ(num_calls, 1);
+    EXPECT_EQ(CountedValue::num_constructed, 1);   // built in place, no copies
+
+    it = m.lazy_emplace(1, [&](const Map::constructor& ctor) {
+            ++num_calls;
+            ctor(1, CountedValue(20));
+        });
+    EXPECT_EQ(it->second._v, 10);
+    EXPECT_EQ(num_calls, 1);                       // not called for existing key
+    EXPECT_EQ(CountedValue::num_constructed, 1);
+
+    // across a resize
+    for (int i = 2; i < 100; ++i)
+        m.lazy_emplace(i, [i](const Map::constructor& ctor) { ctor(i, i * 10); });
+    EXPECT_EQ(m.size(), 99u);
+    for (int i = 1; i < 100; ++i)
+        EXPECT_EQ(m.find(i)->second._v, i * 10);
+
+    sparse_hash_set<std::string> s;
+    s.lazy_emplace(std::string("xxx"), [](const sparse_hash_set<std::string>::constructor& ctor) {
+            ctor(3, 'x');
+        });
+    EXPECT_EQ(s.size(), 1u);
+    EXPECT_EQ(s.count("xxx"), 1u);
+
+    // a throwing callback leaves the group as it was, with relocatable
+    // items (moved with memcpy) and with the others
+    sparse_hash_map<int, int> m2;
+    sparse_hash_map<int, std::string> m3;
+    for (int i = 0; i < 64; i += 2)
+    {
+        m2[i] = i;
+        m3[i] = std::to_string(i);
+    }
+    for (int i = 1; i < 64; i += 2)
+    {
+        try
+        {
+            m2.lazy_emplace(i, [](const sparse_hash_map<int, int>::constructor&) {
+                    throw std::runtime_error("m2");
+                });
+            EXPECT_TRUE(false);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+        try
+        {
+            m3.lazy_emplace(i, [](const sparse_hash_map<int, std::string>::constructor&) {
+                    throw std::runtime_error("m3");
+                });
+            EXPECT_TRUE(false);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+    }
+    EXPECT_EQ(m2.size(), 32u);
+    EXPECT_EQ(m3.size(), 32u);
+    for (int i = 0; i < 64; i += 2)
+    {
+        EXPECT_EQ(m2[i], i);
+        EXPECT_EQ(m3[i], std::to_string(i));
+    }
+}
+
 #endif
 
 
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+struct TransparentKey
+{
+    static int num_constructed;
+
+    TransparentKey(const char *s) : _s(s) { ++num_constructed; }
+    TransparentKey(const TransparentKey &o) : _s(o._s) { ++num_constructed; }
+    TransparentKey& operator=(const TransparentKey &) = default;
+    bool operator==(const TransparentKey &o) const { return _s == o._s; }
+
+    std::string _s;
+};
+
+int TransparentKey::num_constructed = 0;
+
+struct TransparentHash
+{
+    typedef void is_transparent;
+
+    size_t operator()(const TransparentKey &k) const { return (*this)(k._s.c_str()); }
+    size_t operator()(const char *s) const
+    {
+        size_t h = 0;
+        for (; *s; ++s)
+            h = h * 31 + static_cast<size_t>(*s);
+        return h;
+    }
+};
+
+struct TransparentEqual
+{
+    typedef void is_transparent;
+
+    bool operator()(const TransparentKey &a, const TransparentKey &b) const { return a == b; }
+    bool operator()(const char *a, const TransparentKey &b) const { return b._s == a; }
+};
+
+TEST(HashtableTest, HeterogeneousLookup) 
+{
+    sparse_hash_map<TransparentKey, int, TransparentHash, TransparentEqual> m;
+    m.insert(std::make_pair(TransparentKey("one"), 1));
+    m.insert(std::make_pair(TransparentKey("two"), 2));
+    m.insert(std::make_pair(TransparentKey("three"), 3));
+
+    const sparse_hash_map<TransparentKey, int, TransparentHash, TransparentEqual> &cm = m;
+
+    TransparentKey::num_constructed = 0;
+    EXPECT_TRUE(m.find("two") != m.end());
+    EXPECT_EQ(m.find("two")->second, 2);
+    EXPECT_TRUE(cm.find("three") != cm.end());
+    EXPECT_TRUE(m.find("four") == m.end());
+    EXPECT_EQ(m.count("one"), 1u);
+    EXPECT_EQ(m.count("four"), 0u);
+    EXPECT_TRUE(m.contains("one"));
+    EXPECT_FALSE(cm.contains("four"));
+    EXPECT_EQ(m.at("three"), 3);
+    EXPECT_EQ(cm.at("three"), 3);
+    EXPECT_TRUE(m.equal_range("one").first != m.end());
+    EXPECT_TRUE(cm.equal_range("four").first == cm.end());
+    EXPECT_EQ(m.erase("four"), 0u);
+    EXPECT_EQ(TransparentKey::num_constructed, 0);   // no temporary keys
+    EXPECT_EQ(m.erase("one"), 1u);                   // may relocate other keys
+    EXPECT_EQ(m.erase("one"), 0u);
+    EXPECT_EQ(m.size(), 2u);
+
+    // erasing through an iterator still picks the iterator overload
+    m.erase(m.find("two"));
+    EXPECT_EQ(m.size(), 1u);
+
+    sparse_hash_set<TransparentKey, TransparentHash, TransparentEqual> s;
+    s.insert(TransparentKey("one"));
+    TransparentKey::num_constructed = 0;
+    EXPECT_TRUE(s.find("one") != s.end());
+    EXPECT_TRUE(s.contains("one"));
+    EXPECT_EQ(s.count("two"), 0u);
+    EXPECT_EQ(s.erase("two"), 0u);
+    EXPECT_EQ(TransparentKey::num_constructed, 0);
+    EXPECT_EQ(s.erase("one"), 1u);
+    EXPECT_TRUE(s.empty());
+
+    // without is_transparent, the key is converted as before
+    sparse_hash_map<std::string, int> m2;
+    m2["abc"] = 1;
+    EXPECT_TRUE(m2.find("abc") != m2.end());
+    EXPECT_EQ(m2.count("abc"), 1u);
+    EXPECT_EQ(m2.erase("abc"), 1u);
+}
+
+TEST(HashtableTest, PrecomputedHash) 
+{
+    sparse_hash_map<std::string, int> m1, m2;
+    std::string keys[] = { "one", "two", "three", "four" };
+
+    for (int i = 0; i < 4; ++i)
+    {
+        size_t h = m1.hash(keys[i]);
+        EXPECT_EQ(h, m2.hash(keys[i]));         // same hasher, same value
+        EXPECT_TRUE(m1.insert_with_hash(h, std::make_pair(keys[i], i)).second);
+        EXPECT_TRUE(m2.emplace_with_hash(h, keys[i], i * 10).second);
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        size_t h = m1.hash(keys[i]);
+        EXPECT_EQ(m1.find(keys[i], h)->second, i);
+        EXPECT_EQ(m2.find(keys[i], h)->second, i * 10);
+        EXPECT_TRUE(m1.contains(keys[i], h));
+        EXPECT_EQ(m2.count(keys[i], h), 1u);
+        EXPECT_FALSE(m1.try_emplace_with_hash(h, keys[i], -1).second);
+    }
+    EXPECT_EQ(m1.find("three")->second, 2);
+
+    std::string five("five");
+    size_t h5 = m1.hash(five);
+    EXPECT_TRUE(m1.find(five, h5) == m1.end());
+    EXPECT_EQ(m1.count(five, h5), 0u);
+    EXPECT_TRUE(m1.try_emplace_with_hash(h5, five, 5).second);
+    EXPECT_EQ(m1["five"], 5);
+    EXPECT_EQ(m1.erase(five, h5), 1u);
+    EXPECT_EQ(m1.erase(five, h5), 0u);
+    EXPECT_EQ(m1.size(), 4u);
+
+    sparse_hash_set<TransparentKey, TransparentHash, TransparentEqual> s;
+    size_t h = s.hash("one");
+    EXPECT_TRUE(s.insert_with_hash(h, TransparentKey("one")).second);
+    EXPECT_FALSE(s.emplace_with_hash(h, "one").second);
+    TransparentKey::num_constructed = 0;
+    EXPECT_TRUE(s.contains("one", h));
+    EXPECT_TRUE(s.find("one", h) != s.end());
+    EXPECT_EQ(s.count("one", h), 1u);
+    EXPECT_EQ(s.erase("one", h), 1u);
+    EXPECT_EQ(TransparentKey::num_constructed, 0);
+    EXPECT_TRUE(s.empty());
+}
+#endif
+
 #if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
 TEST(HashtableTest, IncompleteTypes) 
 {
@@ -1621,6 +1927,1293 @@ TEST(HashtableTest, ModifyViaIterator)
     }
 }
 
+TEST(HashtableTest, FindMany) 
+{
+    sparse_hash_map<int, int> ht;
+    for (int i = 0; i < 1000; i += 2)
+        ht[i] = -i;
+
+    // more keys than one batch, half of them missing
+    int keys[100];
+    for (int i = 0; i < 100; ++i)
+        keys[i] = i * 7;
+
+    std::vector<sparse_hash_map<int, int>::iterator> res;
+    ht.find_many(keys, 100, std::back_inserter(res));
+    EXPECT_EQ(res.size(), 100u);
+    for (int i = 0; i < 100; ++i)
+    {
+        if (keys[i] % 2)
+            EXPECT_TRUE(res[i] == ht.end());
+        else
+            EXPECT_EQ(res[i]->second, -keys[i]);
+    }
+
+    const sparse_hash_map<int, int> &cht = ht;
+    sparse_hash_map<int, int>::const_iterator cres[3];
+    EXPECT_TRUE(cht.find_many(keys, 3, cres) == cres + 3);
+    EXPECT_EQ(cres[0]->second, 0);
+    EXPECT_TRUE(cres[1] == cht.end());
+    EXPECT_EQ(cht.find_many(keys, 0, cres), cres);
+
+    sparse_hash_set<int> s;
+    s.insert(7);
+    sparse_hash_set<int>::iterator sres[2];
+    s.find_many(keys, 2, sres);
+    EXPECT_TRUE(sres[0] == s.end());
+    EXPECT_EQ(*sres[1], 7);
+}
+
+TEST(HashtableTest, Prefetch) 
+{
+    // prefetch is only a hint: it must work on empty and const tables,
+    // and not hash more than once or change anything
+    sparse_hash_map<int, int, Hasher, Hasher> ht;
+    ht.prefetch(1);
+    ht[1] = 2;
+    const sparse_hash_map<int, int, Hasher, Hasher> &cht = ht;
+    int num_hashes = ht.hash_funct().num_hashes();
+    int num_compares = ht.key_eq().num_compares();
+    cht.prefetch(1);
+    cht.prefetch(3, ht.hash(3));
+    EXPECT_EQ(ht.hash_funct().num_hashes(), num_hashes + 2);
+    EXPECT_EQ(ht.key_eq().num_compares(), num_compares);
+    EXPECT_EQ(ht.size(), 1u);
+    EXPECT_EQ(ht[1], 2);
+
+    sparse_hash_set<int> s;
+    s.prefetch(5);
+    s.insert(5);
+    s.prefetch(5, s.hash(5));
+    EXPECT_EQ(s.count(5), 1u);
+}
+
+TEST(HashtableTest, Fingerprints) 
+{
+    // different hashes, from the low bits to the top one, should not
+    // share their fingerprints much
+    {
+        spp::group_fingerprints<true> g;
+        const size_t top = static_cast<size_t>(1) << (sizeof(size_t) * 8 - 1);
+        g.set_fingerprint(0, 12345);
+        EXPECT_TRUE(g.match_fingerprint(0, 12345));
+        EXPECT_FALSE(g.match_fingerprint(0, 12345 ^ top));
+
+        int num_matches = 0;
+        for (size_t h = 0; h < 256; ++h)
+        {
+            g.set_fingerprint(1, h);
+            num_matches += g.match_fingerprint(1, h + 1);
+            g.set_fingerprint(2, h << 24);
+            num_matches += g.match_fingerprint(2, (h + 1) << 24);
+        }
+        EXPECT_LT(num_matches, 16);
+    }
+
+    typedef sparse_hash_map<string, int, Hasher, Hasher> Plain;
+    typedef sparse_hash_map<string, int, spp::fingerprint_hash<Hasher>, Hasher> Fp;
+    Plain plain;
+    Fp fp;
+    char buf[32];
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        sprintf(buf, "key_%d", i);
+        plain[buf] = i;
+        fp[buf] = i;
+    }
+    for (int i = 0; i < 1000; i += 3)
+    {
+        sprintf(buf, "key_%d", i);
+        fp.erase(buf);
+    }
+
+    // looking up missing keys should compare far fewer keys
+    int plain_compares = plain.key_eq().num_compares();
+    int fp_compares = fp.key_eq().num_compares();
+    for (int i = 1000; i < 2000; ++i)
+    {
+        sprintf(buf, "key_%d", i);
+        EXPECT_TRUE(plain.find(buf) == plain.end());
+        EXPECT_TRUE(fp.find(buf) == fp.end());
+    }
+    plain_compares = plain.key_eq().num_compares() - plain_compares;
+    fp_compares = fp.key_eq().num_compares() - fp_compares;
+    EXPECT_LT(fp_compares * 4, plain_compares);
+
+    // and still find the present ones, also after a copy and a rehash
+    Fp fp2(fp);
+    fp.resize(5000);
+    for (int i = 0; i < 1000; ++i)
+    {
+        sprintf(buf, "key_%d", i);
+        EXPECT_EQ(fp.count(buf), i % 3 ? 1u : 0u);
+        EXPECT_EQ(fp2.count(buf), i % 3 ? 1u : 0u);
+    }
+
+    // fingerprints are recomputed when reading a serialized table
+    typedef sparse_hash_map<int, int, spp::fingerprint_hash<spp::spp_hash<int> > > IntFp;
+    IntFp ht_out, ht_in;
+    for (int i = 0; i < 100; ++i)
+        ht_out[i] = -i;
+    std::stringstream string_buffer;
+    EXPECT_TRUE(ht_out.serialize(IntFp::NopointerSerializer(), &string_buffer));
+    EXPECT_TRUE(ht_in.unserialize(IntFp::NopointerSerializer(), &string_buffer));
+    for (int i = 0; i < 100; ++i)
+        EXPECT_EQ(ht_in[i], -i);
+    EXPECT_EQ(ht_in.size(), 100u);
+}
+
+template <class Probing>
+static void TestProbing()
+{
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                            SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                            Probing> Map;
+    Map ht;
+    for (int i = 0; i < 3000; ++i)
+        ht[i * 64] = i;              // same position in many groups
+    for (int i = 0; i < 3000; i += 2)
+        ht.erase(i * 64);
+    for (int i = 0; i < 3000; ++i)
+    {
+        typename Map::iterator it = ht.find(i * 64);
+        EXPECT_EQ(it == ht.end(), i % 2 == 0);
+        if (it != ht.end())
+            EXPECT_EQ(it->second, i);
+        EXPECT_TRUE(ht.find(i * 64 + 1) == ht.end());
+    }
+    EXPECT_EQ(ht.size(), 1500u);
+}
+
+TEST(HashtableTest, ProbingPolicies) 
+{
+    TestProbing<spp::linear_probing>();
+    TestProbing<spp::quadratic_probing>();
+    TestProbing<spp::group_local_probing>();
+    TestProbing<spp::robin_hood_probing>();
+}
+
+struct CountingHash
+{
+    size_t operator()(int i) const { ++num_calls; return spp::spp_hash<int>()(i); }
+    static int num_calls;
+};
+
+int CountingHash::num_calls = 0;
+
+// all the keys collide on 4 home buckets, so that the runs are longer
+// than the distances stored in a byte
+struct CollidingHash
+{
+    size_t operator()(int i) const { return (size_t)(i % 4); }
+};
+
+// the home bucket of i is i / 100
+struct HundredsHash
+{
+    size_t operator()(int i) const { return (size_t)(i / 100); }
+};
+
+// throws when copied from a negative value
+struct ThrowingCopy
+{
+    ThrowingCopy(int v = 0) : v(v) {}
+    ThrowingCopy(const ThrowingCopy &o) : v(o.v)
+    {
+        if (v < 0)
+            throw std::runtime_error("ThrowingCopy");
+    }
+    int v;
+};
+
+TEST(HashtableTest, RobinHood) 
+{
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                            SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                            spp::robin_hood_probing> Map;
+    Map ht;
+    std::map<int, int> ref;
+
+    // heavy churn on a small key range, so runs wrap around the table
+    srand(7);
+    for (int i = 0; i < 20000; ++i)
+    {
+        int k = rand() % 200;
+        if (rand() % 2)
+        {
+            ht[k] = i;
+            ref[k] = i;
+        }
+        else
+            EXPECT_EQ(ht.erase(k), ref.erase(k));
+    }
+    EXPECT_EQ(ht.size(), ref.size());
+    for (int k = 0; k < 200; ++k)
+    {
+        Map::iterator it = ht.find(k);
+        EXPECT_EQ(it != ht.end(), ref.count(k) == 1);
+        if (it != ht.end())
+            EXPECT_EQ(it->second, ref[k]);
+    }
+
+    // erase through iterators, which returns the next item even when
+    // it was shifted back into the erased bucket
+    for (Map::iterator it = ht.begin(); it != ht.end(); )
+    {
+        if (it->first % 2)
+            it = ht.erase(it);
+        else
+            ++it;
+    }
+    for (int k = 0; k < 200; ++k)
+        EXPECT_EQ(ht.count(k), (k % 2 == 0 && ref.count(k)) ? 1u : 0u);
+
+    sparse_hash_set<int, spp::spp_hash<int>, std::equal_to<int>,
+                    SPP_DEFAULT_ALLOCATOR<int>, spp::robin_hood_probing> s;
+    for (int i = 0; i < 1000; ++i)
+        s.insert(i);
+    s.erase(s.begin(), s.end());
+    EXPECT_TRUE(s.empty());
+
+    // the distances to the home buckets are stored, so lookups and erases
+    // only hash the key they are given
+    sparse_hash_map<int, int, CountingHash, std::equal_to<int>,
+                    SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                    spp::robin_hood_probing> ch;
+    for (int i = 0; i < 1000; ++i)
+        ch[i] = i;
+    CountingHash::num_calls = 0;
+    for (int i = 0; i < 2000; ++i)
+        EXPECT_EQ(ch.count(i), i < 1000 ? 1u : 0u);
+    for (int i = 0; i < 1000; i += 2)
+        EXPECT_EQ(ch.erase(i), 1u);
+    EXPECT_EQ(CountingHash::num_calls, 2500);
+
+    sparse_hash_map<int, int, CollidingHash, std::equal_to<int>,
+                    SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                    spp::robin_hood_probing> far;
+    std::map<int, int> far_ref;
+    for (int i = 0; i < 2000; ++i)
+    {
+        int k = rand() % 600;
+        if (rand() % 3)
+        {
+            far[k] = i;
+            far_ref[k] = i;
+        }
+        else
+            EXPECT_EQ(far.erase(k), far_ref.erase(k));
+    }
+    EXPECT_EQ(far.size(), far_ref.size());
+    for (int k = 0; k < 600; ++k)
+        EXPECT_EQ(far.count(k), far_ref.count(k));
+
+    // an insert which throws while building the item shifts back the run
+    // it made room in (103 goes before 200, 201 and 202)
+    typedef sparse_hash_map<int, ThrowingCopy, HundredsHash, std::equal_to<int>,
+                            SPP_DEFAULT_ALLOCATOR<std::pair<const int, ThrowingCopy> >,
+                            spp::robin_hood_probing> ThrowMap;
+    ThrowMap tm;
+    const int runs[] = { 100, 101, 102, 200, 201, 202 };
+    for (int i = 0; i < 6; ++i)
+        tm[runs[i]] = ThrowingCopy(i);
+    try
+    {
+        ThrowMap::value_type v(103, ThrowingCopy(6));
+        v.second.v = -1;
+        tm.insert(v);
+        EXPECT_TRUE(false);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+#if !defined(SPP_NO_CXX11_VARIADIC_TEMPLATES)
+    try
+    {
+        tm.lazy_emplace(103, [](const ThrowMap::constructor&) {
+                throw std::runtime_error("lazy_emplace");
+            });
+        EXPECT_TRUE(false);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+#endif
+    EXPECT_EQ(tm.size(), 6u);
+    for (int i = 0; i < 6; ++i)
+    {
+        ThrowMap::iterator it = tm.find(runs[i]);
+        EXPECT_TRUE(it != tm.end());
+        if (it != tm.end())
+            EXPECT_EQ(it->second.v, i);
+    }
+    EXPECT_EQ(tm.count(103), 0u);
+}
+
+TEST(HashtableTest, LayoutPreservingCopy)
+{
+    typedef sparse_hash_map<int, int, CountingHash> Map;
+    Map ht;
+    for (int i = 0; i < 1000; ++i)
+        ht[i] = i;
+    for (int i = 0; i < 1000; i += 3)
+        ht.erase(i);
+
+    // same bucket count: the groups are cloned, erased buckets included
+    CountingHash::num_calls = 0;
+    Map copy(ht);
+    EXPECT_EQ(CountingHash::num_calls, 0);
+    EXPECT_EQ(copy.bucket_count(), ht.bucket_count());
+    EXPECT_TRUE(copy == ht);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(copy.count(i), (i % 3) ? 1u : 0u);
+
+    Map assigned;
+    assigned[5000] = 1;
+    assigned = ht;
+    EXPECT_TRUE(assigned == ht);
+    EXPECT_EQ(assigned.count(5000), 0u);
+
+    // the copies can reuse the erased buckets
+    for (int i = 0; i < 1000; i += 3)
+        copy[i] = -i;
+    EXPECT_EQ(copy.size(), 1000u);
+    EXPECT_EQ(copy[999], -999);
+
+    // when fewer buckets are needed, the copy still rehashes
+    for (int i = 0; i < 1000; ++i)
+        if (i % 10)
+            ht.erase(i);
+    CountingHash::num_calls = 0;
+    Map smaller(ht);
+    EXPECT_GT(CountingHash::num_calls, 0);
+    EXPECT_LT(smaller.bucket_count(), ht.bucket_count());
+    EXPECT_TRUE(smaller == ht);
+}
+
+TEST(HashtableTest, PurgeDeleted)
+{
+    sparse_hash_map<int, int, CountingHash> ht;
+    for (int i = 0; i < 1000; ++i)
+        ht[i] = i;
+    for (int i = 0; i < 1000; i += 2)
+        ht.erase(i);
+    const size_t num_buckets = ht.bucket_count();
+    CountingHash::num_calls = 0;
+    ht.purge_deleted();
+    EXPECT_EQ(CountingHash::num_calls, 500);   // rehashed the items left
+    EXPECT_EQ(ht.bucket_count(), num_buckets);
+    EXPECT_EQ(ht.size(), 500u);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(ht.count(i), (size_t)(i % 2));
+
+    CountingHash::num_calls = 0;
+    ht.purge_deleted();          // nothing to purge
+    EXPECT_EQ(CountingHash::num_calls, 0);
+
+    // group by group in incremental mode
+    for (int i = 1; i < 1000; i += 4)
+        ht.erase(i);
+    ht.set_incremental_resize(1);
+    ht.purge_deleted();
+    EXPECT_TRUE(ht.resize_in_progress());
+    EXPECT_EQ(ht.size(), 250u);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(ht.count(i), (size_t)(i % 4 == 3));
+    ht.set_incremental_resize(0);
+    EXPECT_FALSE(ht.resize_in_progress());
+    EXPECT_EQ(ht.bucket_count(), num_buckets);
+
+    // automatically, on erase then insert churn, which otherwise grows
+    // the table because of the erased buckets
+    sparse_hash_set<int> s, no_purge;
+    s.set_purge_factor(0.1f);
+    EXPECT_EQ(s.get_purge_factor(), 0.1f);
+    s.min_load_factor(0);
+    no_purge.min_load_factor(0);
+    for (int i = 0; i < 10000; ++i)
+    {
+        s.insert(i);
+        no_purge.insert(i);
+        if (i >= 100)
+        {
+            s.erase(i - 100);
+            no_purge.erase(i - 100);
+        }
+    }
+    EXPECT_EQ(s.size(), 100u);
+    EXPECT_LT(s.bucket_count(), no_purge.bucket_count());
+    for (int i = 9900; i < 10000; ++i)
+        EXPECT_EQ(s.count(i), 1u);
+    EXPECT_EQ(s.get_purge_factor(), 0.1f);          // kept by the resizes
+    sparse_hash_set<int> s_copy(s);
+    EXPECT_EQ(s_copy.get_purge_factor(), 0.1f);
+    EXPECT_EQ(no_purge.get_purge_factor(), 0.0f);
+}
+
+TEST(HashtableTest, GrowthPolicy)
+{
+    EXPECT_EQ(spp::tight_growth::sizing(5), 5u);
+    EXPECT_EQ(spp::rounded_growth<4>::sizing(5), 8u);
+    EXPECT_EQ(spp::rounded_growth<4>::sizing(8), 8u);
+    EXPECT_GE(spp::aggressive_growth::sizing(1), 4u);
+
+    typedef std::pair<const int, int> V;
+    typedef spp::growth_allocator<Alloc<V>, spp::tight_growth> TightAlloc;
+    typedef spp::growth_allocator<Alloc<V>, spp::aggressive_growth> AggressiveAlloc;
+
+    // a tight array is reallocated on every insert into its group
+    int tight_allocs = 0, aggressive_allocs = 0;
+    sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, TightAlloc>
+        tight(1000, spp::spp_hash<int>(), std::equal_to<int>(), TightAlloc(Alloc<V>(0, &tight_allocs)));
+    sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, AggressiveAlloc>
+        aggressive(1000, spp::spp_hash<int>(), std::equal_to<int>(),
+                   AggressiveAlloc(Alloc<V>(0, &aggressive_allocs)));
+    for (int i = 0; i < 1000; ++i)
+    {
+        tight[i] = i;
+        aggressive[i] = i;
+    }
+    EXPECT_GT(tight_allocs, aggressive_allocs);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(tight[i], aggressive[i]);
+
+    // copies keep the policy
+    sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, TightAlloc> copy(tight);
+    EXPECT_TRUE(copy == tight);
+}
+
+TEST(HashtableTest, SlabAllocator)
+{
+    EXPECT_EQ(spp::SlabArena::size_class(1), 1u);
+    EXPECT_EQ(spp::SlabArena::size_class(SPP_SLAB_GRANULE), 1u);
+    EXPECT_EQ(spp::SlabArena::size_class(SPP_SLAB_GRANULE + 1), 2u);
+    EXPECT_EQ(spp::SlabArena::size_class(SPP_SLAB_MAX_BYTES + 1), 0u);
+
+    typedef spp::spp_slab_allocator<std::pair<const int, int> > SlabAlloc;
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, SlabAlloc> Map;
+
+    SlabAlloc alloc(new spp::SlabArena);
+    spp::SlabArena *arena = alloc.getArena();
+
+    // growing within the size class keeps the block, freed blocks are reused
+    void *p = arena->allocate(4);
+    EXPECT_TRUE(arena->reallocate(p, 4, 8) == p);
+    void *q = arena->reallocate(p, 8, SPP_SLAB_GRANULE + 8);
+    EXPECT_TRUE(q != p);
+    EXPECT_TRUE(arena->allocate(8) == p);
+    arena->deallocate(p, 8);
+    arena->deallocate(q, SPP_SLAB_GRANULE + 8);
+
+    {
+        // a small map with its own arena takes a page per size class used
+        // (its group array and its item array)
+        Map m0;
+        m0[1] = 1;
+        EXPECT_LE(m0.allocator_footprint(), (size_t)(2 * SPP_SLAB_PAGE_SIZE));
+    }
+
+    {
+        // two maps sharing the arena
+        Map m1(0, Map::hasher(), Map::key_equal(), alloc);
+        Map m2(0, Map::hasher(), Map::key_equal(), alloc);
+        for (int i = 0; i < 20000; ++i)
+        {
+            m1[i] = i;
+            m2[i] = -i;
+        }
+        for (int i = 0; i < 20000; i += 2)
+            m1.erase(i);
+        const size_t footprint = arena->footprint();
+        for (int i = 0; i < 20000; i += 2)
+            m2[i + 20000] = i;      // reuses the blocks freed by m1
+        EXPECT_LE(arena->footprint(), footprint * 11 / 10);
+
+        EXPECT_EQ(m1.size(), 10000u);
+        EXPECT_EQ(m2.size(), 30000u);
+        for (int i = 0; i < 20000; ++i)
+        {
+            EXPECT_EQ(m1.count(i), (size_t)(i % 2));
+            EXPECT_EQ(m2[i], -i);
+        }
+        m2.shrink_to_fit();
+        EXPECT_EQ(m2[19999], -19999);
+    }
+    EXPECT_EQ(arena->count(), 1u);
+
+    // items which are not relocatable, in a map with its own arena
+    typedef spp::spp_slab_allocator<std::pair<const int, std::string> > StrAlloc;
+    sparse_hash_map<int, std::string, spp::spp_hash<int>, std::equal_to<int>, StrAlloc> m3;
+    for (int i = 0; i < 1000; ++i)
+        m3[i] = std::string(i % 50, 'x');
+    for (int i = 0; i < 1000; i += 3)
+        m3.erase(i);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(m3.count(i) ? m3[i] : std::string(), (i % 3) ? std::string(i % 50, 'x') : std::string());
+
+#ifdef SPP_SLAB_THREAD_ARENA
+    // and with the arena of this thread
+    Map m4(0, Map::hasher(), Map::key_equal(), SlabAlloc(spp::SlabArena::this_thread()));
+    Map m5(0, Map::hasher(), Map::key_equal(), SlabAlloc(spp::SlabArena::this_thread()));
+    for (int i = 0; i < 1000; ++i)
+        m4[i] = m5[i] = i;
+    EXPECT_TRUE(m4 == m5);
+    EXPECT_TRUE(m4.get_allocator() == m5.get_allocator());
+    EXPECT_TRUE(m4.get_allocator() != alloc);
+#endif
+}
+
+TEST(HashtableTest, SppAllocator)
+{
+    typedef spp::spp_allocator<std::pair<const int, int> > SppAlloc;
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, SppAlloc> Map;
+
+    SppAlloc alloc;
+    {
+        // two maps sharing one space
+        Map m1(0, Map::hasher(), Map::key_equal(), alloc);
+        Map m2(0, Map::hasher(), Map::key_equal(), alloc);
+        for (int i = 0; i < 100000; ++i)
+        {
+            m1[i] = i;
+            m2[i] = -i;
+        }
+        for (int i = 0; i < 100000; i += 2)
+            m1.erase(i);
+        EXPECT_TRUE(m1.get_allocator() == m2.get_allocator());
+        EXPECT_EQ(m1.allocator_footprint(), m2.allocator_footprint());
+        EXPECT_GT(m1.allocator_footprint(), 100000 * sizeof(std::pair<const int, int>));
+        EXPECT_GE(m1.allocator_max_footprint(), m1.allocator_footprint());
+
+        EXPECT_EQ(m1.size(), 50000u);
+        for (int i = 0; i < 100000; ++i)
+        {
+            EXPECT_EQ(m1.count(i), (size_t)(i % 2));
+            EXPECT_EQ(m2[i], -i);
+        }
+
+        // copies get their own space
+        Map m3(m1);
+        EXPECT_TRUE(m3 == m1);
+        EXPECT_TRUE(m3.get_allocator() != m1.get_allocator());
+
+        m1.trim_allocator();
+        m1[1] = 1;
+        EXPECT_EQ(m1[1], 1);
+    }
+
+    // the space outlives the maps. How much trim() can give back to the
+    // system depends on where the segments were mapped.
+    const size_t footprint = alloc.footprint();
+    EXPECT_LE(alloc.trim(), 1);
+    EXPECT_LE(alloc.footprint(), footprint);
+    EXPECT_LE(alloc.footprint(), alloc.max_footprint());
+
+    // the slab allocator reports its pages, other allocators nothing
+    sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                    spp::spp_slab_allocator<std::pair<const int, int> > > slab;
+    sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                    spp::libc_allocator<std::pair<const int, int> > > libc;
+    for (int i = 0; i < 1000; ++i)
+        slab[i] = libc[i] = i;
+    EXPECT_GT(slab.allocator_footprint(), 0u);
+    EXPECT_EQ(libc.allocator_footprint(), 0u);
+    EXPECT_EQ(libc.trim_allocator(), 0);
+    slab.clear();
+    slab.resize(0);
+    slab.trim_allocator();
+    EXPECT_LT(slab.allocator_footprint(), slab.allocator_max_footprint());
+}
+
+TEST(HashtableTest, HugePages)
+{
+    char *p = static_cast<char *>(spp::huge_page_alloc(100));
+    if (p)
+    {
+        EXPECT_EQ((uintptr_t)p % SPP_HUGE_PAGE_SIZE, 0u);
+        p[0] = p[SPP_HUGE_PAGE_SIZE - 1] = 1;
+        spp::huge_page_free(p, 100);
+    }
+
+    // with a low threshold, so that the group array is mmapped early
+    typedef spp::huge_page_allocator<spp::libc_allocator<std::pair<const int, int> >, 4096> HugeAlloc;
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>, HugeAlloc> Map;
+
+    Map m;
+    for (int i = 0; i < 100000; ++i)
+        m[i] = i;
+    for (int i = 0; i < 100000; i += 2)
+        m.erase(i);
+    Map copy(m);
+    m.resize(0);
+    EXPECT_EQ(m.size(), 50000u);
+    for (int i = 0; i < 100000; ++i)
+        EXPECT_EQ(m.count(i), (size_t)(i % 2));
+    EXPECT_TRUE(copy == m);
+    m.clear();
+    m.swap(copy);
+    EXPECT_EQ(m[99999], 99999);
+}
+
+// Keeps track of the bytes allocated, through allocate() and deallocate()
+// only, as it is not a libc_allocator
+static size_t s_allocated_bytes = 0;
+
+template <class T>
+struct ByteCountingAlloc : public spp::libc_allocator<T>
+{
+    ByteCountingAlloc() {}
+    template <class U> ByteCountingAlloc(const ByteCountingAlloc<U> &) {}
+
+    T *allocate(size_t n, const T * = 0)
+    {
+        s_allocated_bytes += n * sizeof(T);
+        return spp::libc_allocator<T>::allocate(n);
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        s_allocated_bytes -= n * sizeof(T);
+        spp::libc_allocator<T>::deallocate(p, n);
+    }
+
+    template <class U>
+    struct rebind
+    {
+        typedef ByteCountingAlloc<U> other;
+    };
+};
+
+TEST(HashtableTest, ShrinkToFit)
+{
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                            ByteCountingAlloc<std::pair<const int, int> > > Map;
+    {
+        Map ht;
+        for (int i = 0; i < 10000; ++i)
+            ht[i] = i;
+        for (int i = 0; i < 10000; i += 10)
+            ht.erase(i);
+        const size_t num_buckets = ht.bucket_count();
+        const size_t before = s_allocated_bytes;
+        ht.shrink_to_fit();
+        EXPECT_LT(s_allocated_bytes, before);
+        EXPECT_EQ(ht.bucket_count(), num_buckets);
+        EXPECT_EQ(ht.size(), 9000u);
+        for (int i = 0; i < 10000; ++i)
+            EXPECT_EQ(ht.count(i), (i % 10) ? 1u : 0u);
+
+        // the tight arrays grow and shrink again as usual
+        for (int i = 0; i < 10000; i += 10)
+            ht[i] = i;
+        for (int i = 1; i < 10000; i += 10)
+            ht.erase(i);
+        EXPECT_EQ(ht.size(), 9000u);
+        for (int i = 0; i < 10000; ++i)
+            EXPECT_EQ(ht.count(i), (i % 10 != 1) ? 1u : 0u);
+
+        // and resize(0) shrinks the table first
+        for (int i = 0; i < 10000; ++i)
+            if (i % 100)
+                ht.erase(i);
+        ht.shrink_to_fit();
+        EXPECT_LT(ht.bucket_count(), num_buckets);
+        EXPECT_EQ(ht.size(), 100u);
+        EXPECT_EQ(ht[500], 500);
+    }
+    EXPECT_EQ(s_allocated_bytes, 0u);
+
+    // with the realloc() path of libc_allocator
+    sparse_hash_set<int> s;
+    for (int i = 0; i < 1000; ++i)
+        s.insert(i);
+    s.shrink_to_fit();
+    for (int i = 1000; i < 2000; ++i)
+        s.insert(i);
+    for (int i = 0; i < 2000; i += 2)
+        s.erase(i);
+    EXPECT_EQ(s.size(), 1000u);
+    for (int i = 0; i < 2000; ++i)
+        EXPECT_EQ(s.count(i), (size_t)(i % 2));
+}
+
+TEST(HashtableTest, MemoryUsage)
+{
+    typedef sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                            ByteCountingAlloc<std::pair<const int, int> > > Map;
+    {
+        Map ht;
+        EXPECT_EQ(ht.memory_usage().total(), s_allocated_bytes);
+
+        for (int i = 0; i < 10000; ++i)
+            ht[i] = i;
+        for (int i = 0; i < 10000; i += 10)
+            ht.erase(i);
+        spp::memory_usage_info mu = ht.memory_usage();
+        EXPECT_EQ(mu.total(), s_allocated_bytes);     // everything we allocated
+        EXPECT_GE(mu.item_bytes, ht.size() * sizeof(Map::value_type) + mu.slack_bytes);
+        EXPECT_EQ(mu.num_erased, 1000u);
+
+        ht.shrink_to_fit();
+        mu = ht.memory_usage();
+        EXPECT_EQ(mu.total(), s_allocated_bytes);
+        EXPECT_EQ(mu.slack_bytes, 0u);
+        EXPECT_EQ(mu.num_erased, 0u);
+        EXPECT_EQ(mu.item_bytes, ht.size() * sizeof(Map::value_type));
+
+        // the old table is still there during an incremental resize
+        ht.set_incremental_resize(1);
+        const size_t num_buckets = ht.bucket_count();
+        for (int i = 10000; ht.bucket_count() == num_buckets; ++i)
+            ht[i] = i;
+        EXPECT_TRUE(ht.resize_in_progress());
+        EXPECT_EQ(ht.memory_usage().total(), s_allocated_bytes);
+    }
+    EXPECT_EQ(s_allocated_bytes, 0u);
+}
+
+typedef sparse_hash_map<int, int> BudgetMap;
+static int s_budget_calls = 0;
+
+// evicts a quarter of the items, or refuses when the map is empty
+static spp::memory_budget_action EvictSome(void *ctx, size_t used, size_t needed)
+{
+    BudgetMap *m = static_cast<BudgetMap *>(ctx);
+    spp::memory_usage_info mu = m->memory_usage();
+    EXPECT_EQ(used, mu.total() - mu.slack_bytes);
+    EXPECT_GT(needed, 0u);
+    ++s_budget_calls;
+    if (m->empty())
+        return spp::budget_refuse;
+    for (size_t n = m->size() / 4 + 1; n; --n)
+        m->erase(m->begin());
+    return spp::budget_evicted;
+}
+
+static spp::memory_budget_action AllowAll(void *, size_t, size_t)
+{
+    ++s_budget_calls;
+    return spp::budget_allow;
+}
+
+TEST(HashtableTest, MemoryBudget)
+{
+    BudgetMap m;
+    for (int i = 0; i < 1000; ++i)
+        m[i] = i;
+    EXPECT_EQ(m.get_memory_budget(), 0u);
+
+    // without a hook, the insert is refused
+    const size_t budget = m.memory_usage().total() + 1000 * sizeof(BudgetMap::value_type);
+    m.set_memory_budget(budget);
+    int i = 1000;
+    try
+    {
+        for (; i < 100000; ++i)
+            m[i] = i;
+        EXPECT_TRUE(false);
+    }
+    catch (const std::length_error &)
+    {
+    }
+    EXPECT_EQ(m.size(), (size_t)i);
+    EXPECT_EQ(m.count(i), 0u);
+    spp::memory_usage_info mu = m.memory_usage();
+    EXPECT_LE(mu.total() - mu.slack_bytes, budget);
+
+    // evicting items makes room
+    m.set_memory_budget(budget, EvictSome, &m);
+    for (i = 0; i < 100000; ++i)
+    {
+        m[i + 100000] = i;
+        EXPECT_EQ(m[i + 100000], i);
+        mu = m.memory_usage();
+        EXPECT_LE(mu.total() - mu.slack_bytes, budget);
+    }
+    EXPECT_GT(s_budget_calls, 0);
+    EXPECT_GT(m.size(), 1000u);
+
+    // a copy keeps the budget, but not the hook evicting from m
+    {
+        BudgetMap m2(m);
+        EXPECT_EQ(m2.get_memory_budget(), budget);
+        const size_t num_items = m.size();
+        try
+        {
+            for (i = 0; i < 100000; ++i)
+                m2[i + 200000] = i;
+            EXPECT_TRUE(false);
+        }
+        catch (const std::length_error &)
+        {
+        }
+        EXPECT_EQ(m.size(), num_items);
+    }
+
+    // and so does a smaller budget, set later
+    m.set_memory_budget(budget / 4, EvictSome, &m);
+    m.insert(BudgetMap::value_type(-1, -1));
+    EXPECT_EQ(m[-1], -1);
+    EXPECT_LE(m.memory_usage().total(), budget / 4 + budget / 8);
+
+    // or going over it
+    s_budget_calls = 0;
+    m.set_memory_budget(budget, AllowAll);
+    for (i = 0; i < 100000; ++i)
+        m[i] = i;
+    EXPECT_GT(s_budget_calls, 0);
+    EXPECT_GT(m.memory_usage().total(), budget);
+
+    m.set_memory_budget(0);
+    m.clear();
+    EXPECT_EQ(m.get_memory_budget(), 0u);
+    for (i = 0; i < 100000; ++i)
+        m[i] = i;
+    EXPECT_EQ(m.size(), 100000u);
+}
+
+TEST(HashtableTest, IncrementalResize)
+{
+    sparse_hash_map<int, int> ht;
+    int n = 0;
+    while (n < 5000)
+        ht[n++] = 0;
+    ht.set_incremental_resize(1);
+    EXPECT_EQ(ht.get_incremental_resize(), 1u);
+
+    // fill until a resize starts, it then completes over the next inserts
+    while (!ht.resize_in_progress())
+        ht[n++] = 0;
+    const size_t num_buckets = ht.bucket_count();
+    int started = n;
+    while (ht.resize_in_progress())
+        ht[n++] = 0;
+    EXPECT_GT(n - started, 1);
+    EXPECT_EQ(ht.bucket_count(), num_buckets);
+
+    // lookups, erases and copies see both tables while resizing
+    while (!ht.resize_in_progress())
+        ht[n++] = 0;
+    EXPECT_EQ(ht.size(), (size_t)n);
+    EXPECT_EQ(ht.erase(0), 1u);
+    EXPECT_EQ(ht.erase(0), 0u);
+    EXPECT_EQ(ht.count(1), 1u);
+    EXPECT_TRUE(ht.find(2) != ht.end());
+    EXPECT_FALSE(ht.insert(std::make_pair(3, 1)).second);
+
+    // at() or find() move the item they find in the old table, which
+    // invalidates the references to it
+    const sparse_hash_map<int, int> &ht_const = ht;
+    bool moved = false;
+    for (int i = 4; i < n && !moved; ++i)
+    {
+        const int *before = &ht_const.find(i)->second;
+        int &after = ht.at(i);
+        moved = before != &after;
+        EXPECT_EQ(after, 0);
+    }
+    EXPECT_TRUE(moved);
+
+    sparse_hash_map<int, int> copy(ht);
+    EXPECT_EQ(copy.size(), (size_t)(n - 1));
+    EXPECT_EQ(copy.get_incremental_resize(), 1u);
+    EXPECT_FALSE(copy.resize_in_progress());
+    for (int i = 1; i < n; ++i)
+        EXPECT_EQ(copy.count(i), 1u);
+
+    // const lookups and iterators see both tables, without moving anything
+    EXPECT_TRUE(ht.resize_in_progress());
+    const sparse_hash_map<int, int> &cht = ht;
+    std::vector<sparse_hash_map<int, int>::const_iterator> its;
+    for (int i = 1; i < n; ++i)
+    {
+        its.push_back(cht.find(i));
+        EXPECT_TRUE(its.back() != cht.end() && its.back()->first == i);
+    }
+    EXPECT_TRUE(cht.find(0) == cht.end());
+    for (int i = 1; i < n; ++i)
+        EXPECT_TRUE(its[i - 1] == cht.find(i));
+    EXPECT_EQ((int)std::distance(cht.begin(), cht.end()), n - 1);
+    EXPECT_EQ((int)std::distance(ht.begin(), ht.end()), n - 1);
+    std::set<int> keys;
+    for (sparse_hash_map<int, int>::const_iterator it = cht.find(1); it != cht.end(); ++it)
+        keys.insert(it->first);
+    for (sparse_hash_map<int, int>::const_iterator it = cht.begin(); it != cht.end(); ++it)
+        keys.insert(it->first);
+    EXPECT_EQ((int)keys.size(), n - 1);
+    EXPECT_TRUE(ht.resize_in_progress());
+
+    // erasing through iterators, from both tables
+    for (sparse_hash_map<int, int>::iterator it = ht.begin(); it != ht.end(); )
+    {
+        if (it->first % 2)
+            it = ht.erase(it);
+        else
+            ++it;
+    }
+    EXPECT_TRUE(ht.resize_in_progress());
+    EXPECT_EQ(ht.size(), (size_t)(n - 1) / 2);
+    for (int i = 1; i < n; ++i)
+        EXPECT_EQ(ht.count(i), i % 2 ? 0u : 1u);
+    ht.erase(ht.begin(), ht.end());
+    EXPECT_TRUE(ht.empty());
+
+    // shrinking after many erases is incremental as well
+    for (int i = 0; i < n; ++i)
+        ht[i] = i;
+    ht.set_incremental_resize(0);                  // finishes the resize
+    ht.set_incremental_resize(1);
+    const size_t full_buckets = ht.bucket_count();
+    for (int i = 10; i < n; ++i)
+        ht.erase(i);
+    ht[n] = n;                                     // considers shrinking
+    EXPECT_LT(ht.bucket_count(), full_buckets);
+    EXPECT_TRUE(ht.resize_in_progress());
+    EXPECT_EQ(ht.size(), 11u);
+    for (int i = 0; i < 10; ++i)
+        EXPECT_EQ(ht.count(i), 1u);
+    EXPECT_EQ(ht.count(n), 1u);
+}
+
+#ifdef SPP_PARALLEL_RESIZE
+TEST(HashtableTest, ParallelResize)
+{
+    sparse_hash_map<int, int> ht;
+    ht.set_resize_threads(4);
+    EXPECT_EQ(ht.get_resize_threads(), 4u);
+
+    // large enough for the last resizes to use all the threads
+    const int n = 300000;
+    for (int i = 0; i < n; ++i)
+        ht[i * 7] = i;
+    EXPECT_EQ(ht.size(), (size_t)n);
+    for (int i = 0; i < n; ++i)
+    {
+        sparse_hash_map<int, int>::iterator it = ht.find(i * 7);
+        EXPECT_TRUE(it != ht.end() && it->second == i);
+    }
+    EXPECT_TRUE(ht.find(1) == ht.end());
+
+    sparse_hash_set<std::string> s;
+    s.set_resize_threads(3);
+    s.resize(100000);
+    for (int i = 0; i < 100000; ++i)
+        s.insert(std::to_string(i));
+    s.resize(400000);
+    EXPECT_EQ(s.size(), 100000u);
+    for (int i = 0; i < 100000; ++i)
+        EXPECT_EQ(s.count(std::to_string(i)), 1u);
+}
+
+TEST(HashtableTest, ParallelBuild)
+{
+    // with duplicates: as with insert(), the first one of a key stays
+    const int n = 300000;
+    std::vector<std::pair<int, int> > items;
+    for (int i = 0; i < n; ++i)
+        items.push_back(std::make_pair(i * 7, i));
+    for (int i = 0; i < n; i += 3)
+        items.push_back(std::make_pair(i * 7, -1));
+
+    sparse_hash_map<int, int> ht;
+    ht.parallel_build(items.begin(), items.end(), 4);
+    EXPECT_EQ(ht.size(), (size_t)n);
+    for (int i = 0; i < n; ++i)
+    {
+        sparse_hash_map<int, int>::iterator it = ht.find(i * 7);
+        EXPECT_TRUE(it != ht.end() && it->second == i);
+    }
+    EXPECT_TRUE(ht.find(1) == ht.end());
+    ht[1] = 1;
+    EXPECT_EQ(ht.size(), (size_t)n + 1);
+
+    // not empty: same as insert()
+    ht.parallel_build(items.begin(), items.begin() + 10, 4);
+    EXPECT_EQ(ht.size(), (size_t)n + 1);
+
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100000; ++i)
+        keys.push_back(std::to_string(i % 70000));
+    sparse_hash_set<std::string> s;
+    s.parallel_build(keys.begin(), keys.end(), 3);
+    EXPECT_EQ(s.size(), 70000u);
+    for (int i = 0; i < 70000; ++i)
+        EXPECT_EQ(s.count(std::to_string(i)), 1u);
+    sparse_hash_set<std::string> s2(keys.begin(), keys.end());
+    EXPECT_TRUE(s == s2);
+
+    // the range is copied, also when parallel_build() falls back on insert()
+    sparse_hash_set<std::string> s3;
+    s3.parallel_build(keys.begin(), keys.end(), 1);
+    EXPECT_TRUE(s3 == s2);
+    for (int i = 0; i < 100000; ++i)
+        EXPECT_EQ(keys[i], std::to_string(i % 70000));
+}
+
+TEST(HashtableTest, ParallelMap)
+{
+    typedef spp::parallel_sparse_hash_map<int, int> Map;
+    Map m;
+    EXPECT_EQ(Map::num_shards, 16u);
+
+    // each thread inserts, and erases one third of, its own keys
+    const int num_threads = 8, n = 20000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t)
+        threads.push_back(std::thread([&m, t, n]() {
+            for (int i = 0; i < n; ++i)
+            {
+                const int key = i * num_threads + t;
+                m.try_emplace(key, i);
+                m.insert_or_assign(key, i + 1);
+                if (i % 3 == 0)
+                    EXPECT_EQ(m.erase(key), 1u);
+            }
+        }));
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+
+    const size_t expected = (size_t)num_threads * (n - (n + 2) / 3);
+    EXPECT_EQ(m.size(), expected);
+    EXPECT_EQ((size_t)std::distance(m.begin(), m.end()), expected);
+    for (int key = 0; key < num_threads * n; ++key)
+    {
+        const int i = key / num_threads;
+        EXPECT_EQ(m.count(key), (i % 3) ? 1u : 0u);
+        if (i % 3)
+            EXPECT_EQ(m.at(key), i + 1);
+    }
+
+    // the keys are spread over the shards
+    for (size_t i = 0; i < Map::num_shards; ++i)
+        EXPECT_GT(m.get_inner(i).size(), expected / Map::num_shards / 2);
+
+    Map copy(m);
+    EXPECT_TRUE(copy == m);
+    copy[-1] = 1;
+    EXPECT_TRUE(copy != m);
+    EXPECT_EQ(copy.find(-1)->second, 1);
+    EXPECT_TRUE(copy.find(-2) == copy.end());
+
+    std::stringstream ss;
+    EXPECT_TRUE(m.serialize(Map::NopointerSerializer(), &ss));
+    Map read;
+    EXPECT_TRUE(read.unserialize(Map::NopointerSerializer(), &ss));
+    EXPECT_TRUE(read == m);
+
+    for (Map::iterator it = copy.begin(); it != copy.end(); )
+        it = (it->first % 2) ? copy.erase(it) : ++it;
+    for (Map::const_iterator it = copy.cbegin(); it != copy.cend(); ++it)
+        EXPECT_EQ(it->first % 2, 0);
+    copy.swap(read);
+    EXPECT_TRUE(copy == m);
+    copy.clear();
+    EXPECT_TRUE(copy.empty());
+
+    // a single shard
+    spp::parallel_sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                                  SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                                  spp::quadratic_probing, 0> one;
+    for (int i = 0; i < 1000; ++i)
+        one[i] = i;
+    EXPECT_EQ(one.get_inner(0).size(), 1000u);
+    EXPECT_EQ(one.memory_usage().total(), one.get_inner(0).memory_usage().total());
+}
+
+template <size_t N>
+static void TestLockingOperations()
+{
+    typedef spp::parallel_sparse_hash_map<int, int, spp::spp_hash<int>, std::equal_to<int>,
+                                          SPP_DEFAULT_ALLOCATOR<std::pair<const int, int> >,
+                                          spp::quadratic_probing, N> Map;
+    typedef typename Map::value_type value_type;
+    Map m;
+
+    // all the threads count the same keys
+    const int num_threads = 4, n = 10000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t)
+        threads.push_back(std::thread([&m, n]() {
+            for (int i = 0; i < n; ++i)
+                m.try_emplace_l(i % 1000, [](value_type &v) { ++v.second; }, 1);
+        }));
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    EXPECT_EQ(m.size(), 1000u);
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_EQ(m.at(i), num_threads * n / 1000);
+
+    EXPECT_TRUE(m.modify_if(5, [](value_type &v) { v.second = -5; }));
+    EXPECT_FALSE(m.modify_if(1000, [](value_type &v) { v.second = -5; }));
+    int val = 0;
+    EXPECT_TRUE(m.if_contains(5, [&val](const value_type &v) { val = v.second; }));
+    EXPECT_EQ(val, -5);
+    EXPECT_FALSE(m.if_contains(-1, [&val](const value_type &v) { val = v.second; }));
+
+    EXPECT_FALSE(m.erase_if(5, [](value_type &v) { return v.second > 0; }));
+    EXPECT_TRUE(m.erase_if(5, [](value_type &v) { return v.second < 0; }));
+    EXPECT_FALSE(m.erase_if(5, [](value_type &) { return true; }));
+    EXPECT_EQ(m.count(5), 0u);
+
+    m.for_each_m([](value_type &v) { v.second = v.first; });
+    long sum = 0;
+    m.for_each([&sum](const value_type &v) { EXPECT_EQ(v.first, v.second); sum += v.second; });
+    EXPECT_EQ(sum, 999L * 1000 / 2 - 5);
+}
+
+TEST(HashtableTest, ParallelMapLocking)
+{
+    TestLockingOperations<4>();
+    TestLockingOperations<0>();     // one map, with its mutex
+}
+
+TEST(HashtableTest, SnapshotMap)
+{
+    typedef spp::snapshot_sparse_hash_map<int, int> Map;
+    Map m;
+
+    m.insert(std::make_pair(1, 1));
+    m.insert_or_assign(2, 2);
+    EXPECT_EQ(m.pending(), 2u);
+    {
+        Map::reader r(m);
+        EXPECT_TRUE(r->empty());             // not published yet
+        EXPECT_EQ(m.writer_view().size(), 2u);
+    }
+    m.publish();
+    {
+        Map::reader r(m);
+        EXPECT_EQ(r->size(), 2u);
+        EXPECT_EQ(r->at(2), 2);
+    }
+
+    // the readers always see a published version: key i is there with
+    // value i in the versions holding i + 1 keys
+    const int n = 20000;
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+        readers.push_back(std::thread([&m, &done, &errors]() {
+            while (!done.load())
+            {
+                Map::reader r(m);
+                int last = (int)r->size() - 1;
+                Map::submap_type::const_iterator it = r->find(last);
+                if (last >= 2 && (it == r->end() || it->second != last))
+                    ++errors;
+            }
+        }));
+    for (int i = 3; i < n; ++i)
+    {
+        m.insert_or_assign(0, 0);
+        m.insert(std::make_pair(i - 1, i - 1));
+        if (i % 100 == 0)
+            m.publish();
+    }
+    m.publish();
+    done.store(true);
+    for (size_t t = 0; t < readers.size(); ++t)
+        readers[t].join();
+    EXPECT_EQ(errors.load(), 0);
+    EXPECT_EQ(m.pending(), 0u);
+
+    // both copies are up to date after a publish
+    m.erase(5);
+    m.publish();
+    m.publish();
+    EXPECT_TRUE(m.writer_view().count(5) == 0);
+    {
+        Map::reader r(m);
+        EXPECT_TRUE(*r == m.writer_view());
+    }
+
+    m.clear();
+    m.insert(std::make_pair(7, 7));
+    m.publish();
+    {
+        Map::reader r(m);
+        EXPECT_EQ(r->size(), 1u);
+        EXPECT_EQ(r->count(7), 1u);
+    }
+}
+
+TEST(HashtableTest, OptimisticMap)
+{
+    typedef spp::optimistic_sparse_hash_map<int, int> Map;
+    Map m;
+    int v = 0;
+
+    EXPECT_FALSE(m.find(1, v));
+    EXPECT_TRUE(m.insert(std::make_pair(1, 10)));
+    EXPECT_FALSE(m.insert(std::make_pair(1, 11)));
+    EXPECT_TRUE(m.find(1, v));
+    EXPECT_EQ(v, 10);
+    EXPECT_FALSE(m.insert_or_assign(1, 12));
+    EXPECT_TRUE(m.find(1, v));
+    EXPECT_EQ(v, 12);
+    m.clear();
+
+    // the writer resizes incrementally, so the lookups don't wait for a
+    // whole rehash
+    EXPECT_EQ(m.writer_view().get_incremental_resize(), (size_t)SPP_OPTIMISTIC_RESIZE_STEP);
+    bool resized = false;
+    for (int i = 0; i < 1000; ++i)
+    {
+        m.insert(std::make_pair(i, i));
+        resized = resized || m.writer_view().resize_in_progress();
+    }
+    EXPECT_TRUE(resized);
+    m.clear();
+
+    // the readers see each key either missing or with one of the values
+    // the writer stores, while it inserts, assigns, erases and resizes
+    const int n = 20000;
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+        readers.push_back(std::thread([&m, &done, &errors, t]() {
+            int k = t;
+            while (!done.load())
+            {
+                int val;
+                k = (k + 7919) % n;
+                if (m.find(k, val) && val != k * 3 && val != k * 5)
+                    ++errors;
+            }
+        }));
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < n; ++i)
+            m.insert_or_assign(i, i * 3);
+        for (int i = 0; i < n; i += 2)
+            m.insert_or_assign(i, i * 5);
+        for (int i = 0; i < n; i += 3)
+            m.erase(i);
+        if (round == 1)
+            m.clear();
+    }
+    done.store(true);
+    for (size_t t = 0; t < readers.size(); ++t)
+        readers[t].join();
+    EXPECT_EQ(errors.load(), 0);
+
+    EXPECT_EQ(m.size(), (size_t)(n - (n + 2) / 3));
+    EXPECT_FALSE(m.contains(3));
+    EXPECT_TRUE(m.find(4, v));
+    EXPECT_EQ(v, 20);
+    EXPECT_TRUE(m.find(5, v));
+    EXPECT_EQ(v, 15);
+
+    m.reclaim();
+    m.clear();
+    EXPECT_TRUE(m.empty());
+    EXPECT_FALSE(m.contains(4));
+}
+#endif
+
 TYPED_TEST(HashtableAllTest, ConstIterators)
 {
     this->ht_.insert(this->UniqueObject(1));